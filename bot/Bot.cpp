@@ -0,0 +1,574 @@
+//
+// Bot.cpp
+//
+
+#include "Bot.hpp"
+#include "../common/network/Utils.hpp"
+#include "../common/network/Command.hpp"
+#include "../common/network/JsonScanner.hpp"
+#include "../common/Logger.hpp"
+#include "../server/version.hpp"
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <boost/make_shared.hpp>
+
+namespace network {
+
+    using namespace boost::posix_time;
+
+    namespace {
+        const ptime EPOCH = microsec_clock::universal_time();
+    }
+
+    BotOptions::BotOptions() :
+    host("127.0.0.1"),
+    port(39390),
+    position_interval(100),
+    chat_interval(10000),
+    step(8),
+    area(500),
+    udp(true)
+    {
+    }
+
+    BotStats::BotStats() :
+    measuring(false),
+    connected(0),
+    logged_in(0),
+    udp_position(0),
+    disconnected(0),
+    refused_crowded(0),
+    refused_version(0),
+    positions_sent(0),
+    positions_received(0),
+    positions_unmatched(0),
+    keyframe_requests(0),
+    chats_sent(0),
+    chats_received(0)
+    {
+    }
+
+    void BotDirectory::Add(uint32_t user_id, Bot* bot)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(mutex_);
+        bots_[user_id] = bot;
+    }
+
+    bool BotDirectory::FindSentTime(uint32_t user_id, const PlayerPosition& position, uint64_t* time) const
+    {
+        boost::shared_lock<boost::shared_mutex> lock(mutex_);
+        auto it = bots_.find(user_id);
+        return it != bots_.end() && it->second->FindSentTime(position, time);
+    }
+
+    Bot::BotSession::BotSession(boost::asio::io_service& io_service,
+            const tcp::endpoint& endpoint, const udp::endpoint& udp_endpoint) :
+        Session(io_service),
+        endpoint_(endpoint),
+        socket_udp_(io_service, udp::endpoint(udp::v4(), 0)),
+        udp_endpoint_(udp_endpoint),
+        udp_test_received_(false),
+        udp_key_ready_(false),
+        udp_probe_sent_(false),
+        udp_position_(false)
+    {
+        set_udp_port(socket_udp_.local_endpoint().port());
+    }
+
+    Bot::BotSession::~BotSession()
+    {
+    }
+
+    void Bot::BotSession::Start()
+    {
+        socket_tcp_.async_connect(endpoint_,
+                strand_.wrap(boost::bind(&BotSession::Connect, this,
+                        boost::asio::placeholders::error)));
+
+        socket_udp_.async_receive_from(
+            boost::asio::buffer(receive_buf_udp_, BOT_UDP_MAX_RECEIVE_LENGTH), sender_endpoint_,
+            strand_.wrap(boost::bind(&BotSession::ReceiveUDP, this,
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred)));
+    }
+
+    void Bot::BotSession::Close()
+    {
+        Session::Close();
+        socket_udp_.close();
+    }
+
+    void Bot::BotSession::Connect(const boost::system::error_code& error)
+    {
+        if (error) {
+            FatalError();
+            return;
+        }
+
+        // Nagleアルゴリズムを無効化
+        socket_tcp_.set_option(boost::asio::ip::tcp::no_delay(true));
+
+        boost::asio::async_read_until(socket_tcp_, receive_buf_, NETWORK_UTILS_DELIMITOR,
+                strand_.wrap(boost::bind(&BotSession::ReceiveTCP, shared_from_this(),
+                        boost::asio::placeholders::error)));
+    }
+
+    void Bot::BotSession::SendUDP(const Command& command)
+    {
+        auto holder = std::make_shared<std::string>(SerializeDatagram(command, DATAGRAM_SENDER_CLIENT));
+        socket_udp_.async_send_to(
+            boost::asio::buffer(holder->data(), holder->size()), udp_endpoint_,
+            strand_.wrap(boost::bind(&BotSession::WriteUDP, this,
+                boost::asio::placeholders::error, holder)));
+    }
+
+    void Bot::BotSession::set_udp_key_ready()
+    {
+        udp_key_ready_ = true;
+        StartUDPProbe();
+    }
+
+    void Bot::BotSession::EnableUDPPosition()
+    {
+        udp_position_ = true;
+    }
+
+    bool Bot::BotSession::udp_position() const
+    {
+        return udp_position_;
+    }
+
+    boost::asio::io_service::strand& Bot::BotSession::strand()
+    {
+        return strand_;
+    }
+
+    void Bot::BotSession::StartUDPProbe()
+    {
+        if (!udp_test_received_ || !udp_key_ready_ || udp_probe_sent_) {
+            return;
+        }
+        udp_probe_sent_ = true;
+
+        for (int i = 0; i < BOT_UDP_PROBE_PACKET_TIME; i++) {
+            SendUDP(ServerStartUDPPosition());
+        }
+    }
+
+    void Bot::BotSession::FetchUDP(const std::string& buffer)
+    {
+        if (buffer == UDP_TEST_PACKET_MESSAGE) {
+            udp_test_received_ = true;
+            StartUDPProbe();
+            return;
+        }
+
+        header::CommandHeader header;
+        std::string body;
+        if (DeserializeDatagram(buffer, DATAGRAM_SENDER_SERVER, &header, &body) &&
+            header == header::ClientUpdatePlayerPositionBatch && on_receive_) {
+            (*on_receive_)(Command(header, body, shared_from_this()));
+        }
+    }
+
+    void Bot::BotSession::ReceiveUDP(const boost::system::error_code& error, size_t bytes_recvd)
+    {
+        // サーバー以外からのパケットは無視する
+        if (bytes_recvd > 0 && sender_endpoint_ == udp_endpoint_) {
+            FetchUDP(std::string(receive_buf_udp_, bytes_recvd));
+        }
+        if (!error) {
+            socket_udp_.async_receive_from(
+                boost::asio::buffer(receive_buf_udp_, BOT_UDP_MAX_RECEIVE_LENGTH), sender_endpoint_,
+                strand_.wrap(boost::bind(&BotSession::ReceiveUDP, this,
+                    boost::asio::placeholders::error,
+                    boost::asio::placeholders::bytes_transferred)));
+        }
+    }
+
+    void Bot::BotSession::WriteUDP(const boost::system::error_code& error, std::shared_ptr<std::string> holder)
+    {
+    }
+
+    Bot::Bot(boost::asio::io_service& io_service, int index,
+            const std::string& public_key, const std::string& private_key,
+            const tcp::endpoint& endpoint, const udp::endpoint& udp_endpoint,
+            const BotOptions& options, BotStats* stats, BotDirectory* directory) :
+        index_(index),
+        public_key_(public_key),
+        options_(options),
+        stats_(*stats),
+        directory_(*directory),
+        session_(boost::make_shared<BotSession>(io_service, endpoint, udp_endpoint)),
+        move_timer_(io_service),
+        chat_timer_(io_service),
+        random_(static_cast<uint32_t>(index) * 2654435761u + 1),
+        logged_in_(false),
+        stopping_(false),
+        start_time_(0),
+        chat_count_(0),
+        position_keyframe_requested_(false),
+        sent_count_(0)
+    {
+        auto& encrypter = session_->encrypter();
+        encrypter.SetPublicKey(public_key);
+        encrypter.SetPrivateKey(private_key);
+
+        // 歩き始める位置
+        boost::uniform_int<> area(-options_.area, options_.area);
+        position_.x = static_cast<int16_t>(area(random_));
+        position_.z = static_cast<int16_t>(area(random_));
+    }
+
+    Bot::~Bot()
+    {
+    }
+
+    void Bot::Start()
+    {
+        start_time_ = Now();
+        session_->set_on_receive(std::make_shared<CallbackFunc>(
+            [this](Command c) {
+                Receive(c);
+            }));
+        session_->Start();
+    }
+
+    void Bot::Stop()
+    {
+        session_->strand().post([this](){
+            stopping_ = true;
+            move_timer_.cancel();
+            chat_timer_.cancel();
+            session_->Close();
+        });
+    }
+
+    bool Bot::logged_in() const
+    {
+        return logged_in_;
+    }
+
+    bool Bot::FindSentTime(const PlayerPosition& position, uint64_t* time) const
+    {
+        boost::mutex::scoped_lock lock(sent_mutex_);
+
+        // 新しいものから探す
+        size_t count = std::min<size_t>(sent_count_, BOT_SENT_POSITION_HISTORY);
+        for (size_t i = 1; i <= count; i++) {
+            const auto& sent = sent_positions_[(sent_count_ - i) % BOT_SENT_POSITION_HISTORY];
+            if (sent.position.x == position.x && sent.position.y == position.y &&
+                sent.position.z == position.z && sent.position.theta == position.theta &&
+                sent.position.vy == position.vy) {
+                *time = sent.time;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint64_t Bot::Now()
+    {
+        return (microsec_clock::universal_time() - EPOCH).total_microseconds();
+    }
+
+    void Bot::Receive(const Command& command)
+    {
+        auto now = Now();
+
+        switch (command.header()) {
+
+        // クライアント情報要求
+        case header::ClientRequestedClientInfo:
+        {
+            stats_.connected++;
+            // 以降は長さ付きフレームで送る
+            session_->SendAndEnableLengthFraming(ServerReceiveClientInfo(
+                    Encrypter::GetHash(public_key_),
+                    static_cast<uint16_t>(MMO_PROTOCOL_VERSION),
+                    session_->udp_port()));
+            session_->Send(ServerRequestedFullServerInfo());
+        }
+        break;
+
+        // 公開鍵要求
+        case header::ClientRequestedPublicKey:
+        {
+            session_->Send(ServerReceivePublicKey(public_key_));
+        }
+        break;
+
+        // 共通鍵を受信
+        case header::ClientReceiveCommonKey:
+        {
+            std::string key;
+            std::string sign;
+            unsigned int user_id;
+            Utils::Deserialize(command.body(), &key, &sign, &user_id);
+
+            session_->set_id(user_id);
+            session_->encrypter().SetCryptedCommonKey(key);
+            session_->Send(ServerStartEncryptedSession(session_->encrypter().GetCommonKeyProof()));
+        }
+        break;
+
+        // 長さ付きフレーム開始
+        case header::ClientStartLengthFraming:
+        {
+            session_->EnableReceiveLengthFraming();
+        }
+        break;
+
+        // 暗号化通信開始
+        case header::ClientStartEncryptedSession:
+        {
+            // 新規の鍵ではここで初めてユーザーIDが決まる
+            unsigned int user_id;
+            Utils::Deserialize(command.body(), &user_id);
+            session_->set_id(user_id);
+
+            session_->EnableEncryption();
+            LogIn();
+        }
+        break;
+
+        // UDPでの位置の送受信開始
+        case header::ClientStartUDPPosition:
+        {
+            session_->EnableUDPPosition();
+            stats_.udp_position++;
+        }
+        break;
+
+        case header::ClientUpdatePlayerPosition:
+        {
+            PlayerPosition pos;
+            uint32_t user_id;
+            Utils::Deserialize(command.body(), &user_id, &pos.x, &pos.y, &pos.z, &pos.theta, &pos.vy);
+            ReceivePosition(user_id, pos, now);
+        }
+        break;
+
+        case header::ClientUpdatePlayerPositionBatch:
+        {
+            std::string entries;
+            Utils::Deserialize(command.body(), &entries);
+            ReceivePositionBatch(entries, now);
+        }
+        break;
+
+        case header::ClientUpdatePlayerPositionDelta:
+        {
+            std::string data;
+            Utils::Deserialize(command.body(), &data);
+
+            std::vector<PositionDeltaEntry> entries;
+            if (position_decoder_.Decode(data, &entries)) {
+                position_keyframe_requested_ = false;
+                BOOST_FOREACH(const auto& entry, entries) {
+                    ReceivePosition(entry.first, entry.second, now);
+                }
+            } else if (!position_keyframe_requested_) {
+                // 基準値を取りこぼしたので送り直してもらう
+                session_->Send(ServerRequestedPositionKeyframe());
+                position_keyframe_requested_ = true;
+                stats_.keyframe_requests++;
+            }
+        }
+        break;
+
+        case header::ClientReceiveJSON:
+        {
+            std::string info_json, message_json;
+            Utils::Deserialize(command.body(), &info_json, &message_json);
+            ReceiveChat(message_json, now);
+        }
+        break;
+
+        // 接続拒否
+        case header::ClientReceiveServerCrowdedError:
+        {
+            stats_.refused_crowded++;
+        }
+        break;
+
+        case header::ClientReceiveUnsupportVersionError:
+        {
+            stats_.refused_version++;
+        }
+        break;
+
+        // 切断
+        case header::FatalConnectionError:
+        case header::UserFatalConnectionError:
+        {
+            if (!stopping_) {
+                stats_.disconnected++;
+                Logger::Error("Bot %d disconnected", index_);
+            }
+            logged_in_ = false;
+            move_timer_.cancel();
+            chat_timer_.cancel();
+        }
+        break;
+
+        default:
+        break;
+        }
+    }
+
+    void Bot::LogIn()
+    {
+        auto data = Utils::Serialize(static_cast<uint16_t>(NAME), (boost::format("bot%05d") % index_).str());
+        if (!options_.model_name.empty()) {
+            data += Utils::Serialize(static_cast<uint16_t>(MODEL_NAME), options_.model_name);
+        }
+        session_->Send(ServerReceiveAccountInitializeData(data));
+
+        directory_.Add(static_cast<uint32_t>(session_->id()), this);
+        logged_in_ = true;
+        stats_.logged_in++;
+        stats_.login_time.Record(Now() - start_time_);
+
+        if (options_.udp) {
+            session_->set_udp_key_ready();
+        }
+
+        // 全員が同時に送らないように最初の送信をばらけさせる
+        if (options_.position_interval > 0) {
+            ScheduleMove(boost::uniform_int<>(0, options_.position_interval)(random_));
+        }
+        if (options_.chat_interval > 0) {
+            ScheduleChat(boost::uniform_int<>(0, options_.chat_interval)(random_));
+        }
+    }
+
+    void Bot::ScheduleMove(int delay)
+    {
+        move_timer_.expires_from_now(milliseconds(delay));
+        move_timer_.async_wait(session_->strand().wrap(
+                boost::bind(&Bot::Move, this, boost::asio::placeholders::error)));
+    }
+
+    void Bot::Move(const boost::system::error_code& error)
+    {
+        if (error || stopping_ || !logged_in_) {
+            return;
+        }
+
+        // 範囲内で毎回少しずつ違う位置へ歩く
+        boost::uniform_int<> step(-options_.step, options_.step);
+        int dx, dz;
+        do {
+            dx = step(random_);
+            dz = step(random_);
+        } while (dx == 0 && dz == 0);
+
+        position_.x = static_cast<int16_t>(std::max(-options_.area, std::min(options_.area, position_.x + dx)));
+        position_.z = static_cast<int16_t>(std::max(-options_.area, std::min(options_.area, position_.z + dz)));
+        position_.theta = static_cast<uint8_t>(std::atan2(static_cast<double>(dz), static_cast<double>(dx)) / M_PI * 128);
+
+        {
+            boost::mutex::scoped_lock lock(sent_mutex_);
+            auto& sent = sent_positions_[sent_count_ % BOT_SENT_POSITION_HISTORY];
+            sent.position = position_;
+            sent.time = Now();
+            sent_count_++;
+        }
+
+        ServerUpdatePlayerPosition command(position_.x, position_.y, position_.z,
+                position_.theta, static_cast<uint8_t>(position_.vy));
+        if (session_->udp_position()) {
+            session_->SendUDP(command);
+        } else {
+            session_->Send(command);
+        }
+
+        if (stats_.measuring) {
+            stats_.positions_sent++;
+        }
+
+        ScheduleMove(options_.position_interval);
+    }
+
+    void Bot::ScheduleChat(int delay)
+    {
+        chat_timer_.expires_from_now(milliseconds(delay));
+        chat_timer_.async_wait(session_->strand().wrap(
+                boost::bind(&Bot::Chat, this, boost::asio::placeholders::error)));
+    }
+
+    void Bot::Chat(const boost::system::error_code& error)
+    {
+        if (error || stopping_ || !logged_in_) {
+            return;
+        }
+
+        // 送信時刻は受信側で遅延を測るために付ける
+        auto message = (boost::format("{\"body\":\"bot%05d #%d\",\"bot_time\":\"%d\"}")
+                % index_ % ++chat_count_ % Now()).str();
+        session_->Send(ServerReceiveJSON(message));
+
+        if (stats_.measuring) {
+            stats_.chats_sent++;
+        }
+
+        ScheduleChat(options_.chat_interval);
+    }
+
+    void Bot::ReceivePosition(uint32_t user_id, const PlayerPosition& position, uint64_t now)
+    {
+        if (!stats_.measuring || user_id == static_cast<uint32_t>(session_->id())) {
+            return;
+        }
+
+        stats_.positions_received++;
+
+        uint64_t sent_time;
+        if (directory_.FindSentTime(user_id, position, &sent_time) && now >= sent_time) {
+            stats_.position_latency.Record(now - sent_time);
+        } else {
+            // 範囲に入った時の現在位置など、最近送ったものではない
+            stats_.positions_unmatched++;
+        }
+    }
+
+    void Bot::ReceivePositionBatch(const std::string& entries, uint64_t now)
+    {
+        size_t offset = 0;
+        while (offset < entries.size()) {
+            PlayerPosition pos;
+            uint32_t user_id;
+            auto size = Utils::Deserialize(entries.substr(offset),
+                &user_id, &pos.x, &pos.y, &pos.z, &pos.theta, &pos.vy);
+            if (size == 0) {
+                break;
+            }
+            offset += size;
+            ReceivePosition(user_id, pos, now);
+        }
+    }
+
+    void Bot::ReceiveChat(const std::string& message, uint64_t now)
+    {
+        if (!stats_.measuring) {
+            return;
+        }
+
+        stats_.chats_received++;
+
+        JsonScanner scanner(message);
+        JsonScanner::Value key, value;
+        while (scanner.NextMember(&key, &value)) {
+            std::string time_text;
+            if (key.Equals("bot_time") && value.ToString(&time_text)) {
+                auto sent_time = std::strtoull(time_text.c_str(), nullptr, 10);
+                if (now >= sent_time) {
+                    stats_.chat_latency.Record(now - sent_time);
+                }
+                break;
+            }
+        }
+    }
+
+}
@@ -0,0 +1,189 @@
+//
+// Bot.hpp
+//
+
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <unordered_map>
+#include <boost/random.hpp>
+#include "../common/network/Session.hpp"
+#include "../common/network/PositionDelta.hpp"
+#include "../server/Metrics.hpp"
+
+#define BOT_UDP_MAX_RECEIVE_LENGTH (2048)
+#define BOT_UDP_PROBE_PACKET_TIME (5)
+#define BOT_SENT_POSITION_HISTORY (64)
+
+namespace network {
+
+    struct BotOptions {
+        BotOptions();
+
+        std::string host;
+        uint16_t port;
+
+        // 0なら送らない
+        int position_interval;
+        int chat_interval;
+
+        // 1回の移動量の上限と、歩き回る範囲の半径
+        int step;
+        int area;
+
+        bool udp;
+        // 空なら送らない
+        std::string model_name;
+    };
+
+    // 全ボットで共有する計測値
+    // 時間はすべてマイクロ秒
+    struct BotStats {
+        BotStats();
+
+        // 計測期間中だけ送受信を数える
+        std::atomic<bool> measuring;
+
+        std::atomic<uint64_t> connected;
+        std::atomic<uint64_t> logged_in;
+        std::atomic<uint64_t> udp_position;
+        std::atomic<uint64_t> disconnected;
+        std::atomic<uint64_t> refused_crowded;
+        std::atomic<uint64_t> refused_version;
+
+        std::atomic<uint64_t> positions_sent;
+        std::atomic<uint64_t> positions_received;
+        std::atomic<uint64_t> positions_unmatched;
+        std::atomic<uint64_t> keyframe_requests;
+
+        std::atomic<uint64_t> chats_sent;
+        std::atomic<uint64_t> chats_received;
+
+        Histogram login_time;
+        Histogram position_latency;
+        Histogram chat_latency;
+    };
+
+    class Bot;
+
+    // ユーザーIDから送信元のボットを引く 受信した位置の遅延を測るのに使う
+    class BotDirectory {
+        public:
+            void Add(uint32_t user_id, Bot* bot);
+            // user_idのボットが最後にpositionを送った時刻
+            bool FindSentTime(uint32_t user_id, const PlayerPosition& position, uint64_t* time) const;
+
+        private:
+            std::unordered_map<uint32_t, Bot*> bots_;
+            mutable boost::shared_mutex mutex_;
+    };
+
+    // 1人分のクライアント
+    // ハンドシェイクからログイン後の歩行とチャットまでを行う
+    // 受信もタイマーもセッションのstrand上で動くので、送信履歴以外はロックしない
+    class Bot {
+        private:
+            class BotSession : public Session {
+                public:
+                    BotSession(boost::asio::io_service& io_service,
+                            const tcp::endpoint& endpoint, const udp::endpoint& udp_endpoint);
+                    ~BotSession();
+
+                    void Start();
+                    void Close();
+                    void SendUDP(const Command& command);
+
+                    // UDPの疎通確認 テストパケットの受信と共通鍵の交換が済んだらサーバーへ送る
+                    void set_udp_key_ready();
+                    void EnableUDPPosition();
+                    bool udp_position() const;
+
+                    boost::asio::io_service::strand& strand();
+
+                private:
+                    void Connect(const boost::system::error_code& error);
+                    void ReceiveUDP(const boost::system::error_code& error, size_t bytes_recvd);
+                    void WriteUDP(const boost::system::error_code& error, std::shared_ptr<std::string> holder);
+                    void FetchUDP(const std::string& buffer);
+                    void StartUDPProbe();
+
+                private:
+                    tcp::endpoint endpoint_;
+                    udp::socket socket_udp_;
+                    udp::endpoint udp_endpoint_;
+                    udp::endpoint sender_endpoint_;
+
+                    char receive_buf_udp_[BOT_UDP_MAX_RECEIVE_LENGTH];
+
+                    bool udp_test_received_;
+                    bool udp_key_ready_;
+                    bool udp_probe_sent_;
+                    bool udp_position_;
+            };
+
+            typedef boost::shared_ptr<BotSession> BotSessionPtr;
+
+        public:
+            Bot(boost::asio::io_service& io_service, int index,
+                    const std::string& public_key, const std::string& private_key,
+                    const tcp::endpoint& endpoint, const udp::endpoint& udp_endpoint,
+                    const BotOptions& options, BotStats* stats, BotDirectory* directory);
+            ~Bot();
+
+            void Start();
+            // strand上で切断する 戻った時点ではまだ閉じていない
+            void Stop();
+
+            bool logged_in() const;
+            bool FindSentTime(const PlayerPosition& position, uint64_t* time) const;
+
+            // 計測に使う単調な時刻
+            static uint64_t Now();
+
+        private:
+            void Receive(const Command& command);
+            void LogIn();
+
+            void ScheduleMove(int delay);
+            void Move(const boost::system::error_code& error);
+            void ScheduleChat(int delay);
+            void Chat(const boost::system::error_code& error);
+
+            void ReceivePosition(uint32_t user_id, const PlayerPosition& position, uint64_t now);
+            void ReceivePositionBatch(const std::string& entries, uint64_t now);
+            void ReceiveChat(const std::string& message, uint64_t now);
+
+        private:
+            int index_;
+            std::string public_key_;
+            const BotOptions& options_;
+            BotStats& stats_;
+            BotDirectory& directory_;
+
+            BotSessionPtr session_;
+            boost::asio::deadline_timer move_timer_;
+            boost::asio::deadline_timer chat_timer_;
+            boost::mt19937 random_;
+
+            std::atomic<bool> logged_in_;
+            bool stopping_;
+            uint64_t start_time_;
+
+            PlayerPosition position_;
+            int chat_count_;
+
+            PositionDeltaDecoder position_decoder_;
+            bool position_keyframe_requested_;
+
+            // 最近送った位置と時刻
+            struct SentPosition {
+                PlayerPosition position;
+                uint64_t time;
+            };
+            SentPosition sent_positions_[BOT_SENT_POSITION_HISTORY];
+            size_t sent_count_;
+            mutable boost::mutex sent_mutex_;
+    };
+
+}
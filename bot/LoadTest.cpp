@@ -0,0 +1,279 @@
+//
+// LoadTest.cpp
+//
+
+#include "LoadTest.hpp"
+#include "../common/network/Encrypter.hpp"
+#include "../common/Logger.hpp"
+#include <fstream>
+#include <sstream>
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+
+namespace network {
+
+    using namespace boost::posix_time;
+
+    namespace {
+
+        void WriteLatency(std::ostream& out, const Histogram& histogram)
+        {
+            out << "{\"count\":" << histogram.count()
+                << ",\"p50_ms\":" << histogram.Percentile(0.5) / 1000.0
+                << ",\"p99_ms\":" << histogram.Percentile(0.99) / 1000.0
+                << ",\"max_ms\":" << histogram.max() / 1000.0 << "}";
+        }
+
+        bool ReadFile(const boost::filesystem::path& path, std::string* data)
+        {
+            std::ifstream ifs(path.string().c_str(), std::ios::binary);
+            if (!ifs) {
+                return false;
+            }
+            data->assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+            return !data->empty();
+        }
+
+        void WriteFile(const boost::filesystem::path& path, const std::string& data)
+        {
+            std::ofstream ofs(path.string().c_str(), std::ios::binary);
+            ofs.write(data.data(), data.size());
+        }
+
+    }
+
+    LoadTestOptions::LoadTestOptions() :
+    bots(10),
+    duration(30),
+    ramp(1000),
+    threads(2),
+    key_directory("keys"),
+    metrics_port(0)
+    {
+    }
+
+    LoadTest::LoadTest(const LoadTestOptions& options) :
+    options_(options),
+    elapsed_(0),
+    server_metrics_(false)
+    {
+    }
+
+    LoadTest::~LoadTest()
+    {
+    }
+
+    void LoadTest::Run()
+    {
+        PrepareKeys();
+
+        tcp::resolver resolver(io_service_);
+        tcp::endpoint endpoint = *resolver.resolve(tcp::resolver::query(options_.bot.host,
+                boost::lexical_cast<std::string>(options_.bot.port)));
+        udp::endpoint udp_endpoint(endpoint.address(), endpoint.port());
+
+        std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(io_service_));
+        boost::thread_group threads;
+        for (int i = 0; i < options_.threads; i++) {
+            threads.create_thread([this](){ io_service_.run(); });
+        }
+
+        // 接続を少しずつ増やす
+        auto interval = microseconds(options_.bots > 0 ? options_.ramp * 1000LL / options_.bots : 0);
+        for (int i = 0; i < options_.bots; i++) {
+            bots_.emplace_back(new Bot(io_service_, i, keys_[i].first, keys_[i].second,
+                    endpoint, udp_endpoint, options_.bot, &stats_, &directory_));
+            bots_.back()->Start();
+            boost::this_thread::sleep(interval);
+        }
+
+        if (!WaitForLogIn()) {
+            Logger::Error("Only %d of %d bots logged in", stats_.logged_in.load(), options_.bots);
+        }
+
+        server_metrics_ = options_.metrics_port > 0 && FetchServerMetrics(&server_begin_);
+
+        auto start_time = microsec_clock::universal_time();
+        stats_.measuring = true;
+        boost::this_thread::sleep(seconds(options_.duration));
+        stats_.measuring = false;
+        elapsed_ = (microsec_clock::universal_time() - start_time).total_microseconds() / 1e6;
+
+        if (server_metrics_) {
+            server_metrics_ = FetchServerMetrics(&server_end_);
+        }
+
+        for (auto it = bots_.begin(); it != bots_.end(); ++it) {
+            (*it)->Stop();
+        }
+        boost::this_thread::sleep(milliseconds(LOAD_TEST_STOP_WAIT_MILLISECONDS));
+
+        work.reset();
+        io_service_.stop();
+        threads.join_all();
+    }
+
+    void LoadTest::PrepareKeys()
+    {
+        boost::filesystem::path directory(options_.key_directory);
+        boost::filesystem::create_directories(directory);
+
+        keys_.resize(options_.bots);
+        std::vector<int> missing;
+        for (int i = 0; i < options_.bots; i++) {
+            auto base = (boost::format("bot%05d") % i).str();
+            if (!ReadFile(directory / (base + ".pub"), &keys_[i].first) ||
+                !ReadFile(directory / (base + ".key"), &keys_[i].second)) {
+                missing.push_back(i);
+            }
+        }
+
+        if (missing.empty()) {
+            return;
+        }
+
+        // 鍵の生成は重いので並列に行い、次回以降のために保存しておく
+        Logger::Info("Generating %d key pairs...", missing.size());
+        std::atomic<size_t> next(0);
+        boost::thread_group threads;
+        for (unsigned int t = 0; t < std::max(1u, boost::thread::hardware_concurrency()); t++) {
+            threads.create_thread([&](){
+                for (size_t n = next++; n < missing.size(); n = next++) {
+                    int i = missing[n];
+                    Encrypter encrypter;
+                    keys_[i].first = encrypter.GetPublicKey();
+                    keys_[i].second = encrypter.GetPrivateKey();
+
+                    auto base = (boost::format("bot%05d") % i).str();
+                    WriteFile(directory / (base + ".pub"), keys_[i].first);
+                    WriteFile(directory / (base + ".key"), keys_[i].second);
+                }
+            });
+        }
+        threads.join_all();
+    }
+
+    bool LoadTest::WaitForLogIn()
+    {
+        auto deadline = microsec_clock::universal_time() + seconds(LOAD_TEST_LOGIN_TIMEOUT_SECONDS);
+        while (microsec_clock::universal_time() < deadline) {
+            if (stats_.logged_in + stats_.disconnected >= static_cast<uint64_t>(options_.bots)) {
+                break;
+            }
+            boost::this_thread::sleep(milliseconds(100));
+        }
+        return stats_.logged_in >= static_cast<uint64_t>(options_.bots);
+    }
+
+    bool LoadTest::FetchServerMetrics(MetricsSample* sample) const
+    {
+        tcp::iostream stream(options_.bot.host, boost::lexical_cast<std::string>(options_.metrics_port));
+        if (!stream) {
+            Logger::Error("Cannot connect to metrics port %d", options_.metrics_port);
+            return false;
+        }
+
+        stream << "GET /metrics HTTP/1.0\r\n\r\n" << std::flush;
+
+        // ヘッダーを読み飛ばしてから "名前{ラベル} 値" の行を読む
+        std::string line;
+        bool body = false;
+        while (std::getline(stream, line)) {
+            if (!line.empty() && line[line.size() - 1] == '\r') {
+                line.erase(line.size() - 1);
+            }
+            if (!body) {
+                body = line.empty();
+                continue;
+            }
+            auto separator = line.rfind(' ');
+            if (line.empty() || line[0] == '#' || separator == std::string::npos) {
+                continue;
+            }
+            (*sample)[line.substr(0, separator)] = std::atof(line.c_str() + separator + 1);
+        }
+        return body;
+    }
+
+    void LoadTest::WriteJSON(std::ostream& out) const
+    {
+        auto per_second = [this](uint64_t count) {
+            return elapsed_ > 0 ? count / elapsed_ : 0;
+        };
+
+        out << "{\"bots\":" << options_.bots
+            << ",\"duration_seconds\":" << elapsed_
+            << ",\"position_interval_ms\":" << options_.bot.position_interval
+            << ",\"chat_interval_ms\":" << options_.bot.chat_interval
+            << ",\"udp\":" << (options_.bot.udp ? "true" : "false");
+
+        out << ",\"sessions\":{\"connected\":" << stats_.connected.load()
+            << ",\"logged_in\":" << stats_.logged_in.load()
+            << ",\"udp_position\":" << stats_.udp_position.load()
+            << ",\"disconnected\":" << stats_.disconnected.load()
+            << ",\"refused_crowded\":" << stats_.refused_crowded.load()
+            << ",\"refused_version\":" << stats_.refused_version.load()
+            << ",\"login\":";
+        WriteLatency(out, stats_.login_time);
+        out << "}";
+
+        out << ",\"positions\":{\"sent\":" << stats_.positions_sent.load()
+            << ",\"received\":" << stats_.positions_received.load()
+            << ",\"unmatched\":" << stats_.positions_unmatched.load()
+            << ",\"keyframe_requests\":" << stats_.keyframe_requests.load()
+            << ",\"sent_per_second\":" << per_second(stats_.positions_sent)
+            << ",\"received_per_second\":" << per_second(stats_.positions_received)
+            << ",\"latency\":";
+        WriteLatency(out, stats_.position_latency);
+        out << "}";
+
+        out << ",\"chat\":{\"sent\":" << stats_.chats_sent.load()
+            << ",\"received\":" << stats_.chats_received.load()
+            << ",\"sent_per_second\":" << per_second(stats_.chats_sent)
+            << ",\"received_per_second\":" << per_second(stats_.chats_received)
+            << ",\"latency\":";
+        WriteLatency(out, stats_.chat_latency);
+        out << "}";
+
+        out << ",\"server\":";
+        if (server_metrics_) {
+            WriteServerJSON(out);
+        } else {
+            out << "null";
+        }
+        out << "}" << std::endl;
+    }
+
+    void LoadTest::WriteServerJSON(std::ostream& out) const
+    {
+        // 計測期間中に増えた分
+        auto delta = [this](const std::string& name) -> double {
+            auto end = server_end_.find(name);
+            auto begin = server_begin_.find(name);
+            return (end != server_end_.end() ? end->second : 0) -
+                (begin != server_begin_.end() ? begin->second : 0);
+        };
+        auto last = [this](const std::string& name) -> double {
+            auto it = server_end_.find(name);
+            return it != server_end_.end() ? it->second : 0;
+        };
+
+        auto positions_received = delta("mmo_command_received_total{command=\"0x07\"}");
+
+        out << "{\"positions_received\":" << positions_received
+            << ",\"positions_dropped\":" << std::max(0.0, stats_.positions_sent - positions_received)
+            << ",\"chats_received\":" << delta("mmo_command_received_total{command=\"0x14\"}")
+            << ",\"log_dropped\":" << delta("mmo_log_dropped_total")
+            << ",\"crypto_overflowed\":" << delta("mmo_crypto_overflowed_total")
+            << ",\"crypto_failed\":" << delta("mmo_crypto_failed_total")
+            << ",\"refused_blocked\":" << delta("mmo_sessions_refused_total{reason=\"blocked\"}")
+            << ",\"refused_crowded\":" << delta("mmo_sessions_refused_total{reason=\"crowded\"}")
+            << ",\"refused_version\":" << delta("mmo_sessions_refused_total{reason=\"version\"}")
+            << ",\"send_queue_max_messages\":" << last("mmo_send_queue_max_messages")
+            << ",\"position_handler_p99_ms\":"
+            << last("mmo_command_handler_seconds{command=\"0x07\",quantile=\"0.99\"}") * 1000
+            << ",\"io_loop_lag_p99_ms\":" << last("mmo_io_loop_lag_seconds{quantile=\"0.99\"}") * 1000
+            << "}";
+    }
+
+}
@@ -0,0 +1,70 @@
+//
+// LoadTest.hpp
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <ostream>
+#include "Bot.hpp"
+
+#define LOAD_TEST_LOGIN_TIMEOUT_SECONDS (30)
+#define LOAD_TEST_STOP_WAIT_MILLISECONDS (500)
+
+namespace network {
+
+    struct LoadTestOptions {
+        LoadTestOptions();
+
+        BotOptions bot;
+
+        int bots;
+        // 計測する秒数
+        int duration;
+        // 全員が接続し終わるまでの時間
+        int ramp;
+        int threads;
+
+        // ボットの鍵の置き場所 なければ生成して保存する
+        std::string key_directory;
+
+        // サーバーの計測値を取得するポート 0なら取得しない
+        uint16_t metrics_port;
+    };
+
+    // ボットを接続させて一定時間動かし、結果をJSONで書き出す
+    class LoadTest {
+        public:
+            LoadTest(const LoadTestOptions& options);
+            ~LoadTest();
+
+            void Run();
+            void WriteJSON(std::ostream& out) const;
+
+        private:
+            typedef std::map<std::string, double> MetricsSample;
+
+            void PrepareKeys();
+            bool WaitForLogIn();
+            bool FetchServerMetrics(MetricsSample* sample) const;
+            void WriteServerJSON(std::ostream& out) const;
+
+        private:
+            LoadTestOptions options_;
+
+            boost::asio::io_service io_service_;
+            std::vector<std::pair<std::string, std::string>> keys_;
+            std::vector<std::unique_ptr<Bot>> bots_;
+
+            BotStats stats_;
+            BotDirectory directory_;
+
+            double elapsed_;
+            bool server_metrics_;
+            MetricsSample server_begin_, server_end_;
+    };
+
+}
@@ -0,0 +1,115 @@
+//
+// main.cpp
+//
+
+#include "LoadTest.hpp"
+#include "../common/Logger.hpp"
+#include <fstream>
+#include <boost/lexical_cast.hpp>
+
+namespace {
+
+    void usage()
+    {
+        std::cerr <<
+            "Usage: bot [options]\n"
+            "  --host HOST                server address (127.0.0.1)\n"
+            "  --port PORT                server port (39390)\n"
+            "  --bots N                   number of bots (10)\n"
+            "  --duration SECONDS         measurement time after all bots logged in (30)\n"
+            "  --ramp MILLISECONDS        time to connect all bots (1000)\n"
+            "  --position-interval MS     position update interval, 0 to stand still (100)\n"
+            "  --chat-interval MS         chat interval, 0 to keep silent (10000)\n"
+            "  --step N                   maximum distance of one step (8)\n"
+            "  --area N                   half width of the walking area (500)\n"
+            "  --model NAME               model name sent on login\n"
+            "  --tcp-only                 do not switch positions to UDP\n"
+            "  --threads N                io threads (2)\n"
+            "  --keys DIR                 key pair cache (keys)\n"
+            "  --metrics-port PORT        server metrics_port to read drop counts from (0)\n"
+            "  --output FILE              write the JSON report to FILE instead of stdout\n"
+            "  --log-level LEVEL          debug, info, error or none (error)\n";
+    }
+
+}
+
+int main(int argc, char* argv[])
+{
+    network::LoadTestOptions options;
+    std::string output;
+    Logger::set_level(Logger::LEVEL_ERROR);
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string name = argv[i];
+            if (name == "--tcp-only") {
+                options.bot.udp = false;
+                continue;
+            } else if (name == "--help" || i + 1 >= argc) {
+                usage();
+                return name == "--help" ? 0 : 1;
+            }
+
+            std::string value = argv[++i];
+            if (name == "--host") {
+                options.bot.host = value;
+            } else if (name == "--port") {
+                options.bot.port = boost::lexical_cast<uint16_t>(value);
+            } else if (name == "--bots") {
+                options.bots = boost::lexical_cast<int>(value);
+            } else if (name == "--duration") {
+                options.duration = boost::lexical_cast<int>(value);
+            } else if (name == "--ramp") {
+                options.ramp = boost::lexical_cast<int>(value);
+            } else if (name == "--position-interval") {
+                options.bot.position_interval = boost::lexical_cast<int>(value);
+            } else if (name == "--chat-interval") {
+                options.bot.chat_interval = boost::lexical_cast<int>(value);
+            } else if (name == "--step") {
+                options.bot.step = boost::lexical_cast<int>(value);
+            } else if (name == "--area") {
+                options.bot.area = boost::lexical_cast<int>(value);
+            } else if (name == "--model") {
+                options.bot.model_name = value;
+            } else if (name == "--threads") {
+                options.threads = boost::lexical_cast<int>(value);
+            } else if (name == "--keys") {
+                options.key_directory = value;
+            } else if (name == "--metrics-port") {
+                options.metrics_port = boost::lexical_cast<uint16_t>(value);
+            } else if (name == "--output") {
+                output = value;
+            } else if (name == "--log-level") {
+                const char* levels[] = {"debug", "info", "error", "none"};
+                for (int level = 0; level < 4; level++) {
+                    if (value == levels[level]) {
+                        Logger::set_level(static_cast<Logger::Level>(level));
+                    }
+                }
+            } else {
+                usage();
+                return 1;
+            }
+        }
+    } catch (const boost::bad_lexical_cast&) {
+        usage();
+        return 1;
+    }
+
+    network::LoadTest load_test(options);
+    try {
+        load_test.Run();
+    } catch (const std::exception& e) {
+        Logger::Error(e.what());
+        return 1;
+    }
+
+    if (output.empty()) {
+        load_test.WriteJSON(std::cout);
+    } else {
+        std::ofstream ofs(output.c_str());
+        load_test.WriteJSON(ofs);
+    }
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+//
+// stdafx.h
+//
+
+#pragma once
+
+#include <stdlib.h>
+#include <memory.h>
+#include <stdint.h>
+#include <assert.h>
+#include <cmath>
+#include <iostream>
+
+#include <vector>
+#include <list>
+#include <map>
+#include <deque>
+#include <queue>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+#include <osrng.h>
+#include <modes.h>
+#include <aes.h>
+#include <rsa.h>
+#include <sha.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/format.hpp>
+#include <boost/thread.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "../common/Logger.hpp"
@@ -103,7 +103,8 @@ Client::Client(const std::string& host,
                             Logger::Info(_T("Receive local public key fingerprint request"));
                             Logger::Info(_T("Send local public key fingerprint..."));
 
-                            session->Send(network::ServerReceiveClientInfo(
+                            // 以降は長さ付きフレームで送る
+                            session->SendAndEnableLengthFraming(network::ServerReceiveClientInfo(
                                             network::Encrypter::GetHash(public_key),
                                             (uint16_t)MMO_PROTOCOL_VERSION,
                                             session->udp_port()
@@ -154,22 +155,48 @@ Client::Client(const std::string& host,
                             */
 
                             session->encrypter().SetCryptedCommonKey(key);
-                            session->Send(ServerStartEncryptedSession());
+                            session->Send(ServerStartEncryptedSession(
+                                session->encrypter().GetCommonKeyProof()));
 
                         }
                     }
                     break;
 
+                    // 長さ付きフレーム開始
+                    case network::header::ClientStartLengthFraming:
+                    {
+                        if (auto session = c.session().lock()) {
+                            Logger::Info(_T("Start length-prefixed framing"));
+                            session->EnableReceiveLengthFraming();
+                        }
+                    }
+                    break;
+
                     // 暗号化通信開始
                     case network::header::ClientStartEncryptedSession:
                     {
                         if (auto session = c.session().lock()) {
                             Logger::Info(_T("Start encrypted session"));
+
+                            // 新規の鍵ではここで初めてユーザーIDが決まる
+                            unsigned int user_id;
+                            Utils::Deserialize(c.body(), &user_id);
+                            session->set_id(user_id);
+
                             session->EnableEncryption();
+                            session_->set_udp_key_ready();
                         }
                     }
                     break;
 
+                    // UDPでの位置の送受信開始
+                    case network::header::ClientStartUDPPosition:
+                    {
+                        Logger::Info(_T("Start UDP position"));
+                        session_->EnableUDPPosition();
+                    }
+                    break;
+
                     // 通信量制限
                     case network::header::ClientReceiveWriteAverageLimitUpdate:
                     {
@@ -242,7 +269,12 @@ void Client::WriteUDP(const Command& msg)
         // 送信制限を超えていないかチェック
         // if (GetWriteByteAverage() <= write_average_limit_) {
         if (true) {
-            session_->SendUDP(msg.body());
+            // UDPの疎通が確認できていなければTCPで送る
+            if (session_->udp_position()) {
+                session_->SendUDP(msg);
+            } else {
+                session_->Send(msg);
+            }
         } else {
             Logger::Error(_T("Write limit exceeded"));
             Logger::Info(_T("Command ignored"));
@@ -345,8 +377,8 @@ void Client::ClientSession::Connect(const boost::system::error_code& error)
 		socket_tcp_.set_option(option);
 
         boost::asio::async_read_until(socket_tcp_, receive_buf_, NETWORK_UTILS_DELIMITOR,
-                boost::bind(&ClientSession::ReceiveTCP, shared_from_this(),
-                        boost::asio::placeholders::error));
+                strand_.wrap(boost::bind(&ClientSession::ReceiveTCP, shared_from_this(),
+                        boost::asio::placeholders::error)));
 
         if (on_receive_) {
             // (*on_receive_)(ConnectionSucceeded());
@@ -358,16 +390,70 @@ void Client::ClientSession::Connect(const boost::system::error_code& error)
     }
 }
 
-void Client::ClientSession::SendUDP(const std::string& message)
+void Client::ClientSession::SendUDP(const Command& command)
 {
-	auto holder = std::make_shared<std::string>(message.data(), message.size());
+	auto holder = std::make_shared<std::string>(SerializeDatagram(command, DATAGRAM_SENDER_CLIENT));
     io_service_.post(boost::bind(&Client::ClientSession::DoWriteUDP, this, holder, *iterator_udp_));
 }
 
+void Client::ClientSession::set_udp_key_ready()
+{
+    udp_key_ready_ = true;
+    StartUDPProbe();
+}
+
+void Client::ClientSession::EnableUDPPosition()
+{
+    udp_position_ = true;
+}
+
+bool Client::ClientSession::udp_position() const
+{
+    return udp_position_;
+}
+
+void Client::ClientSession::StartUDPProbe()
+{
+    if (!udp_test_received_ || !udp_key_ready_ || udp_probe_sent_) {
+        return;
+    }
+    udp_probe_sent_ = true;
+
+    // 届いたらサーバーがTCPでClientStartUDPPositionを返す
+    // 返ってこなければTCPのまま
+    for (int i = 0; i < UDP_PROBE_PACKET_TIME; i++) {
+        SendUDP(ServerStartUDPPosition());
+    }
+}
+
+void Client::ClientSession::FetchUDP(const std::string& buffer)
+{
+    if (buffer == UDP_TEST_PACKET_MESSAGE) {
+        if (!udp_test_received_) {
+            Logger::Info(_T("Receive UDP test packet"));
+            udp_test_received_ = true;
+            StartUDPProbe();
+        }
+        return;
+    }
+
+    header::CommandHeader header;
+    std::string body;
+    if (DeserializeDatagram(buffer, DATAGRAM_SENDER_SERVER, &header, &body) &&
+        header == header::ClientUpdatePlayerPositionBatch && on_receive_) {
+        (*on_receive_)(Command(header, body, shared_from_this()));
+    }
+}
+
 void Client::ClientSession::ReceiveUDP(const boost::system::error_code& error, size_t bytes_recvd)
 {
     if (bytes_recvd > 0) {
         Logger::Debug(_T("UDP Receive %d"), bytes_recvd);
+
+        // サーバー以外からのパケットは無視する
+        if (sender_endpoint_ == *iterator_udp_) {
+            FetchUDP(std::string(receive_buf_udp_, bytes_recvd));
+        }
     }
     if (!error) {
       socket_udp_.async_receive_from(
@@ -385,10 +471,10 @@ void Client::ClientSession::DoWriteUDP(std::shared_ptr<std::string> data, const
     socket_udp_.async_send_to(
         boost::asio::buffer(data->data(), data->size()), endpoint,
         boost::bind(&Client::ClientSession::WriteUDP, this,
-          boost::asio::placeholders::error));
+          boost::asio::placeholders::error, data));
 }
 
-void Client::ClientSession::WriteUDP(const boost::system::error_code& error)
+void Client::ClientSession::WriteUDP(const boost::system::error_code& error, std::shared_ptr<std::string> holder)
 {
 
 }
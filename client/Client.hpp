@@ -9,7 +9,8 @@
 #include "../common/network/Session.hpp"
 #include "../common/network/Signature.hpp"
 
-#define UDP_MAX_RECEIVE_LENGTH (512)
+#define UDP_MAX_RECEIVE_LENGTH (2048)
+#define UDP_PROBE_PACKET_TIME (5)
 #define DEFAULT_WRITE_AVERAGE_LIMIT (200)
 
 namespace network {
@@ -25,7 +26,11 @@ namespace network {
                                 io_service_(io_service),
                                 endpoint_iterator_(endpoint_iterator),
                                 socket_udp_(io_service, udp::endpoint(udp::v4(), udp_port)),
-                                iterator_udp_(iterator_udp)
+                                iterator_udp_(iterator_udp),
+                                udp_test_received_(false),
+                                udp_key_ready_(false),
+                                udp_probe_sent_(false),
+                                udp_position_(false)
                 {
                 }
                 ;
@@ -34,11 +39,20 @@ namespace network {
                     void Start();
                     void Close();
                     void Connect(const boost::system::error_code& error);
-                    void SendUDP(const std::string& data);
+                    void SendUDP(const Command& command);
+
+                    // UDPの疎通確認 テストパケットの受信と共通鍵の交換が済んだらサーバーへ送る
+                    void set_udp_key_ready();
+                    void EnableUDPPosition();
+                    bool udp_position() const;
 
                     void ReceiveUDP(const boost::system::error_code& error, size_t bytes_recvd);
                     void DoWriteUDP(std::shared_ptr<std::string> data, const udp::endpoint& endpoint);
-                    void WriteUDP(const boost::system::error_code& error);
+                    void WriteUDP(const boost::system::error_code& error, std::shared_ptr<std::string> holder);
+
+                private:
+                    void FetchUDP(const std::string& buffer);
+                    void StartUDPProbe();
 
                 private:
                     boost::asio::io_service& io_service_;
@@ -49,6 +63,11 @@ namespace network {
                     udp::endpoint sender_endpoint_;
 
                     char receive_buf_udp_[UDP_MAX_RECEIVE_LENGTH];
+
+                    bool udp_test_received_;
+                    bool udp_key_ready_;
+                    bool udp_probe_sent_;
+                    std::atomic<bool> udp_position_;
             };
 
             typedef boost::shared_ptr<ClientSession> ClientSessionPtr;
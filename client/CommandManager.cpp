@@ -14,7 +14,8 @@
 
 CommandManager::CommandManager(const ManagerAccessorPtr& manager_accessor) :
 	manager_accessor_(manager_accessor),
-	status_(STATUS_STANDBY)
+	status_(STATUS_STANDBY),
+	position_keyframe_requested_(false)
 {
 }
 
@@ -28,7 +29,8 @@ void CommandManager::Update()
 
 		// 移動コマンドが溜まっている場合は強制的に消費
 		if (client_->GetCommandSize() > 40) {
-			while (command && command->header() == network::header::ClientUpdatePlayerPosition) {
+			while (command && (command->header() == network::header::ClientUpdatePlayerPosition ||
+					command->header() == network::header::ClientUpdatePlayerPositionBatch)) {
 				command = client_->PopCommand();
 			}
 		}
@@ -185,6 +187,57 @@ void CommandManager::FetchCommand(const network::Command& command)
 	}
 		break;
 
+	// プレイヤー位置更新 (まとめ送り)
+	case ClientUpdatePlayerPositionBatch:
+	{
+		if (player_manager) {
+			std::string entries;
+			network::Utils::Deserialize(command.body(), &entries);
+
+			auto myself = player_manager->GetMyself();
+			unsigned int my_id = myself ? myself->id() : 0;
+
+			size_t offset = 0;
+			while (offset < entries.size()) {
+				PlayerPosition pos;
+				uint32_t user_id;
+				auto size = network::Utils::Deserialize(entries.substr(offset),
+					&user_id, &pos.x, &pos.y, &pos.z, &pos.theta, &pos.vy);
+				if (size == 0) {
+					break;
+				}
+				offset += size;
+				if (user_id != my_id) {
+					player_manager->UpdatePlayerPosition(user_id, pos);
+				}
+			}
+		}
+	}
+		break;
+
+	// プレイヤー位置更新 (差分)
+	case ClientUpdatePlayerPositionDelta:
+	{
+		std::string data;
+		network::Utils::Deserialize(command.body(), &data);
+
+		std::vector<network::PositionDeltaEntry> entries;
+		if (position_decoder_.Decode(data, &entries)) {
+			position_keyframe_requested_ = false;
+			if (player_manager) {
+				BOOST_FOREACH(const auto& entry, entries) {
+					player_manager->UpdatePlayerPosition(entry.first, entry.second);
+				}
+			}
+		} else if (!position_keyframe_requested_) {
+			// 基準値を取りこぼしたので送り直してもらう
+			Logger::Info(_T("Request position keyframe"));
+			client_->Write(network::ServerRequestedPositionKeyframe());
+			position_keyframe_requested_ = true;
+		}
+	}
+		break;
+
 	case ClientReceiveAccountRevisionUpdateNotify:
 	{
 		if (player_manager) {
@@ -212,6 +265,18 @@ void CommandManager::FetchCommand(const network::Command& command)
 	}
 		break;
 
+	case ClientReceiveAccountSnapshot:
+	{
+		Logger::Info(_T("Receive account database snapshot"));
+		std::string buffer = network::Utils::Deserialize<std::string>(command.body());
+		while (buffer.size()) {
+			std::string data;
+			buffer.erase(0, network::Utils::Deserialize(buffer, &data));
+			player_manager->ApplyRevisionPatch(data);
+		}
+	}
+		break;
+
 	case FatalConnectionError:
 	case UserFatalConnectionError:
 	{
@@ -226,6 +291,8 @@ void CommandManager::FetchCommand(const network::Command& command)
 void CommandManager::set_client(ClientUniqPtr client)
 {
     client_= std::move(client);
+	position_decoder_ = network::PositionDeltaDecoder();
+	position_keyframe_requested_ = false;
 	// status_ = STATUS_CONNECTING;
 }
 
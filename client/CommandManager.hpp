@@ -5,6 +5,7 @@
 #pragma once
 
 #include "ManagerAccessor.hpp"
+#include "../common/network/PositionDelta.hpp"
 #include <string>
 
 namespace network {
@@ -67,6 +68,9 @@ class CommandManager {
 		Status status_;
 
 		std::map<unsigned char, ChannelPtr> channels_;
+
+		network::PositionDeltaDecoder position_decoder_;
+		bool position_keyframe_requested_;
 };
 
 typedef std::shared_ptr<CommandManager> CommandManagerPtr;
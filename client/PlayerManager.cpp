@@ -170,7 +170,7 @@ void PlayerManager::Update()
         // Logger::Debug(_T("vychar %d"), (int)vy_char);
         if (auto command_manager = manager_accessor_->command_manager().lock()) {
 //          command_manager->Write(network::ServerUpdatePlayerPosition(pos.x, pos.y, pos.z, theta, vy_char));
-            command_manager->Write(network::ServerUpdatePlayerPosition(pos.x, pos.y, pos.z, theta2, vy_char));
+            command_manager->WriteUDP(network::ServerUpdatePlayerPosition(pos.x, pos.y, pos.z, theta2, vy_char));
         }
 // ※ ここまで
         //Logger::Debug(_T("PlayerPos %f %f %f"), pos.x, pos.y, pos.z);
@@ -334,7 +334,9 @@ void PlayerManager::ApplyRevisionPatch(const std::string& patch)
 	MMO_PROFILE_FUNCTION;
 
     std::string buffer(patch);
-    Logger::Debug(_T("%s"), unicode::ToTString(network::Utils::ToHexString(buffer)));
+    if (Logger::IsEnabled(Logger::LEVEL_DEBUG)) {
+        Logger::Debug(_T("%s"), unicode::ToTString(network::Utils::ToHexString(buffer)));
+    }
 
     uint32_t user_id;
     uint32_t new_revision;
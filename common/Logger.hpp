@@ -4,10 +4,17 @@
 
 #pragma once
 #include <iostream>
+#include <atomic>
+#include <ctime>
+#include <memory>
+#include <type_traits>
+#include <stdint.h>
 #include "unicode.hpp"
 #include <boost/algorithm/string.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/date_time/c_local_time_adjustor.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
 
 #ifdef _WIN32
 #define WriteDebugString(str) OutputDebugString(str.c_str()), \
@@ -18,10 +25,61 @@
 			ofs_ << unicode::ToString(out) << std::flush;
 #endif
 
+// リングバッファのレコード数 (2の累乗)
+#define LOGGER_BUFFER_SIZE (2048)
+// 引数をコピーしておく領域の大きさ
+#define LOGGER_RECORD_SIZE (192)
+// バッファが空の時に書き込みスレッドが待つ時間
+#define LOGGER_FLUSH_INTERVAL_MILLISECONDS (10)
+
+// 書き込みスレッドで整形するまで保持する引数の型
+// 文字列へのポインタは呼び出し元の寿命に依存するのでコピーする
+template<class T>
+struct LoggerArgument {
+    typedef T type;
+};
+
+template<>
+struct LoggerArgument<const char*> {
+    typedef std::string type;
+};
+
+template<>
+struct LoggerArgument<char*> {
+    typedef std::string type;
+};
+
+template<>
+struct LoggerArgument<const wchar_t*> {
+    typedef std::wstring type;
+};
+
+template<>
+struct LoggerArgument<wchar_t*> {
+    typedef std::wstring type;
+};
+
 class Logger {
+    public:
+        enum Level {
+            LEVEL_DEBUG = 0,
+            LEVEL_INFO = 1,
+            LEVEL_ERROR = 2,
+            LEVEL_NONE = 3
+        };
+
         // Singleton
     private:
-        inline Logger() {
+        inline Logger() :
+            buffer_(new Record[LOGGER_BUFFER_SIZE]),
+            enqueue_pos_(0),
+            dequeue_pos_(0),
+            level_(LEVEL_DEBUG),
+            dropped_(0),
+            reported_dropped_(0),
+            last_time_(0),
+            running_(true)
+        {
 			using namespace boost::filesystem;
 
 			if (!exists("./log")) {
@@ -33,16 +91,34 @@ class Logger {
 			#ifdef _WIN32
 				setlocale(LC_ALL, "japanese");
 			#endif
+
+            for (size_t i = 0; i < LOGGER_BUFFER_SIZE; i++) {
+                buffer_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+
+            thread_ = boost::thread([this](){ Run(); });
 		}
 
         Logger(const Logger& logger) {}
-        virtual ~Logger() {}
 
-		inline tstring GetTimeString() const
+        virtual ~Logger() {
+            // 溜まっているものを書き出してから終了する
+            running_ = false;
+            thread_.join();
+        }
+
+		inline tstring GetTimeString(std::time_t time)
 		{
 			using namespace boost::posix_time;
-			ptime now = second_clock::local_time();
-            return unicode::ToTString(to_iso_extended_string(now));
+
+            // 同じ秒のレコードが続くことが多いので変換結果を使い回す
+            if (time != last_time_ || last_time_string_.empty()) {
+                typedef boost::date_time::c_local_adjustor<ptime> local_adjustor;
+                ptime local = local_adjustor::utc_to_local(from_time_t(time));
+                last_time_ = time;
+                last_time_string_ = unicode::ToTString(to_iso_extended_string(local));
+            }
+            return last_time_string_;
 		}
 
 		inline std::string GetLogFileName() const
@@ -55,87 +131,106 @@ class Logger {
 		}
 
     public:
+        // 指定したレベル未満のログは引数を整形せずに捨てる
+        static void set_level(Level level) {
+            getInstance().level_.store(level, std::memory_order_relaxed);
+        }
+
+        static bool IsEnabled(Level level) {
+		#ifndef _DEBUG
+            if (level == LEVEL_DEBUG) {
+                return false;
+            }
+		#endif
+            return level >= getInstance().level_.load(std::memory_order_relaxed);
+        }
+
+        // バッファが溢れて捨てたレコードの数
+        static uint64_t dropped() {
+            return getInstance().dropped_.load(std::memory_order_relaxed);
+        }
+
         static void Info(const tstring& format) {
-            getInstance().Log(_T("INFO: "), format);
+            getInstance().Log(LEVEL_INFO, format);
         }
 
         template<class T1>
         static void Info(const tstring& format, const T1& t1) {
-            getInstance().Log(_T("INFO: "), format, t1);
+            getInstance().Log(LEVEL_INFO, format, t1);
         }
 
         template<class T1, class T2>
         static void Info(const tstring& format, const T1& t1, const T2& t2) {
-            getInstance().Log(_T("INFO: "), format, t1, t2);
+            getInstance().Log(LEVEL_INFO, format, t1, t2);
         }
 
         template<class T1, class T2, class T3>
         static void Info(const tstring& format, const T1& t1, const T2& t2, const T3& t3) {
-            getInstance().Log(_T("INFO: "), format, t1, t2, t3);
+            getInstance().Log(LEVEL_INFO, format, t1, t2, t3);
         }
 
         template<class T1, class T2, class T3, class T4>
         static void Info(const tstring& format, const T1& t1, const T2& t2, const T3& t3, const T4& t4) {
-            getInstance().Log(_T("INFO: "), format, t1, t2, t3, t4);
+            getInstance().Log(LEVEL_INFO, format, t1, t2, t3, t4);
         }
 
 
         static void Error(const tstring& format) {
-            getInstance().Log(_T("ERROR: "), format);
+            getInstance().Log(LEVEL_ERROR, format);
         }
 
         template<class T1>
         static void Error(const tstring& format, const T1& t1) {
-            getInstance().Log(_T("ERROR: "), format, t1);
+            getInstance().Log(LEVEL_ERROR, format, t1);
         }
 
         template<class T1, class T2>
         static void Error(const tstring& format, const T1& t1, const T2& t2) {
-            getInstance().Log(_T("ERROR: "), format, t1, t2);
+            getInstance().Log(LEVEL_ERROR, format, t1, t2);
         }
 
         template<class T1, class T2, class T3>
         static void Error(const tstring& format, const T1& t1, const T2& t2, const T3& t3) {
-            getInstance().Log(_T("ERROR: "), format, t1, t2, t3);
+            getInstance().Log(LEVEL_ERROR, format, t1, t2, t3);
         }
 
         template<class T1, class T2, class T3, class T4>
         static void Error(const tstring& format, const T1& t1, const T2& t2, const T3& t3, const T4& t4) {
-            getInstance().Log(_T("ERROR: "), format, t1, t2, t3, t4);
+            getInstance().Log(LEVEL_ERROR, format, t1, t2, t3, t4);
         }
 
 
         static void Debug(const tstring& format) {
 		#ifdef _DEBUG
-            getInstance().Log(_T("DEBUG: "), format);
+            getInstance().Log(LEVEL_DEBUG, format);
 		#endif
         }
 
         template<class T1>
         static void Debug(const tstring& format, const T1& t1) {
 		#ifdef _DEBUG
-            getInstance().Log(_T("DEBUG: "), format, t1);
+            getInstance().Log(LEVEL_DEBUG, format, t1);
 		#endif
         }
 
         template<class T1, class T2>
         static void Debug(const tstring& format, const T1& t1, const T2& t2) {
 		#ifdef _DEBUG
-            getInstance().Log(_T("DEBUG: "), format, t1, t2);
+            getInstance().Log(LEVEL_DEBUG, format, t1, t2);
 		#endif
         }
 
         template<class T1, class T2, class T3>
         static void Debug(const tstring& format, const T1& t1, const T2& t2, const T3& t3) {
 		#ifdef _DEBUG
-            getInstance().Log(_T("DEBUG: "), format, t1, t2, t3);
+            getInstance().Log(LEVEL_DEBUG, format, t1, t2, t3);
 		#endif
         }
 
         template<class T1, class T2, class T3, class T4>
         static void Debug(const tstring& format, const T1& t1, const T2& t2, const T3& t3, const T4& t4) {
 		#ifdef _DEBUG
-            getInstance().Log(_T("DEBUG: "), format, t1, t2, t3, t4);
+            getInstance().Log(LEVEL_DEBUG, format, t1, t2, t3, t4);
 		#endif
         }
 
@@ -143,39 +238,278 @@ class Logger {
     private:
         typedef boost::basic_format<TCHAR, std::char_traits<TCHAR>, std::allocator<TCHAR>> tformat;
 
+        template<class T>
+        struct Argument {
+            typedef typename LoggerArgument<typename std::decay<T>::type>::type type;
+        };
+
+        struct Message {
+            Message(const tstring& format) : format_(format) {}
+            virtual ~Message() {}
+            virtual tstring Format() const = 0;
+            tstring format_;
+        };
+
+        struct Message0 : public Message {
+            Message0(const tstring& format) : Message(format) {}
+            tstring Format() const {
+                return format_;
+            }
+        };
+
+        template<class T1>
+        struct Message1 : public Message {
+            Message1(const tstring& format, const T1& t1) :
+                Message(format), t1_(t1) {}
+            tstring Format() const {
+                return (tformat(format_) % t1_).str();
+            }
+            typename Argument<T1>::type t1_;
+        };
+
+        template<class T1, class T2>
+        struct Message2 : public Message {
+            Message2(const tstring& format, const T1& t1, const T2& t2) :
+                Message(format), t1_(t1), t2_(t2) {}
+            tstring Format() const {
+                return (tformat(format_) % t1_ % t2_).str();
+            }
+            typename Argument<T1>::type t1_;
+            typename Argument<T2>::type t2_;
+        };
+
+        template<class T1, class T2, class T3>
+        struct Message3 : public Message {
+            Message3(const tstring& format, const T1& t1, const T2& t2, const T3& t3) :
+                Message(format), t1_(t1), t2_(t2), t3_(t3) {}
+            tstring Format() const {
+                return (tformat(format_) % t1_ % t2_ % t3_).str();
+            }
+            typename Argument<T1>::type t1_;
+            typename Argument<T2>::type t2_;
+            typename Argument<T3>::type t3_;
+        };
+
+        template<class T1, class T2, class T3, class T4>
+        struct Message4 : public Message {
+            Message4(const tstring& format, const T1& t1, const T2& t2, const T3& t3, const T4& t4) :
+                Message(format), t1_(t1), t2_(t2), t3_(t3), t4_(t4) {}
+            tstring Format() const {
+                return (tformat(format_) % t1_ % t2_ % t3_ % t4_).str();
+            }
+            typename Argument<T1>::type t1_;
+            typename Argument<T2>::type t2_;
+            typename Argument<T3>::type t3_;
+            typename Argument<T4>::type t4_;
+        };
+
+        // 固定長のレコード
+        // 収まらない大きさのメッセージだけヒープに置く
+        struct Record {
+            std::atomic<size_t> sequence;
+            Level level;
+            std::time_t time;
+            Message* message;
+            bool allocated;
+            std::aligned_storage<LOGGER_RECORD_SIZE>::type storage;
+        };
+
         static Logger& getInstance() {
             static Logger instance;
             return instance;
         }
 
-        void Log(const tstring& prefix, const tstring& format) {
-            auto out = GetTimeString() + _T(">  ") + prefix + format + _T("\n");
-            WriteDebugString(out);
+        void Log(Level level, const tstring& format) {
+            if (IsEnabled(level)) {
+                Push<Message0>(level, format);
+            }
         }
 
         template<class T1>
-        void Log(const tstring& prefix, const tstring& format, const T1& t1) {
-            auto out = GetTimeString() + _T(">  ") + prefix + (tformat(format) % t1).str() + _T("\n");
-			WriteDebugString(out);
+        void Log(Level level, const tstring& format, const T1& t1) {
+            if (IsEnabled(level)) {
+                Push<Message1<T1>>(level, format, t1);
+            }
         }
 
         template<class T1, class T2>
-        void Log(const tstring& prefix, const tstring& format, const T1& t1, const T2& t2) {
-            auto out = GetTimeString() + _T(">  ") + prefix + (tformat(format) % t1 % t2).str() + _T("\n");
-            WriteDebugString(out);
+        void Log(Level level, const tstring& format, const T1& t1, const T2& t2) {
+            if (IsEnabled(level)) {
+                Push<Message2<T1, T2>>(level, format, t1, t2);
+            }
         }
 
         template<class T1, class T2, class T3>
-        void Log(const tstring& prefix, const tstring& format, const T1& t1, const T2& t2, const T3& t3) {
-            auto out = GetTimeString() + _T(">  ") + prefix + (tformat(format) % t1 % t2 % t3).str() + _T("\n");
-            WriteDebugString(out);
+        void Log(Level level, const tstring& format, const T1& t1, const T2& t2, const T3& t3) {
+            if (IsEnabled(level)) {
+                Push<Message3<T1, T2, T3>>(level, format, t1, t2, t3);
+            }
         }
 
         template<class T1, class T2, class T3, class T4>
-        void Log(const tstring& prefix, const tstring& format, const T1& t1, const T2& t2, const T3& t3, const T4& t4) {
-            auto out = GetTimeString() + _T(">  ") + prefix + (tformat(format) % t1 % t2 % t3 % t4).str() + _T("\n");
-            WriteDebugString(out);
+        void Log(Level level, const tstring& format, const T1& t1, const T2& t2, const T3& t3, const T4& t4) {
+            if (IsEnabled(level)) {
+                Push<Message4<T1, T2, T3, T4>>(level, format, t1, t2, t3, t4);
+            }
+        }
+
+        // 空きレコードを確保する
+        // バッファが一杯の場合はnullptrを返す
+        Record* Reserve(size_t* position) {
+            size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+            while (true) {
+                Record& record = buffer_[pos & (LOGGER_BUFFER_SIZE - 1)];
+                size_t sequence = record.sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+                if (diff == 0) {
+                    if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        *position = pos;
+                        return &record;
+                    }
+                } else if (diff < 0) {
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                    return nullptr;
+                } else {
+                    pos = enqueue_pos_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        template<class M>
+        void Commit(Record* record, size_t position, Level level, M* message) {
+            record->level = level;
+            record->time = std::time(nullptr);
+            record->message = message;
+            record->allocated = (static_cast<void*>(message) != &record->storage);
+            record->sequence.store(position + 1, std::memory_order_release);
+        }
+
+        template<class M>
+        void Push(Level level, const tstring& format) {
+            size_t position;
+            if (auto record = Reserve(&position)) {
+                Commit(record, position, level, sizeof(M) <= LOGGER_RECORD_SIZE ?
+                    new(&record->storage) M(format) : new M(format));
+            }
+        }
+
+        template<class M, class T1>
+        void Push(Level level, const tstring& format, const T1& t1) {
+            size_t position;
+            if (auto record = Reserve(&position)) {
+                Commit(record, position, level, sizeof(M) <= LOGGER_RECORD_SIZE ?
+                    new(&record->storage) M(format, t1) : new M(format, t1));
+            }
+        }
+
+        template<class M, class T1, class T2>
+        void Push(Level level, const tstring& format, const T1& t1, const T2& t2) {
+            size_t position;
+            if (auto record = Reserve(&position)) {
+                Commit(record, position, level, sizeof(M) <= LOGGER_RECORD_SIZE ?
+                    new(&record->storage) M(format, t1, t2) : new M(format, t1, t2));
+            }
+        }
+
+        template<class M, class T1, class T2, class T3>
+        void Push(Level level, const tstring& format, const T1& t1, const T2& t2, const T3& t3) {
+            size_t position;
+            if (auto record = Reserve(&position)) {
+                Commit(record, position, level, sizeof(M) <= LOGGER_RECORD_SIZE ?
+                    new(&record->storage) M(format, t1, t2, t3) : new M(format, t1, t2, t3));
+            }
+        }
+
+        template<class M, class T1, class T2, class T3, class T4>
+        void Push(Level level, const tstring& format, const T1& t1, const T2& t2, const T3& t3, const T4& t4) {
+            size_t position;
+            if (auto record = Reserve(&position)) {
+                Commit(record, position, level, sizeof(M) <= LOGGER_RECORD_SIZE ?
+                    new(&record->storage) M(format, t1, t2, t3, t4) : new M(format, t1, t2, t3, t4));
+            }
+        }
+
+        // 書き込みスレッド
+        void Run() {
+            while (true) {
+                bool running = running_;
+                if (Flush() == 0) {
+                    if (!running) {
+                        break;
+                    }
+                    boost::this_thread::sleep(boost::posix_time::milliseconds(LOGGER_FLUSH_INTERVAL_MILLISECONDS));
+                }
+            }
+        }
+
+        // 溜まっているレコードをまとめて整形して書き出す
+        size_t Flush() {
+            tstring out;
+            size_t count = 0;
+
+            while (true) {
+                Record& record = buffer_[dequeue_pos_ & (LOGGER_BUFFER_SIZE - 1)];
+                if (record.sequence.load(std::memory_order_acquire) != dequeue_pos_ + 1) {
+                    break;
+                }
+
+                tstring text;
+                try {
+                    text = record.message->Format();
+                } catch (const std::exception&) {
+                    // 書式と引数が合わない場合は書式をそのまま出力する
+                    text = record.message->format_;
+                }
+                out += GetTimeString(record.time) + _T(">  ") + GetPrefix(record.level) + text + _T("\n");
+
+                if (record.allocated) {
+                    delete record.message;
+                } else {
+                    record.message->~Message();
+                }
+
+                record.sequence.store(dequeue_pos_ + LOGGER_BUFFER_SIZE, std::memory_order_release);
+                dequeue_pos_++;
+                count++;
+            }
+
+            uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+            if (dropped != reported_dropped_) {
+                out += GetTimeString(std::time(nullptr)) + _T(">  ") + GetPrefix(LEVEL_ERROR)
+                    + (tformat(_T("Logger dropped %d records")) % (dropped - reported_dropped_)).str() + _T("\n");
+                reported_dropped_ = dropped;
+            }
+
+            if (!out.empty()) {
+                WriteDebugString(out);
+            }
+            return count;
+        }
+
+        static const TCHAR* GetPrefix(Level level) {
+            switch (level) {
+            case LEVEL_DEBUG:
+                return _T("DEBUG: ");
+            case LEVEL_INFO:
+                return _T("INFO: ");
+            default:
+                return _T("ERROR: ");
+            }
         }
 
 	std::ofstream ofs_;
+
+    std::unique_ptr<Record[]> buffer_;
+    std::atomic<size_t> enqueue_pos_;
+    size_t dequeue_pos_;
+
+    std::atomic<int> level_;
+    std::atomic<uint64_t> dropped_;
+    uint64_t reported_dropped_;
+
+    std::time_t last_time_;
+    tstring last_time_string_;
+
+    std::atomic<bool> running_;
+    boost::thread thread_;
 };
@@ -100,13 +100,21 @@ typedef boost::weak_ptr<Session> SessionWeakPtr;
 	};
 	
 	typedef CommandTemplate0<header::FatalConnectionError>					FatalConnectionError;
-	typedef CommandTemplate0<header::ServerStartEncryptedSession>			ServerStartEncryptedSession;
-	typedef CommandTemplate0<header::ClientStartEncryptedSession>			ClientStartEncryptedSession;
+	// 共通鍵を復号できたことの証明(Encrypter::GetCommonKeyProof)を付ける
+	typedef CommandTemplate1<header::ServerStartEncryptedSession,
+		const std::string&> ServerStartEncryptedSession;
+	// 鍵の持ち主と確かめてから発行したユーザーIDを付ける
+	typedef CommandTemplate1<header::ClientStartEncryptedSession,
+		uint32_t> ClientStartEncryptedSession;
 	typedef CommandTemplate0<header::ClientRequestedPublicKey>				ClientRequestedPublicKey;
 	typedef CommandTemplate0<header::ClientRequestedClientInfo>				ClientRequestedClientInfo;
 	typedef CommandTemplate0<header::ClientReceiveServerCrowdedError>		ClientReceiveServerCrowdedError;
 	typedef CommandTemplate0<header::ServerRequestedFullServerInfo>			ServerRequestedFullServerInfo;
 	typedef CommandTemplate0<header::ServerRequestedPlainFullServerInfo>	ServerRequestedPlainFullServerInfo;
+	typedef CommandTemplate0<header::ClientStartLengthFraming>				ClientStartLengthFraming;
+	typedef CommandTemplate0<header::ServerRequestedPositionKeyframe>		ServerRequestedPositionKeyframe;
+	typedef CommandTemplate0<header::ServerStartUDPPosition>				ServerStartUDPPosition;
+	typedef CommandTemplate0<header::ClientStartUDPPosition>				ClientStartUDPPosition;
 
 	typedef CommandTemplate1<header::ServerReceivePublicKey,
 		const std::string&>	ServerReceivePublicKey;
@@ -120,6 +128,18 @@ typedef boost::weak_ptr<Session> SessionWeakPtr;
 	typedef CommandTemplate5<header::ServerUpdatePlayerPosition,
 		int16_t, int16_t, int16_t, uint8_t, uint8_t> ServerUpdatePlayerPosition;
 
+	// ClientUpdatePlayerPositionと同じ並びの項目を連結したもの
+	typedef CommandTemplate1<header::ClientUpdatePlayerPositionBatch,
+		const std::string&> ClientUpdatePlayerPositionBatch;
+
+	// PositionDeltaEncoderで符号化したもの
+	typedef CommandTemplate1<header::ClientUpdatePlayerPositionDelta,
+		const std::string&> ClientUpdatePlayerPositionDelta;
+
+	// 長さ付きのClientReceiveAccountRevisionPatchを連結したもの
+	typedef CommandTemplate1<header::ClientReceiveAccountSnapshot,
+		const std::string&> ClientReceiveAccountSnapshot;
+
 	typedef CommandTemplate2<header::ServerRequestedAccountRevisionPatch,
 		uint32_t, int> ServerRequestedAccountRevisionPatch;
 
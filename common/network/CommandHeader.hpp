@@ -32,6 +32,13 @@ namespace header {
         ClientReceiveJSON =                         0x15,
         ServerRequestedFullServerInfo =             0x16,
         ClientReceiveFullServerInfo =               0x17,
+        ClientStartLengthFraming =                  0x18,
+        ClientUpdatePlayerPositionBatch =           0x19,
+        ClientUpdatePlayerPositionDelta =           0x1A,
+        ServerRequestedPositionKeyframe =           0x1B,
+        ServerStartUDPPosition =                    0x1C,
+        ClientStartUDPPosition =                    0x1D,
+        ClientReceiveAccountSnapshot =              0x1E,
 		
 		ServerReceiveWriteLimit =					0x20,
 		
@@ -41,8 +48,23 @@ namespace header {
 		ServerRequstedStatus =						0xE0,
 
         LZ4_COMPRESS_HEADER =                       0xF0,
-        ENCRYPT_HEADER =                            0xF1
+        ENCRYPT_HEADER =                            0xF1,
+        DATAGRAM_HEADER =                           0xF2
     };
 
+    // セッションが切断時に自分で作る通知 相手から届いても受け付けない
+    inline bool IsConnectionError(CommandHeader header)
+    {
+        return header == FatalConnectionError || header == UserFatalConnectionError;
+    }
+
+    // ログイン前のセッションから受け付けるコマンド
+    inline bool IsAnonymous(CommandHeader header)
+    {
+        return header == ServerReceiveClientInfo || header == ServerReceivePublicKey ||
+            header == ServerStartEncryptedSession || header == ServerRequestedFullServerInfo ||
+            header == ServerRequestedPlainFullServerInfo || header == ServerRequstedStatus;
+    }
+
 }
 }
@@ -16,10 +16,13 @@
 namespace network {
 
 const int Encrypter::TRIP_LENGTH = 12;
+std::shared_ptr<KeyPool> Encrypter::key_pool_;
 
 using namespace CryptoPP;
 
-Encrypter::Encrypter()
+Encrypter::Encrypter() :
+    has_private_key_(false),
+    has_public_key_(false)
 {
     AutoSeededRandomPool rnd;
     
@@ -34,11 +37,7 @@ Encrypter::Encrypter()
     aes_encrypt_.SetKeyWithIV(common_key, sizeof(common_key), common_key_iv);
     aes_decrypt_.SetKeyWithIV(common_key, sizeof(common_key), common_key_iv);
 
-    InvertibleRSAFunction params;
-    params.GenerateRandomWithKeySize(rnd, 3072);
-
-    private_key_ = RSA::PrivateKey(params);
-    public_key_ = RSA::PublicKey(params);
+    // RSA鍵ペアは必要になるまで生成しない
 }
 
 Encrypter::~Encrypter()
@@ -61,8 +60,43 @@ std::string Encrypter::Decrypt(const std::string& in)
      return out;
 }
 
+std::string Encrypter::EncryptDatagram(uint8_t sender, uint32_t sequence, const std::string& in)
+{
+     auto iv = GetDatagramIV(sender, sequence);
+     CFB_Mode<AES>::Encryption aes;
+     aes.SetKeyWithIV((const byte*)common_key_.data(), common_key_.size(), (const byte*)iv.data());
+
+     std::unique_ptr<char[]> outbuf(new char [in.size()]);
+     aes.ProcessData((byte*)outbuf.get(), (const byte*)in.data(), in.size());
+     return std::string((const char*)outbuf.get(), in.size());
+}
+
+std::string Encrypter::DecryptDatagram(uint8_t sender, uint32_t sequence, const std::string& in)
+{
+     auto iv = GetDatagramIV(sender, sequence);
+     CFB_Mode<AES>::Decryption aes;
+     aes.SetKeyWithIV((const byte*)common_key_.data(), common_key_.size(), (const byte*)iv.data());
+
+     std::unique_ptr<char[]> outbuf(new char [in.size()]);
+     aes.ProcessData((byte*)outbuf.get(), (const byte*)in.data(), in.size());
+     return std::string((const char*)outbuf.get(), in.size());
+}
+
+std::string Encrypter::GetDatagramIV(uint8_t sender, uint32_t sequence) const
+{
+    // 共通のIVに送信者と連番を混ぜる 同じIVが二度使われないようにする
+    std::string iv = common_key_iv_;
+    for (int i = 0; i < 4; i++) {
+        iv[i] ^= static_cast<char>((sequence >> (i * 8)) & 0xFF);
+    }
+    iv[4] ^= static_cast<char>(sender);
+    return iv;
+}
+
 std::string Encrypter::GetPublicKey()
 {
+    PrepareKeyPair();
+
     ByteQueue queue;
     public_key_.Save(queue);
 
@@ -79,10 +113,13 @@ void Encrypter::SetPublicKey(const std::string& in)
     ByteQueue queue;
     queue.Put((const byte*)in.data(), in.size());
     public_key_.Load(queue);
+    has_public_key_ = true;
 }
 
 std::string Encrypter::GetPrivateKey()
 {
+    PrepareKeyPair();
+
     ByteQueue queue;
     private_key_.Save(queue);
 
@@ -99,6 +136,7 @@ void Encrypter::SetPrivateKey(const std::string& in)
     ByteQueue queue;
     queue.Put((const byte*)in.data(), in.size());
     private_key_.Load(queue);
+    has_private_key_ = true;
 }
 
 void Encrypter::SetPairKey(const std::string& pub, const std::string& pri)
@@ -122,8 +160,15 @@ void Encrypter::SetCryptedCommonKey(const std::string& in)
     aes_decrypt_.SetKeyWithIV((const byte*)common_key_.data(), common_key_.size(), (const byte*)common_key_iv_.data());
 }
 
+std::string Encrypter::GetCommonKeyProof()
+{
+    return GetHash("MMO common key proof" + GetCommonKey());
+}
+
 std::string Encrypter::PublicEncrypt(const std::string& in)
 {
+    PrepareKeyPair();
+
     AutoSeededRandomPool rng;
     RSAES_OAEP_SHA_Encryptor encryptor(public_key_);
 
@@ -143,6 +188,8 @@ std::string Encrypter::PublicEncrypt(const std::string& in)
 
 std::string Encrypter::PublicDecrypt(const std::string& in)
 {
+    PrepareKeyPair();
+
     AutoSeededRandomPool rng;
     RSAES_OAEP_SHA_Decryptor decryptor(private_key_);
 
@@ -217,5 +264,24 @@ std::string Encrypter::GetCommonKey()
     return common_key_ + common_key_iv_;
 }
 
+void Encrypter::PrepareKeyPair()
+{
+    // 片方でも外から設定されていれば、それと対にならない鍵は作らない
+    if (has_private_key_ || has_public_key_) {
+        return;
+    }
+
+    KeyPool::KeyPair pair = key_pool_ ? key_pool_->Take() : KeyPool::Generate();
+    private_key_ = pair.private_key;
+    public_key_ = pair.public_key;
+    has_private_key_ = true;
+    has_public_key_ = true;
+}
+
+void Encrypter::set_key_pool(const std::shared_ptr<KeyPool>& key_pool)
+{
+    key_pool_ = key_pool;
+}
+
 }
 
@@ -5,10 +5,13 @@
 #pragma once
 
 #include <string>
+#include <stdint.h>
 
 #include <modes.h>
 #include <aes.h>
 #include <rsa.h>
+#include <memory>
+#include "KeyPool.hpp"
 
 namespace network {
 
@@ -20,6 +23,10 @@ class Encrypter {
         std::string Encrypt(const std::string&);
         std::string Decrypt(const std::string&);
 
+        // UDPデータグラム用 欠落や順序の入れ替わりがあっても個別に復号できる
+        std::string EncryptDatagram(uint8_t sender, uint32_t sequence, const std::string&);
+        std::string DecryptDatagram(uint8_t sender, uint32_t sequence, const std::string&);
+
         std::string PublicEncrypt(const std::string&);
         std::string PublicDecrypt(const std::string&);
 
@@ -35,13 +42,20 @@ class Encrypter {
 
         std::string GetCryptedCommonKey();
         void SetCryptedCommonKey(const std::string&);
+        // 共通鍵から作る値 秘密鍵の持ち主だけが共通鍵を復号して同じ値を作れる
+        std::string GetCommonKeyProof();
 
         std::string GetPublicKeyFingerPrint();
         static std::string GetHash(const std::string&);
         static std::string GetTrip(const std::string&);
 
+        // 鍵ペアが必要になったときに使う 起動時に一度だけ設定する
+        static void set_key_pool(const std::shared_ptr<KeyPool>& key_pool);
+
     private:
         std::string GetCommonKey();
+        void PrepareKeyPair();
+        std::string GetDatagramIV(uint8_t sender, uint32_t sequence) const;
         static std::string GetTripHash(const std::string&);
 
     private:
@@ -55,6 +69,12 @@ class Encrypter {
 
         CryptoPP::RSA::PrivateKey private_key_;
         CryptoPP::RSA::PublicKey public_key_;
+
+        // 鍵が設定も生成もされていなければfalse
+        bool has_private_key_;
+        bool has_public_key_;
+
+        static std::shared_ptr<KeyPool> key_pool_;
 };
 
 }
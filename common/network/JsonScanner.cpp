@@ -0,0 +1,374 @@
+﻿//
+// JsonScanner.cpp
+//
+
+#include "JsonScanner.hpp"
+#include <cstring>
+
+namespace network {
+
+    namespace {
+
+        enum {
+            MAX_NESTING = 64
+        };
+
+        int HexValue(char c)
+        {
+            if (c >= '0' && c <= '9') {
+                return c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                return c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                return c - 'A' + 10;
+            } else {
+                return -1;
+            }
+        }
+
+        bool ReadHex4(const char* p, const char* end, uint32_t* out)
+        {
+            if (end - p < 4) {
+                return false;
+            }
+            uint32_t value = 0;
+            for (int i = 0; i < 4; i++) {
+                int digit = HexValue(p[i]);
+                if (digit < 0) {
+                    return false;
+                }
+                value = (value << 4) | digit;
+            }
+            *out = value;
+            return true;
+        }
+
+        void AppendUTF8(std::string* out, uint32_t code)
+        {
+            if (code < 0x80) {
+                out->push_back(static_cast<char>(code));
+            } else if (code < 0x800) {
+                out->push_back(static_cast<char>(0xC0 | (code >> 6)));
+                out->push_back(static_cast<char>(0x80 | (code & 0x3F)));
+            } else if (code < 0x10000) {
+                out->push_back(static_cast<char>(0xE0 | (code >> 12)));
+                out->push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+                out->push_back(static_cast<char>(0x80 | (code & 0x3F)));
+            } else {
+                out->push_back(static_cast<char>(0xF0 | (code >> 18)));
+                out->push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+                out->push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+                out->push_back(static_cast<char>(0x80 | (code & 0x3F)));
+            }
+        }
+
+    }
+
+    bool JsonScanner::Value::Equals(const char* text) const
+    {
+        size_t length = std::strlen(text);
+        return static_cast<size_t>(end - begin) == length && std::memcmp(begin, text, length) == 0;
+    }
+
+    bool JsonScanner::Value::ToString(std::string* out) const
+    {
+        out->clear();
+        if (type != TYPE_STRING && type != TYPE_NUMBER) {
+            return false;
+        }
+
+        // エスケープが無ければそのままコピーする
+        const char* escape = static_cast<const char*>(std::memchr(begin, '\\', end - begin));
+        if (!escape) {
+            out->assign(begin, end);
+            return true;
+        }
+
+        out->reserve(end - begin);
+        out->assign(begin, escape);
+        for (const char* p = escape; p < end; ) {
+            if (*p != '\\') {
+                out->push_back(*p++);
+                continue;
+            }
+
+            if (++p >= end) {
+                return false;
+            }
+            char c = *p++;
+            switch (c) {
+            case '"':  out->push_back('"'); break;
+            case '\\': out->push_back('\\'); break;
+            case '/':  out->push_back('/'); break;
+            case 'b':  out->push_back('\b'); break;
+            case 'f':  out->push_back('\f'); break;
+            case 'n':  out->push_back('\n'); break;
+            case 'r':  out->push_back('\r'); break;
+            case 't':  out->push_back('\t'); break;
+            case 'u':
+            {
+                uint32_t code;
+                if (!ReadHex4(p, end, &code)) {
+                    return false;
+                }
+                p += 4;
+
+                // サロゲートペア
+                if (code >= 0xD800 && code < 0xDC00) {
+                    uint32_t low;
+                    if (end - p >= 6 && p[0] == '\\' && p[1] == 'u' &&
+                            ReadHex4(p + 2, end, &low) && low >= 0xDC00 && low < 0xE000) {
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        p += 6;
+                    }
+                }
+                AppendUTF8(out, code);
+            }
+                break;
+            default:
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool JsonScanner::Value::ToUInt32(uint32_t* out) const
+    {
+        // 文字列で書かれた数値も受け付ける
+        if ((type != TYPE_NUMBER && type != TYPE_STRING) || begin == end) {
+            return false;
+        }
+
+        uint64_t value = 0;
+        for (const char* p = begin; p < end; p++) {
+            if (*p < '0' || *p > '9') {
+                return false;
+            }
+            value = value * 10 + (*p - '0');
+            if (value > 0xFFFFFFFFULL) {
+                return false;
+            }
+        }
+        *out = static_cast<uint32_t>(value);
+        return true;
+    }
+
+    JsonScanner::JsonScanner(const char* begin, const char* end) :
+    pos_(begin),
+    end_(end),
+    opened_(false),
+    closed_(false),
+    first_(true),
+    error_(false)
+    {
+    }
+
+    JsonScanner::JsonScanner(const std::string& json) :
+    pos_(json.data()),
+    end_(json.data() + json.size()),
+    opened_(false),
+    closed_(false),
+    first_(true),
+    error_(false)
+    {
+    }
+
+    JsonScanner::JsonScanner(const Value& value) :
+    pos_(value.begin),
+    end_(value.end),
+    opened_(false),
+    closed_(false),
+    first_(true),
+    error_(false)
+    {
+    }
+
+    bool JsonScanner::NextMember(Value* key, Value* value)
+    {
+        if (!Open('{') || !Separator('}')) {
+            return false;
+        }
+
+        SkipSpace();
+        if (pos_ >= end_ || *pos_ != '"' || !ReadString(key)) {
+            return Fail();
+        }
+
+        SkipSpace();
+        if (pos_ >= end_ || *pos_ != ':') {
+            return Fail();
+        }
+        pos_++;
+
+        return ReadValue(value);
+    }
+
+    bool JsonScanner::NextElement(Value* value)
+    {
+        if (!Open('[') || !Separator(']')) {
+            return false;
+        }
+        return ReadValue(value);
+    }
+
+    bool JsonScanner::error() const
+    {
+        return error_;
+    }
+
+    bool JsonScanner::Open(char bracket)
+    {
+        if (error_ || closed_) {
+            return false;
+        }
+        if (!opened_) {
+            SkipSpace();
+            if (pos_ >= end_ || *pos_ != bracket) {
+                return Fail();
+            }
+            pos_++;
+            opened_ = true;
+        }
+        return true;
+    }
+
+    bool JsonScanner::Separator(char close)
+    {
+        SkipSpace();
+        if (pos_ >= end_) {
+            return Fail();
+        }
+
+        if (*pos_ == close) {
+            pos_++;
+            closed_ = true;
+            return false;
+        }
+
+        if (!first_) {
+            if (*pos_ != ',') {
+                return Fail();
+            }
+            pos_++;
+        }
+        first_ = false;
+        return true;
+    }
+
+    bool JsonScanner::ReadValue(Value* value)
+    {
+        SkipSpace();
+        if (pos_ >= end_) {
+            return Fail();
+        }
+
+        const char* begin = pos_;
+        switch (*pos_) {
+        case '"':
+            return ReadString(value);
+
+        case '{':
+        case '[':
+            value->type = (*pos_ == '{') ? TYPE_OBJECT : TYPE_ARRAY;
+            if (!SkipContainer()) {
+                return Fail();
+            }
+            break;
+
+        case 't':
+        case 'f':
+        case 'n':
+        {
+            const char* literal = (*pos_ == 't') ? "true" : (*pos_ == 'f') ? "false" : "null";
+            size_t length = std::strlen(literal);
+            if (static_cast<size_t>(end_ - pos_) < length || std::memcmp(pos_, literal, length) != 0) {
+                return Fail();
+            }
+            value->type = (*pos_ == 'n') ? TYPE_NULL : TYPE_BOOLEAN;
+            pos_ += length;
+        }
+            break;
+
+        default:
+            if (*pos_ != '-' && (*pos_ < '0' || *pos_ > '9')) {
+                return Fail();
+            }
+            while (pos_ < end_ && (std::strchr("+-.eE", *pos_) || (*pos_ >= '0' && *pos_ <= '9'))) {
+                pos_++;
+            }
+            value->type = TYPE_NUMBER;
+            break;
+        }
+
+        value->begin = begin;
+        value->end = pos_;
+        return true;
+    }
+
+    bool JsonScanner::ReadString(Value* value)
+    {
+        const char* begin = ++pos_;
+        while (pos_ < end_) {
+            if (*pos_ == '"') {
+                value->type = TYPE_STRING;
+                value->begin = begin;
+                value->end = pos_++;
+                return true;
+            } else if (*pos_ == '\\') {
+                pos_++;
+            }
+            pos_++;
+        }
+        return Fail();
+    }
+
+    bool JsonScanner::SkipContainer()
+    {
+        // 括弧の対応だけを見て読み飛ばす
+        char stack[MAX_NESTING];
+        int depth = 0;
+
+        while (pos_ < end_) {
+            char c = *pos_++;
+            if (c == '"') {
+                while (pos_ < end_ && *pos_ != '"') {
+                    if (*pos_ == '\\') {
+                        pos_++;
+                    }
+                    pos_++;
+                }
+                if (pos_ >= end_) {
+                    return false;
+                }
+                pos_++;
+            } else if (c == '{' || c == '[') {
+                if (depth >= MAX_NESTING) {
+                    return false;
+                }
+                stack[depth++] = (c == '{') ? '}' : ']';
+            } else if (c == '}' || c == ']') {
+                if (depth == 0 || stack[--depth] != c) {
+                    return false;
+                }
+                if (depth == 0) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void JsonScanner::SkipSpace()
+    {
+        while (pos_ < end_ && (*pos_ == ' ' || *pos_ == '\t' || *pos_ == '\n' || *pos_ == '\r')) {
+            pos_++;
+        }
+    }
+
+    bool JsonScanner::Fail()
+    {
+        error_ = true;
+        return false;
+    }
+
+}
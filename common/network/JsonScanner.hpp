@@ -0,0 +1,79 @@
+﻿//
+// JsonScanner.hpp
+//
+
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+namespace network {
+
+    //
+    // DOMを作らずにJSONを先頭から読み進めるスキャナ
+    //
+    // 値は元の文字列の範囲として返すので、必要な項目だけを取り出せる
+    // 入れ子のオブジェクトや配列は読み飛ばすか、値の範囲から別のスキャナを作って読む
+    // 元の文字列はスキャナより長く生存している必要がある
+    //
+
+    class JsonScanner {
+        public:
+            enum Type {
+                TYPE_NONE,
+                TYPE_OBJECT,
+                TYPE_ARRAY,
+                TYPE_STRING,
+                TYPE_NUMBER,
+                TYPE_BOOLEAN,
+                TYPE_NULL
+            };
+
+            // 文字列は引用符を除いた範囲で、エスケープは解釈していない
+            // オブジェクトと配列は括弧を含む範囲
+            struct Value {
+                Value() : type(TYPE_NONE), begin(nullptr), end(nullptr) {}
+
+                bool Equals(const char* text) const;
+                bool ToString(std::string* out) const;
+                bool ToUInt32(uint32_t* out) const;
+
+                Type type;
+                const char* begin;
+                const char* end;
+            };
+
+        public:
+            JsonScanner(const char* begin, const char* end);
+            explicit JsonScanner(const std::string& json);
+            explicit JsonScanner(const Value& value);
+
+            // オブジェクトの次のメンバーを読む
+            // 終端に達するか、不正な入力であればfalseを返す
+            bool NextMember(Value* key, Value* value);
+
+            // 配列の次の要素を読む
+            bool NextElement(Value* value);
+
+            // 途中で不正な入力があったか
+            bool error() const;
+
+        private:
+            bool Open(char bracket);
+            bool Separator(char close);
+            bool ReadValue(Value* value);
+            bool ReadString(Value* value);
+            bool SkipContainer();
+            void SkipSpace();
+            bool Fail();
+
+        private:
+            const char* pos_;
+            const char* end_;
+            bool opened_;
+            bool closed_;
+            bool first_;
+            bool error_;
+    };
+
+}
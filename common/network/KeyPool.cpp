@@ -0,0 +1,78 @@
+﻿//
+// KeyPool.cpp
+//
+
+#include <osrng.h>
+#include "KeyPool.hpp"
+
+namespace network {
+
+using namespace CryptoPP;
+
+KeyPool::KeyPool(size_t size) :
+    size_(size),
+    stop_(false),
+    thread_(boost::bind(&KeyPool::Run, this))
+{
+}
+
+KeyPool::~KeyPool()
+{
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        stop_ = true;
+    }
+    condition_.notify_all();
+    thread_.join();
+}
+
+KeyPool::KeyPair KeyPool::Take()
+{
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (!pairs_.empty()) {
+            KeyPair pair = pairs_.front();
+            pairs_.pop_front();
+            condition_.notify_all();
+            return pair;
+        }
+    }
+    return Generate();
+}
+
+size_t KeyPool::available() const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    return pairs_.size();
+}
+
+KeyPool::KeyPair KeyPool::Generate()
+{
+    AutoSeededRandomPool rnd;
+    InvertibleRSAFunction params;
+    params.GenerateRandomWithKeySize(rnd, RSA_KEY_LENGTH);
+
+    KeyPair pair;
+    pair.private_key = RSA::PrivateKey(params);
+    pair.public_key = RSA::PublicKey(params);
+    return pair;
+}
+
+void KeyPool::Run()
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!stop_) {
+        if (pairs_.size() >= size_) {
+            condition_.wait(lock);
+            continue;
+        }
+
+        // 生成中はロックを外し、Takeを待たせない
+        lock.unlock();
+        KeyPair pair = Generate();
+        lock.lock();
+        pairs_.push_back(pair);
+    }
+}
+
+}
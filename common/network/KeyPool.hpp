@@ -0,0 +1,47 @@
+﻿//
+// KeyPool.hpp
+//
+
+#pragma once
+
+#include <deque>
+#include <boost/thread.hpp>
+#include <rsa.h>
+
+#define RSA_KEY_LENGTH (3072)
+
+namespace network {
+
+// 事前に生成しておくRSA鍵ペアの在庫
+// 鍵の生成には数百ミリ秒かかるため、別スレッドで常にsize個を用意しておく
+class KeyPool {
+    public:
+        struct KeyPair {
+            CryptoPP::RSA::PrivateKey private_key;
+            CryptoPP::RSA::PublicKey public_key;
+        };
+
+    public:
+        KeyPool(size_t size);
+        ~KeyPool();
+
+        // 在庫がなければその場で生成する
+        KeyPair Take();
+        size_t available() const;
+
+        static KeyPair Generate();
+
+    private:
+        void Run();
+
+    private:
+        size_t size_;
+        bool stop_;
+        std::deque<KeyPair> pairs_;
+
+        mutable boost::mutex mutex_;
+        boost::condition_variable condition_;
+        boost::thread thread_;
+};
+
+}
@@ -0,0 +1,246 @@
+//
+// PositionDelta.cpp
+//
+
+#include "PositionDelta.hpp"
+#include "Utils.hpp"
+#include <boost/foreach.hpp>
+
+namespace network {
+
+    namespace {
+
+        enum {
+            FLAG_KEYFRAME = 0x01
+        };
+
+        enum {
+            MASK_X =     0x01,
+            MASK_Y =     0x02,
+            MASK_Z =     0x04,
+            MASK_THETA = 0x08,
+            MASK_VY =    0x10
+        };
+
+        uint32_t ZigZag(int32_t value)
+        {
+            return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+        }
+
+        int32_t UnZigZag(uint32_t value)
+        {
+            return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+        }
+
+        class Reader {
+            public:
+                explicit Reader(const std::string& data) : data_(data), offset_(0), error_(false) {}
+
+                uint32_t ReadVarint()
+                {
+                    uint32_t value = 0;
+                    int length = Utils::DeserializeVarint(data_.data() + offset_, data_.size() - offset_, &value);
+                    if (length <= 0) {
+                        error_ = true;
+                        return 0;
+                    }
+                    offset_ += length;
+                    return value;
+                }
+
+                int32_t ReadZigZag()
+                {
+                    return UnZigZag(ReadVarint());
+                }
+
+                uint8_t ReadByte()
+                {
+                    if (offset_ >= data_.size()) {
+                        error_ = true;
+                        return 0;
+                    }
+                    return static_cast<uint8_t>(data_[offset_++]);
+                }
+
+                bool error() const
+                {
+                    return error_;
+                }
+
+            private:
+                const std::string& data_;
+                size_t offset_;
+                bool error_;
+        };
+
+    }
+
+    PositionDeltaEncoder::PositionDeltaEncoder() :
+        next_index_(0),
+        sequence_(0),
+        frames_since_keyframe_(0),
+        keyframe_requested_(true)
+    {
+    }
+
+    void PositionDeltaEncoder::RequestKeyframe()
+    {
+        keyframe_requested_ = true;
+    }
+
+    std::string PositionDeltaEncoder::Encode(const std::vector<PositionDeltaEntry>& entries, uint32_t skip_id)
+    {
+        bool keyframe = keyframe_requested_ ||
+            frames_since_keyframe_ >= POSITION_DELTA_KEYFRAME_INTERVAL ||
+            next_index_ + entries.size() > POSITION_DELTA_MAX_INDEX;
+
+        if (keyframe) {
+            slots_.clear();
+            next_index_ = 0;
+        }
+
+        std::string body;
+        uint32_t count = 0;
+        BOOST_FOREACH(const auto& entry, entries) {
+            if (entry.first == skip_id) {
+                continue;
+            }
+            const PlayerPosition& pos = entry.second;
+
+            auto it = slots_.find(entry.first);
+            if (it == slots_.end()) {
+                Slot slot = {next_index_++, pos};
+                slots_[entry.first] = slot;
+
+                body += Utils::SerializeVarint((slot.index << 1) | 1);
+                body += Utils::SerializeVarint(entry.first);
+                body += Utils::SerializeVarint(ZigZag(pos.x));
+                body += Utils::SerializeVarint(ZigZag(pos.y));
+                body += Utils::SerializeVarint(ZigZag(pos.z));
+                body += static_cast<char>(pos.theta);
+                body += static_cast<char>(pos.vy);
+            } else {
+                PlayerPosition& base = it->second.base;
+                uint8_t mask = (pos.x != base.x ? MASK_X : 0) |
+                               (pos.y != base.y ? MASK_Y : 0) |
+                               (pos.z != base.z ? MASK_Z : 0) |
+                               (pos.theta != base.theta ? MASK_THETA : 0) |
+                               (pos.vy != base.vy ? MASK_VY : 0);
+                if (mask == 0) {
+                    continue;
+                }
+
+                body += Utils::SerializeVarint(it->second.index << 1);
+                body += static_cast<char>(mask);
+                if (mask & MASK_X) {
+                    body += Utils::SerializeVarint(ZigZag(pos.x - base.x));
+                }
+                if (mask & MASK_Y) {
+                    body += Utils::SerializeVarint(ZigZag(pos.y - base.y));
+                }
+                if (mask & MASK_Z) {
+                    body += Utils::SerializeVarint(ZigZag(pos.z - base.z));
+                }
+                if (mask & MASK_THETA) {
+                    body += static_cast<char>(pos.theta);
+                }
+                if (mask & MASK_VY) {
+                    body += static_cast<char>(pos.vy);
+                }
+                base = pos;
+            }
+            count++;
+        }
+
+        if (count == 0 && !keyframe) {
+            return std::string();
+        }
+
+        if (keyframe) {
+            keyframe_requested_ = false;
+            frames_since_keyframe_ = 0;
+        } else {
+            frames_since_keyframe_++;
+        }
+
+        return static_cast<char>(keyframe ? FLAG_KEYFRAME : 0)
+            + Utils::SerializeVarint(++sequence_)
+            + Utils::SerializeVarint(count)
+            + body;
+    }
+
+    PositionDeltaDecoder::PositionDeltaDecoder() :
+        sequence_(0),
+        synchronized_(false)
+    {
+    }
+
+    bool PositionDeltaDecoder::Decode(const std::string& data, std::vector<PositionDeltaEntry>* entries)
+    {
+        Reader reader(data);
+        uint8_t flags = reader.ReadByte();
+        uint32_t sequence = reader.ReadVarint();
+        uint32_t count = reader.ReadVarint();
+        if (reader.error()) {
+            return false;
+        }
+
+        if (flags & FLAG_KEYFRAME) {
+            slots_.clear();
+            synchronized_ = true;
+        } else if (!synchronized_ || sequence != sequence_ + 1) {
+            // 基準となるフレームを取りこぼした
+            synchronized_ = false;
+            return false;
+        }
+        sequence_ = sequence;
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t header = reader.ReadVarint();
+            uint16_t index = header >> 1;
+
+            if (header & 1) {
+                PositionDeltaEntry entry;
+                entry.first = reader.ReadVarint();
+                entry.second.x = reader.ReadZigZag();
+                entry.second.y = reader.ReadZigZag();
+                entry.second.z = reader.ReadZigZag();
+                entry.second.theta = reader.ReadByte();
+                entry.second.vy = reader.ReadByte();
+                slots_[index] = entry;
+            } else {
+                auto it = slots_.find(index);
+                if (it == slots_.end()) {
+                    synchronized_ = false;
+                    return false;
+                }
+                PlayerPosition& pos = it->second.second;
+                uint8_t mask = reader.ReadByte();
+                if (mask & MASK_X) {
+                    pos.x += reader.ReadZigZag();
+                }
+                if (mask & MASK_Y) {
+                    pos.y += reader.ReadZigZag();
+                }
+                if (mask & MASK_Z) {
+                    pos.z += reader.ReadZigZag();
+                }
+                if (mask & MASK_THETA) {
+                    pos.theta = reader.ReadByte();
+                }
+                if (mask & MASK_VY) {
+                    pos.vy = reader.ReadByte();
+                }
+            }
+
+            if (reader.error()) {
+                synchronized_ = false;
+                return false;
+            }
+            entries->push_back(slots_[index]);
+        }
+
+        return true;
+    }
+
+}
@@ -0,0 +1,65 @@
+//
+// PositionDelta.hpp
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+#include "../database/AccountProperty.hpp"
+
+#define POSITION_DELTA_KEYFRAME_INTERVAL (100)
+#define POSITION_DELTA_MAX_INDEX (4096)
+
+namespace network {
+
+    //
+    // 位置の差分符号化
+    //
+    // フレーム: [flags] [sequence] [entry count] [entry]...
+    // エントリ: [index << 1 | new]
+    //   new  : [user id] [x] [y] [z] [theta] [vy]  (絶対値)
+    //   差分 : [mask] [dx] [dy] [dz] [theta] [vy]  (maskで示した項目のみ)
+    // 整数は可変長、座標はジグザグ符号化する
+    // キーフレームで両端の索引と基準値をリセットする
+    //
+
+    typedef std::pair<uint32_t, PlayerPosition> PositionDeltaEntry;
+
+    class PositionDeltaEncoder {
+        public:
+            PositionDeltaEncoder();
+
+            // skip_idのエントリは含めない 送るものがなければ空文字列を返す
+            std::string Encode(const std::vector<PositionDeltaEntry>& entries, uint32_t skip_id);
+            void RequestKeyframe();
+
+        private:
+            struct Slot {
+                uint16_t index;
+                PlayerPosition base;
+            };
+
+            std::unordered_map<uint32_t, Slot> slots_;
+            uint16_t next_index_;
+            uint32_t sequence_;
+            int frames_since_keyframe_;
+            bool keyframe_requested_;
+    };
+
+    class PositionDeltaDecoder {
+        public:
+            PositionDeltaDecoder();
+
+            // 基準となるフレームが欠けている場合はfalseを返す キーフレームを要求すること
+            bool Decode(const std::string& data, std::vector<PositionDeltaEntry>* entries);
+
+        private:
+            std::unordered_map<uint16_t, PositionDeltaEntry> slots_;
+            uint32_t sequence_;
+            bool synchronized_;
+    };
+
+}
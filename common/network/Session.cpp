@@ -15,7 +15,16 @@ namespace network {
     Session::Session(boost::asio::io_service& io_service_tcp) :
       io_service_tcp_(io_service_tcp),
       socket_tcp_(io_service_tcp),
+      strand_(io_service_tcp),
       encryption_(false),
+      send_length_framing_(false),
+      receive_length_framing_(false),
+      protocol_version_(0),
+      receive_escape_(false),
+      receive_stuffed_size_(0),
+      send_queue_depth_(0),
+      datagram_send_sequence_(0),
+      datagram_receive_sequence_(0),
       online_(true),
       login_(false),
       read_start_time_(time(nullptr) - BYTE_AVERAGE_REFRESH_SECONDS),
@@ -43,20 +52,32 @@ namespace network {
 
     void Session::Send(const Command& command)
     {
-        auto msg = Serialize(command, command.plain());
-        write_byte_sum_ += msg.size();
-        UpdateWriteByteAverage();
+        Send(boost::make_shared<const SharedFrame>(command));
+    }
 
-		// Logger::Debug(_T("%d byte/s"), GetWriteByteAverage()); ※ 
+    void Session::Send(const SharedFramePtr& frame)
+    {
+        // 暗号化のストリーム状態を壊さないよう、暗号化もstrand上で行う
+        strand_.post(boost::bind(&Session::DoWriteTCP, this, frame, shared_from_this()));
+    }
 
-        io_service_tcp_.post(boost::bind(&Session::DoWriteTCP, this, msg, shared_from_this()));
+    void Session::Post(const std::function<void()>& handler)
+    {
+        auto session_holder = shared_from_this();
+        strand_.post([handler, session_holder](){
+            handler();
+        });
     }
 
     void Session::SyncSend(const Command& command)
     {
-        auto msg = Serialize(command, command.plain());
+        SharedFrame frame(command);
+        auto msg = *Serialize(frame);
         write_byte_sum_ += msg.size();
+        serialized_byte_sum_ += frame.original_size();
+        compressed_byte_sum_ += frame.payload().size();
         UpdateWriteByteAverage();
+        OnWrite(frame, 0);
 
         try {
             boost::asio::write(
@@ -67,6 +88,45 @@ namespace network {
         }
     }
 
+    std::string Session::SerializeDatagram(const Command& command, uint8_t sender)
+    {
+        // 平文の先頭にも連番を入れ、復号結果と照合する
+        uint32_t sequence = ++datagram_send_sequence_;
+        auto plain = Utils::Serialize(sequence, static_cast<uint8_t>(command.header())) + command.body();
+        return Utils::Serialize(static_cast<uint8_t>(header::DATAGRAM_HEADER), sequence)
+            + encrypter_.EncryptDatagram(sender, sequence, plain);
+    }
+
+    bool Session::DeserializeDatagram(const std::string& datagram, uint8_t sender,
+        header::CommandHeader* header, std::string* body)
+    {
+        const size_t prefix_size = sizeof(uint8_t) + sizeof(uint32_t);
+        if (datagram.size() < prefix_size + sizeof(uint32_t) + sizeof(uint8_t)) {
+            return false;
+        }
+
+        uint8_t datagram_header;
+        uint32_t sequence;
+        Utils::Deserialize(datagram, &datagram_header, &sequence);
+        if (datagram_header != header::DATAGRAM_HEADER ||
+            sequence <= datagram_receive_sequence_) {
+            return false;
+        }
+
+        auto plain = encrypter_.DecryptDatagram(sender, sequence, datagram.substr(prefix_size));
+        uint32_t plain_sequence;
+        uint8_t plain_header;
+        Utils::Deserialize(plain, &plain_sequence, &plain_header);
+        if (plain_sequence != sequence) {
+            return false;
+        }
+
+        datagram_receive_sequence_ = sequence;
+        *header = static_cast<header::CommandHeader>(plain_header);
+        *body = plain.substr(sizeof(plain_sequence) + sizeof(plain_header));
+        return true;
+    }
+
     double Session::GetReadByteAverage() const
     {
         return 1.0f * read_byte_sum_ / (time(nullptr) - read_start_time_);
@@ -81,7 +141,7 @@ namespace network {
     {
         auto elapsed_time = time(nullptr) - read_start_time_;
         if (elapsed_time >= BYTE_AVERAGE_REFRESH_SECONDS) {
-            read_byte_sum_ /= 2;
+            read_byte_sum_ -= read_byte_sum_ / 2;
             read_start_time_ = time(nullptr) - elapsed_time / 2;
         }
     }
@@ -90,7 +150,7 @@ namespace network {
     {
         auto elapsed_time = time(nullptr) - write_start_time_;
         if (elapsed_time >= BYTE_AVERAGE_REFRESH_SECONDS) {
-            write_byte_sum_ /= 2;
+            write_byte_sum_ -= write_byte_sum_ / 2;
             write_start_time_ = time(nullptr) - elapsed_time / 2;
         }
     }
@@ -106,10 +166,44 @@ namespace network {
 	}
 
     void Session::EnableEncryption()
+    {
+        // 先に送信要求されたコマンドは平文のまま送る
+        strand_.post(boost::bind(&Session::DoEnableEncryption, this, shared_from_this()));
+    }
+
+    void Session::DoEnableEncryption(SessionPtr session_holder)
     {
         encryption_ = true;
     }
 
+    void Session::SendAndEnableLengthFraming(const Command& command)
+    {
+        // 他のスレッドからの送信が間に入らないよう、書き込みと切り替えを同じハンドラで行う
+        strand_.post(boost::bind(&Session::DoEnableSendLengthFraming, this,
+            boost::make_shared<const SharedFrame>(command), shared_from_this()));
+    }
+
+    void Session::DoEnableSendLengthFraming(SharedFramePtr frame, SessionPtr session_holder)
+    {
+        DoWriteTCP(frame, session_holder);
+        send_length_framing_ = true;
+    }
+
+    void Session::EnableReceiveLengthFraming()
+    {
+        receive_length_framing_ = true;
+    }
+
+    uint16_t Session::protocol_version() const
+    {
+        return protocol_version_;
+    }
+
+    void Session::set_protocol_version(uint16_t version)
+    {
+        protocol_version_ = version;
+    }
+
     Encrypter& Session::encrypter()
     {
         return encrypter_;
@@ -130,6 +224,16 @@ namespace network {
         id_ = id;
     }
 
+    const std::string& Session::pending_public_key() const
+    {
+        return pending_public_key_;
+    }
+
+    void Session::set_pending_public_key(const std::string& public_key)
+    {
+        pending_public_key_ = public_key;
+    }
+
 	unsigned char Session::channel() const
 	{
 		return channel_;
@@ -174,6 +278,11 @@ namespace network {
         return compressed_byte_sum_;
     }
 
+    size_t Session::send_queue_depth() const
+    {
+        return send_queue_depth_;
+    }
+
     bool Session::operator==(const Session& s)
     {
         return id_ == s.id_;
@@ -196,43 +305,41 @@ namespace network {
 
     std::string Session::Serialize(const Command& command, bool plain)
     {
-        assert(command.header() < 0xFF);
-        auto header = static_cast<uint8_t>(command.header());
-        std::string body = command.body();
-
-        std::string msg = Utils::Serialize(header) + body;
+        assert(command.plain() == plain);
+        return *Serialize(SharedFrame(command));
+    }
 
-		if (plain) {
-			auto length = Utils::Serialize(static_cast<unsigned int>(msg.size()));
-			return length + msg;
+    SharedBuffer Session::Serialize(const SharedFrame& frame)
+    {
+		if (frame.plain()) {
+			return frame.encoded();
+		} else if (!encryption_) {
+			// 暗号化しない場合は全セッションで同じバイト列を使う
+			return send_length_framing_ ? frame.length_prefixed() : frame.encoded();
 		} else {
-			// 圧縮
-			if (body.size() >= COMPRESS_MIN_LENGTH) {
-				auto compressed = Utils::LZ4Compress(msg);
-				if (msg.size() > compressed.size() + sizeof(uint8_t)) {
-					assert(msg.size() < 65535);
-					msg = Utils::Serialize(static_cast<uint8_t>(header::LZ4_COMPRESS_HEADER),
-						static_cast<uint16_t>(msg.size()))
-						+ compressed;
-				}
-			}
-
 			// 暗号化
-			if (encryption_) {
-				msg = Utils::Serialize(static_cast<uint8_t>(header::ENCRYPT_HEADER))
-					+ encrypter_.Encrypt(msg);
+			auto msg = Utils::Serialize(static_cast<uint8_t>(header::ENCRYPT_HEADER))
+				+ encrypter_.Encrypt(frame.payload());
+			if (send_length_framing_) {
+				return boost::make_shared<const std::string>(Utils::SerializeVarint(msg.size()) + msg);
+			} else {
+				return boost::make_shared<const std::string>(Utils::Encode(msg));
 			}
-			return Utils::Encode(msg);
 		}
-
     }
 
     Command Session::Deserialize(const std::string& msg)
     {
-        std::string decoded_msg = Utils::Decode(msg);
-
         uint8_t header;
-        Utils::Deserialize(decoded_msg, &header);
+        Utils::Deserialize(msg, &header);
+
+        // 暗号化も圧縮もされていなければそのまま取り出す
+        if (header != header::ENCRYPT_HEADER && header != header::LZ4_COMPRESS_HEADER) {
+            return Command(static_cast<header::CommandHeader>(header),
+                msg.substr(sizeof(header)), shared_from_this());
+        }
+
+        std::string decoded_msg = msg;
 
         // 復号
         if (header == header::ENCRYPT_HEADER) {
@@ -258,88 +365,191 @@ namespace network {
     void Session::ReceiveTCP(const boost::system::error_code& error)
     {
         if (!error) {
-            std::string buffer(boost::asio::buffer_cast<const char*>(receive_buf_.data()),receive_buf_.size());
-            auto length = buffer.find_last_of(NETWORK_UTILS_DELIMITOR);
+            // 受信バッファをコピーせずにその場で走査する
+            // 末尾の不完全なメッセージも復号済みの状態で次回に持ち越す
+            auto size = ParseStuffedStream(
+                boost::asio::buffer_cast<const char*>(receive_buf_.data()), receive_buf_.size());
+            receive_buf_.consume(size);
+
+            if (receive_length_framing_) {
+                ReadLengthFramed();
+            } else {
+                boost::asio::async_read_until(socket_tcp_,
+                    receive_buf_, NETWORK_UTILS_DELIMITOR,
+                    strand_.wrap(boost::bind(
+                      &Session::ReceiveTCP, shared_from_this(),
+                      boost::asio::placeholders::error)));
+            }
 
-            if (length != std::string::npos) {
+        } else {
+            FatalError();
+        }
+    }
 
-                receive_buf_.consume(length+1);
-                buffer.erase(length+1);
+    size_t Session::ParseStuffedStream(const char* data, size_t size)
+    {
+        size_t begin = 0;
+        for (size_t i = 0; i < size; i++) {
+            const char c = data[i];
+            if (c != NETWORK_UTILS_DELIMITOR && c != 0x7d && !receive_escape_) {
+                continue;
+            }
+
+            // 特殊文字の直前までをまとめて追加
+            receive_msg_.append(data + begin, i - begin);
+            receive_stuffed_size_ += i - begin;
+            begin = i + 1;
 
-                while (!buffer.empty()) {
-                    std::string msg;
-					msg.reserve(buffer.size());
+            if (c == NETWORK_UTILS_DELIMITOR) {
+                read_byte_sum_ += receive_stuffed_size_;
+                UpdateReadByteAverage();
 
-                    while (!buffer.empty() && buffer[0]!=NETWORK_UTILS_DELIMITOR)
-                    {
-                        msg += buffer[0];
-                        buffer.erase(0,1);
-                    }
-                    buffer.erase(0,1);
+                FetchTCP(receive_msg_);
 
-                    read_byte_sum_ += msg.size();
-                    UpdateReadByteAverage();
+                // 確保済みの領域は次のメッセージで再利用する
+                receive_msg_.clear();
+                receive_stuffed_size_ = 0;
+                receive_escape_ = false;
 
-                    FetchTCP(msg);
+                // 長さ付きフレームに切り替わった場合、残りはそちらで読む
+                if (receive_length_framing_) {
+                    return i + 1;
                 }
+            } else if (receive_escape_) {
+                receive_msg_ += static_cast<char>(c ^ 0x20);
+                receive_stuffed_size_++;
+                receive_escape_ = false;
+            } else {
+                receive_stuffed_size_++;
+                receive_escape_ = true;
+            }
+        }
 
-                boost::asio::async_read_until(socket_tcp_,
-                    receive_buf_, NETWORK_UTILS_DELIMITOR,
-                    boost::bind(
-                      &Session::ReceiveTCP, shared_from_this(),
-                      boost::asio::placeholders::error));
+        receive_msg_.append(data + begin, size - begin);
+        receive_stuffed_size_ += size - begin;
+        return size;
+    }
+
+    void Session::ReceiveLengthFramedTCP(const boost::system::error_code& error)
+    {
+        if (!error) {
+            ReadLengthFramed();
+        } else {
+            FatalError();
+        }
+    }
 
+    void Session::ReadLengthFramed()
+    {
+        // 受信済みの完全なフレームをすべて処理する
+        size_t required_size = 0;
+        bool header_ready = false;
+        while (required_size == 0) {
+            auto data = boost::asio::buffer_cast<const char*>(receive_buf_.data());
+            auto size = receive_buf_.size();
+
+            // ヘッダが揃っていない時は長さが設定されない
+            uint32_t length = 0;
+            int header_size = Utils::DeserializeVarint(data, size, &length);
+            if (header_size < 0 || length > MAX_FRAME_LENGTH) {
+                Logger::Error(_T("Invalid frame length"));
+                FatalError();
+                return;
+            } else if (header_size == 0) {
+                required_size = 1;
+            } else if (size < header_size + length) {
+                required_size = header_size + length - size;
+                header_ready = true;
+            } else {
+                receive_msg_.assign(data + header_size, length);
+                receive_buf_.consume(header_size + length);
+
+                read_byte_sum_ += header_size + length;
+                UpdateReadByteAverage();
+
+                FetchTCP(receive_msg_);
             }
+        }
 
+        // ヘッダが揃っていなければ届いた分だけ、本体は残りのサイズちょうどを読む
+        if (!header_ready) {
+            boost::asio::async_read(socket_tcp_, receive_buf_,
+                boost::asio::transfer_at_least(1),
+                strand_.wrap(boost::bind(
+                  &Session::ReceiveLengthFramedTCP, shared_from_this(),
+                  boost::asio::placeholders::error)));
         } else {
-            FatalError();
+            boost::asio::async_read(socket_tcp_, receive_buf_,
+                boost::asio::transfer_exactly(required_size),
+                strand_.wrap(boost::bind(
+                  &Session::ReceiveLengthFramedTCP, shared_from_this(),
+                  boost::asio::placeholders::error)));
         }
     }
 
-    void Session::DoWriteTCP(const std::string msg, SessionPtr session_holder)
+    void Session::DoWriteTCP(SharedFramePtr frame, SessionPtr session_holder)
     {
-        bool write_in_progress = !send_queue_.empty();
-        send_queue_.push(msg);
-        if (!write_in_progress && !send_queue_.empty())
-        {
-           
-          auto s = boost::make_shared<std::string>(msg.data(), msg.size());
+        auto msg = Serialize(*frame);
+        write_byte_sum_ += msg->size();
+        serialized_byte_sum_ += frame->original_size();
+        compressed_byte_sum_ += frame->payload().size();
+        UpdateWriteByteAverage();
+
+        send_queue_.push_back(std::move(msg));
+        send_queue_depth_ = send_queue_.size() + writing_buffers_.size();
+        OnWrite(*frame, send_queue_depth_);
 
-          boost::asio::async_write(socket_tcp_,
-              boost::asio::buffer(s->data(), s->size()),
-              boost::bind(&Session::WriteTCP, this,
-                boost::asio::placeholders::error, s, session_holder));
+        if (writing_buffers_.empty()) {
+            StartWriteTCP(session_holder);
         }
     }
 
-    void Session::WriteTCP(const boost::system::error_code& error,
-		boost::shared_ptr<std::string> holder, SessionPtr session_holder)
+    void Session::StartWriteTCP(SessionPtr session_holder)
     {
+        // 書き込み中に溜まったメッセージをまとめて一度に書き込む
+        std::vector<boost::asio::const_buffer> buffers;
+        size_t total_size = 0;
+        while (!send_queue_.empty() && buffers.size() < SEND_GATHER_MAX_BUFFERS) {
+            const auto& msg = send_queue_.front();
+            if (!buffers.empty() && total_size + msg->size() > SEND_GATHER_MAX_BYTES) {
+                break;
+            }
+            buffers.push_back(boost::asio::buffer(msg->data(), msg->size()));
+            total_size += msg->size();
+
+            writing_buffers_.push_back(std::move(send_queue_.front()));
+            send_queue_.pop_front();
+        }
+
+        boost::asio::async_write(socket_tcp_, buffers,
+            strand_.wrap(boost::bind(&Session::WriteTCP, this,
+              boost::asio::placeholders::error, session_holder)));
+    }
+
+    void Session::WriteTCP(const boost::system::error_code& error, SessionPtr session_holder)
+    {
+        writing_buffers_.clear();
         if (!error) {
             if (!send_queue_.empty()) {
-                  send_queue_.pop();
-                  if (!send_queue_.empty())
-                  {
-
-                    boost::shared_ptr<std::string> s = 
-                        boost::make_shared<std::string>(send_queue_.front().data(), send_queue_.front().size());
-
-                    boost::asio::async_write(socket_tcp_,
-                        boost::asio::buffer(s->data(), s->size()),
-                        boost::bind(&Session::WriteTCP, this,
-                          boost::asio::placeholders::error, s, session_holder));
-                  }
+                StartWriteTCP(session_holder);
             }
         } else {
+            send_queue_.clear();
             FatalError(session_holder);
         }
+        send_queue_depth_ = send_queue_.size() + writing_buffers_.size();
     }
 
     void Session::FetchTCP(const std::string& msg)
     {
         if (msg.size() >= sizeof(uint8_t)) {
             if (on_receive_) {
-                (*on_receive_)(Deserialize(msg));
+                auto command = Deserialize(msg);
+                if (header::IsConnectionError(command.header())) {
+                    Logger::Error(_T("Invalid command header"));
+                    return;
+                }
+                (*on_receive_)(command);
             }
         } else {
             Logger::Error(_T("Too short data"));
@@ -350,9 +560,12 @@ namespace network {
     {
         if (online_) {
             online_ = false;
+            OnOffline();
             if (on_receive_) {
-                if (id_ > 0) {
-                    (*on_receive_)(UserFatalConnectionError(id_));
+                if (auto id = id_.load()) {
+                    // 再ログインしたセッションと見分けられるよう、自分を付けて通知する
+                    (*on_receive_)(Command(header::UserFatalConnectionError,
+                        Utils::Serialize(static_cast<uint32_t>(id)), shared_from_this()));
                 } else {
                     (*on_receive_)(FatalConnectionError());
                 }
@@ -360,6 +573,14 @@ namespace network {
         }
     }
 
+    void Session::OnOffline()
+    {
+    }
+
+    void Session::OnWrite(const SharedFrame& frame, size_t queue_depth)
+    {
+    }
+
     void Session::set_on_receive(CallbackFuncPtr func)
     {
         on_receive_ = func;
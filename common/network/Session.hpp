@@ -12,13 +12,23 @@
 #include <stdint.h>
 #include <string>
 #include <queue>
+#include <deque>
+#include <vector>
 #include <memory>
+#include <atomic>
 #include "Encrypter.hpp"
 #include "Command.hpp"
+#include "SharedFrame.hpp"
 
 #define BYTE_AVERAGE_REFRESH_SECONDS (30)
 #define COMPRESSED_FLAG (0x00010000)
 #define COMPRESS_MIN_LENGTH (100)
+#define MAX_FRAME_LENGTH (4194304)
+#define SEND_GATHER_MAX_BUFFERS (64)
+#define SEND_GATHER_MAX_BYTES (65536)
+#define DATAGRAM_SENDER_CLIENT (0)
+#define DATAGRAM_SENDER_SERVER (1)
+#define UDP_TEST_PACKET_MESSAGE "MMO UDP Test Packet"
 
 namespace network {
 
@@ -40,11 +50,28 @@ namespace network {
             virtual void Start() = 0;
             virtual void Close();
             void Send(const Command&);
+            void Send(const SharedFramePtr&);
             void SyncSend(const Command&);
-            void UDPSend(const Command&);
+
+            // このセッションのstrand上で実行する
+            void Post(const std::function<void()>& handler);
+
+            // UDPデータグラム 送信者ごとの連番を付けて個別に暗号化する
+            std::string SerializeDatagram(const Command& command, uint8_t sender);
+            // 復号できないもの・受信済みより古いものはfalse
+            bool DeserializeDatagram(const std::string& datagram, uint8_t sender,
+                header::CommandHeader* header, std::string* body);
 
             void EnableEncryption();
 
+            // 長さ付きフレーム commandを従来の形式で送り、以降は長さ付きで送る
+            void SendAndEnableLengthFraming(const Command& command);
+            // 受信コールバック内から呼ぶこと 以降のデータを長さ付きフレームとして読む
+            void EnableReceiveLengthFraming();
+
+            uint16_t protocol_version() const;
+            void set_protocol_version(uint16_t version);
+
             double GetReadByteAverage() const;
             double GetWriteByteAverage() const;
 
@@ -57,20 +84,27 @@ namespace network {
             void set_on_receive(CallbackFuncPtr);
 
             UserID id() const;
-            void set_id(UserID id);
+            virtual void set_id(UserID id);
+            // 持ち主であることを確かめる前の公開鍵 確かめるまではidは0のまま
+            // ハンドシェイク中のstrand上でのみ触る
+            const std::string& pending_public_key() const;
+            void set_pending_public_key(const std::string& public_key);
             bool online() const;
 
 			unsigned char channel() const;
-			void set_channel(unsigned char channel);
+			virtual void set_channel(unsigned char channel);
 
             std::string global_ip() const;
             uint16_t udp_port() const;
             void set_global_ip(const std::string& global_ip);
-            void set_udp_port(uint16_t udp_port);
+            virtual void set_udp_port(uint16_t udp_port);
 
             int serialized_byte_sum() const;
             int compressed_byte_sum() const;
 
+            // 送信待ちと書き込み中のメッセージの数
+            size_t send_queue_depth() const;
+
 			int write_average_limit() const;
 			void set_write_average_limit(int limit);
 
@@ -82,28 +116,52 @@ namespace network {
             void UpdateWriteByteAverage();
 
             std::string Serialize(const Command& command, bool plain);
+            SharedBuffer Serialize(const SharedFrame& frame);
             Command Deserialize(const std::string& msg);
 
             void ReceiveTCP(const boost::system::error_code& error);
-            void DoWriteTCP(const std::string, SessionPtr session_holder);
-            void WriteTCP(const boost::system::error_code& error,
-					 boost::shared_ptr<std::string> holder, SessionPtr session_holder);
+            size_t ParseStuffedStream(const char* data, size_t size);
+            void ReceiveLengthFramedTCP(const boost::system::error_code& error);
+            void ReadLengthFramed();
+            void DoWriteTCP(SharedFramePtr frame, SessionPtr session_holder);
+            void DoEnableEncryption(SessionPtr session_holder);
+            void DoEnableSendLengthFraming(SharedFramePtr frame, SessionPtr session_holder);
+            void StartWriteTCP(SessionPtr session_holder);
+            void WriteTCP(const boost::system::error_code& error, SessionPtr session_holder);
             void FetchTCP(const std::string&);
 
             void FatalError(SessionPtr session_holder = SessionPtr());
 
+            // 切断を検知してオフラインになった時に呼ばれる
+            virtual void OnOffline();
+            // 送信キューに積んだ時に呼ばれる
+            virtual void OnWrite(const SharedFrame& frame, size_t queue_depth);
+
         protected:
             // ソケット
             boost::asio::io_service& io_service_tcp_;
             tcp::socket socket_tcp_;
 
+            // 同一セッションのハンドラを直列化する
+            boost::asio::io_service::strand strand_;
+
             // 暗号化通信
             Encrypter encrypter_;
             bool encryption_;
 
+            // フレーム形式
+            bool send_length_framing_;
+            bool receive_length_framing_;
+            uint16_t protocol_version_;
+
             // 送受信のためのバッファ
             boost::asio::streambuf receive_buf_;
-            std::queue<std::string> send_queue_;
+            std::string receive_msg_;
+            bool receive_escape_;
+            int receive_stuffed_size_;
+            std::deque<SharedBuffer> send_queue_;
+            std::vector<SharedBuffer> writing_buffers_;
+            std::atomic<size_t> send_queue_depth_;
 
             CallbackFuncPtr on_receive_;
 
@@ -111,17 +169,23 @@ namespace network {
             std::string global_ip_;
             uint16_t udp_port_;
 
-            bool online_;
+            // UDPデータグラムの連番
+            std::atomic<uint32_t> datagram_send_sequence_;
+            uint32_t datagram_receive_sequence_;
+
+            std::atomic<bool> online_;
             bool login_;
 
             time_t read_start_time_, write_start_time_;
-            int read_byte_sum_, write_byte_sum_;
-            int serialized_byte_sum_, compressed_byte_sum_;
+            // SyncSend はストランドの外から加算するのでアトミックにする
+            std::atomic<int> read_byte_sum_, write_byte_sum_;
+            std::atomic<int> serialized_byte_sum_, compressed_byte_sum_;
 			
 			int write_average_limit_;
 
-            UserID id_;
-			unsigned char channel_;
+            std::atomic<UserID> id_;
+            std::string pending_public_key_;
+			std::atomic<unsigned char> channel_;
     };
 
 }
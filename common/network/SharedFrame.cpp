@@ -0,0 +1,92 @@
+﻿//
+// SharedFrame.cpp
+//
+
+#include "SharedFrame.hpp"
+#include "Session.hpp"
+#include "Utils.hpp"
+#include <boost/make_shared.hpp>
+
+namespace network {
+
+    SharedFrame::SharedFrame(const Command& command) :
+        plain_(command.plain()),
+        header_(static_cast<uint8_t>(command.header())),
+        original_size_(sizeof(uint8_t) + command.body().size())
+    {
+        if (plain_) {
+            assert(command.header() < 0xFF);
+            payload_ = Utils::Serialize(static_cast<uint8_t>(command.header())) + command.body();
+        } else {
+            payload_ = BuildPayload(command);
+        }
+    }
+
+    bool SharedFrame::plain() const
+    {
+        return plain_;
+    }
+
+    uint8_t SharedFrame::header() const
+    {
+        return header_;
+    }
+
+    size_t SharedFrame::original_size() const
+    {
+        return original_size_;
+    }
+
+    const std::string& SharedFrame::payload() const
+    {
+        return payload_;
+    }
+
+    SharedBuffer SharedFrame::encoded() const
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (!encoded_) {
+            if (plain_) {
+                auto length = Utils::Serialize(static_cast<unsigned int>(payload_.size()));
+                encoded_ = boost::make_shared<const std::string>(length + payload_);
+            } else {
+                encoded_ = boost::make_shared<const std::string>(Utils::Encode(payload_));
+            }
+        }
+        return encoded_;
+    }
+
+    SharedBuffer SharedFrame::length_prefixed() const
+    {
+        assert(!plain_);
+        boost::mutex::scoped_lock lock(mutex_);
+        if (!length_prefixed_) {
+            length_prefixed_ = boost::make_shared<const std::string>(
+                Utils::SerializeVarint(payload_.size()) + payload_);
+        }
+        return length_prefixed_;
+    }
+
+    std::string SharedFrame::BuildPayload(const Command& command)
+    {
+        assert(command.header() < 0xFF);
+        auto header = static_cast<uint8_t>(command.header());
+        const std::string& body = command.body();
+
+        std::string msg = Utils::Serialize(header) + body;
+
+        // 圧縮
+        if (body.size() >= COMPRESS_MIN_LENGTH) {
+            auto compressed = Utils::LZ4Compress(msg);
+            if (msg.size() > compressed.size() + sizeof(uint8_t)) {
+                assert(msg.size() < 65535);
+                msg = Utils::Serialize(static_cast<uint8_t>(header::LZ4_COMPRESS_HEADER),
+                    static_cast<uint16_t>(msg.size()))
+                    + compressed;
+            }
+        }
+
+        return msg;
+    }
+
+}
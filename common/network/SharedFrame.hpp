@@ -0,0 +1,52 @@
+﻿//
+// SharedFrame.hpp
+//
+
+#pragma once
+
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include "Command.hpp"
+
+namespace network {
+
+    typedef boost::shared_ptr<const std::string> SharedBuffer;
+
+    // 複数のセッションへ送るためのフレーム
+    // ヘッダ付加とLZ4圧縮は一度だけ行い、暗号化とバイトスタッフィングのみセッションごとに行う
+    class SharedFrame {
+        public:
+            explicit SharedFrame(const Command& command);
+
+            bool plain() const;
+            uint8_t header() const;
+
+            // 圧縮前の大きさ
+            size_t original_size() const;
+
+            // 圧縮済みの平文 (暗号化前)
+            const std::string& payload() const;
+
+            // 暗号化しないセッション向けの送信用バイト列 全セッションで共有する
+            SharedBuffer encoded() const;
+
+            // 長さ付きフレームのセッション向け
+            SharedBuffer length_prefixed() const;
+
+            static std::string BuildPayload(const Command& command);
+
+        private:
+            bool plain_;
+            uint8_t header_;
+            size_t original_size_;
+            std::string payload_;
+
+            mutable boost::mutex mutex_;
+            mutable SharedBuffer encoded_;
+            mutable SharedBuffer length_prefixed_;
+    };
+
+    typedef boost::shared_ptr<const SharedFrame> SharedFramePtr;
+
+}
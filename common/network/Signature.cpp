@@ -10,6 +10,7 @@
 #include "Signature.hpp"
 #include "Utils.hpp"
 #include "Encrypter.hpp"
+#include "KeyPool.hpp"
 #include "../Logger.hpp"
 
 namespace network {
@@ -17,14 +18,35 @@ namespace network {
 using namespace CryptoPP;
 
 
-Signature::Signature(const std::string& filename)
+Signature::Signature(const std::string& filename) :
+    key_generation_(0)
 {
-    AutoSeededRandomPool rnd;
-    InvertibleRSAFunction params;
-    params.GenerateRandomWithKeySize(rnd, 3072);
-
-    private_key_ = RSA::PrivateKey(params);
-    public_key_ = RSA::PublicKey(params);
+    using namespace boost::filesystem;
+
+    // 検証用の公開鍵
+    if (path(filename).extension() == ".pub") {
+        if (exists(filename)) {
+            Load(filename, false);
+        }
+        return;
+    }
+
+    if (exists(filename)) {
+        if (Load(filename, true)) {
+            return;
+        }
+        // 読めなかった鍵ファイルは上書きせず、この起動の間だけ使う鍵を作る
+        Logger::Error("Cannot load signing key: %s", filename);
+        auto pair = KeyPool::Generate();
+        private_key_ = pair.private_key;
+        public_key_ = pair.public_key;
+    } else {
+        Logger::Info("Generating signing key: %s", filename);
+        auto pair = KeyPool::Generate();
+        private_key_ = pair.private_key;
+        public_key_ = pair.public_key;
+        Save(filename);
+    }
 }
 
 Signature::~Signature()
@@ -35,7 +57,16 @@ Signature::~Signature()
 std::string Signature::Sign(const std::string& in)
 {
     AutoSeededRandomPool rng;
-    RSASS<PSSR, SHA1>::Signer signer(private_key_);
+
+    uint32_t key_generation = key_generation_;
+    if (!signer_.get()) {
+        signer_.reset(new ThreadSigner());
+    }
+    if (!signer_->signer || signer_->key_generation != key_generation) {
+        signer_->signer.reset(new Signer(private_key_));
+        signer_->key_generation = key_generation;
+    }
+    Signer& signer = *signer_->signer;
  
     size_t length = signer.MaxSignatureLength();
     SecByteBlock signature(length);
@@ -89,6 +120,54 @@ void Signature::SetPrivateKey(const std::string& in)
     ByteQueue queue;
     queue.Put((const byte*)in.data(), in.size());
     private_key_.Load(queue);
+    key_generation_++;
+}
+
+bool Signature::Load(const std::string& filename, bool private_key)
+{
+    std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+    std::string key((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    if (key.empty()) {
+        return false;
+    }
+
+    try {
+        if (private_key) {
+            SetPrivateKey(key);
+            public_key_ = RSA::PublicKey(private_key_);
+        } else {
+            SetPublicKey(key);
+        }
+    } catch (const std::exception& e) {
+        Logger::Error("%s", e.what());
+        return false;
+    }
+    return true;
+}
+
+void Signature::Save(const std::string& filename)
+{
+    // 秘密鍵と、クライアントに配布する公開鍵(.pub)
+    // 秘密鍵は書き込む前に所有者だけが読めるようにしておく
+    std::ofstream private_ofs(filename, std::ios::out | std::ios::binary);
+    boost::system::error_code error;
+    boost::filesystem::permissions(filename,
+        boost::filesystem::owner_read | boost::filesystem::owner_write, error);
+    if (error) {
+        // 誰でも読める秘密鍵は残さない
+        Logger::Error("Cannot restrict signing key permissions: %s", filename);
+        private_ofs.close();
+        boost::filesystem::remove(filename, error);
+        return;
+    }
+    private_ofs << GetPrivateKey();
+
+    std::ofstream public_ofs(filename + ".pub", std::ios::out | std::ios::binary);
+    public_ofs << GetPublicKey();
+
+    if (!private_ofs || !public_ofs) {
+        Logger::Error("Cannot save signing key: %s", filename);
+    }
 }
 
 }
@@ -5,13 +5,19 @@
 #pragma once
 
 #include <string>
+#include <memory>
+#include <atomic>
+#include <boost/thread.hpp>
 #include <rsa.h>
+#include <pssr.h>
 
 namespace network {
 
 class Signature {
     public:
         Signature();
+        // 秘密鍵のファイルがあれば読み込み、なければ生成して保存する
+        // 拡張子が.pubのファイルは検証用の公開鍵として読むだけ
         Signature(const std::string& filename);
         ~Signature();
 
@@ -23,9 +29,26 @@ class Signature {
         std::string GetPrivateKey();
         void SetPrivateKey(const std::string&);
 
+    private:
+        bool Load(const std::string& filename, bool private_key);
+        void Save(const std::string& filename);
+
     public:
         CryptoPP::RSA::PrivateKey private_key_;
         CryptoPP::RSA::PublicKey public_key_;
+
+    private:
+        typedef CryptoPP::RSASS<CryptoPP::PSSR, CryptoPP::SHA1>::Signer Signer;
+
+        // 署名のたびに作り直さない
+        // Signerはスレッド安全ではないので、ロックせずにスレッドごとに持つ
+        struct ThreadSigner {
+            std::unique_ptr<Signer> signer;
+            uint32_t key_generation;
+        };
+        boost::thread_specific_ptr<ThreadSigner> signer_;
+        // 秘密鍵を変えたら増やし、古い鍵のSignerを作り直させる
+        std::atomic<uint32_t> key_generation_;
 };
 
 }
@@ -61,6 +61,34 @@ namespace network {
             return out;
         }
 
+        std::string SerializeVarint(uint32_t value)
+        {
+            std::string out;
+            while (value >= 0x80) {
+                out += static_cast<char>((value & 0x7f) | 0x80);
+                value >>= 7;
+            }
+            out += static_cast<char>(value);
+            return out;
+        }
+
+        int DeserializeVarint(const char* data, size_t size, uint32_t* value)
+        {
+            uint32_t result = 0;
+            for (size_t i = 0; i < 5; i++) {
+                if (i >= size) {
+                    return 0;
+                }
+                auto c = static_cast<uint8_t>(data[i]);
+                result |= static_cast<uint32_t>(c & 0x7f) << (7 * i);
+                if (!(c & 0x80)) {
+                    *value = result;
+                    return i + 1;
+                }
+            }
+            return -1;
+        }
+
         std::string ToHexString(const std::string& in)
         {
             std::string out;
@@ -5,6 +5,7 @@
 
 #include <string>
 #include <tuple>
+#include <stdint.h>
 #include <boost/format.hpp>
 
 #define NETWORK_UTILS_DELIMITOR (0x7e)
@@ -17,6 +18,11 @@ namespace network {
         std::string ByteStuffingEncode(const std::string&);
         std::string ByteStuffingDecode(const std::string&);
 
+        // 可変長整数 (下位7bitずつ、最上位bitが継続フラグ)
+        std::string SerializeVarint(uint32_t value);
+        // 読み込んだバイト数を返す データが足りない場合は0、不正な場合は-1
+        int DeserializeVarint(const char* data, size_t size, uint32_t* value);
+
         std::string Base64Encode(const std::string&);
         std::string Base64Decode(const std::string&);
 
@@ -9,8 +9,32 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <assert.h>
 
+// Fieldの順に対応するプロパティ
+static const AccountProperty FIELD_PROPERTIES[] = {
+    REVISION,
+    PUBLIC_KEY,
+    LOGIN,
+    CHANNEL,
+    NAME,
+    MODEL_NAME,
+    TRIP,
+    IP_ADDRESS,
+    UDP_PORT
+};
+
+Account::UserRecord::UserRecord() :
+present(0),
+revision(0),
+login(0),
+channel(0),
+udp_port(0)
+{
+    std::fill(field_revision, field_revision + FIELD_COUNT, 0);
+}
+
 Account::Account() :
 revision_(0),
+profile_revision_(0),
 max_user_id_(0)
 {
 }
@@ -19,7 +43,76 @@ Account::~Account()
 {
 }
 
-void Account::LoadInitializeData(UserID user_id, std::string data)
+void Account::OpenJournal(const std::string& path)
+{
+    boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+
+    // 復元中の変更は記録しない
+    journal_.reset();
+    std::unique_ptr<AccountJournal> journal(new AccountJournal(path));
+
+    size_t count = journal->Replay([this](const AccountJournal::Record& record){
+        UserID user_id = record.user_id;
+        max_user_id_ = std::max(max_user_id_, user_id);
+        switch (record.property) {
+            case PUBLIC_KEY:
+                SetString(user_id, FIELD_PUBLIC_KEY, STRING_PUBLIC_KEY, record.value, false);
+                fingerprint_map_[network::Encrypter::GetHash(record.value)] = user_id;
+                break;
+            case NAME:
+                SetString(user_id, FIELD_NAME, STRING_NAME, record.value);
+                break;
+            case MODEL_NAME:
+                SetString(user_id, FIELD_MODEL_NAME, STRING_MODEL_NAME, record.value);
+                break;
+            case TRIP:
+                SetString(user_id, FIELD_TRIP, STRING_TRIP, record.value);
+                break;
+            default:
+                ;
+        }
+    });
+
+    // 上書きされた記録が多ければ詰め直す
+    std::vector<AccountJournal::Record> records;
+    for (UserID user_id = 1; user_id < records_.size(); user_id++) {
+        if (!(records_[user_id].present & (1 << FIELD_PUBLIC_KEY))) {
+            continue;
+        }
+        const std::string* strings = &strings_[user_id * STRING_FIELD_COUNT];
+        AccountJournal::Record record;
+        record.user_id = user_id;
+
+        record.property = PUBLIC_KEY;
+        record.value = strings[STRING_PUBLIC_KEY];
+        records.push_back(record);
+
+        if (records_[user_id].present & (1 << FIELD_NAME)) {
+            record.property = NAME;
+            record.value = strings[STRING_NAME];
+            records.push_back(record);
+        }
+        if (records_[user_id].present & (1 << FIELD_MODEL_NAME)) {
+            record.property = MODEL_NAME;
+            record.value = strings[STRING_MODEL_NAME];
+            records.push_back(record);
+        }
+        if (records_[user_id].present & (1 << FIELD_TRIP)) {
+            record.property = TRIP;
+            record.value = strings[STRING_TRIP];
+            records.push_back(record);
+        }
+    }
+    Logger::Info("Account journal: %d users, %d records", fingerprint_map_.size(), count);
+    if (count > records.size() * 2) {
+        journal->Rewrite(records);
+        Logger::Info("Account journal compacted to %d records", records.size());
+    }
+
+    journal_ = std::move(journal);
+}
+
+void Account::LoadInitializeData(UserID user_id, std::string data, std::string* trip)
 {
     std::string buffer(data);
 
@@ -42,7 +135,12 @@ void Account::LoadInitializeData(UserID user_id, std::string data)
             {
                 std::string value;
                 buffer.erase(0, network::Utils::Deserialize(buffer, &value));
-                SetUserTrip(user_id, value);
+                // 消すだけなら軽いのでその場で行う
+                if (value.empty()) {
+                    SetUserTrip(user_id, value);
+                } else {
+                    *trip = value;
+                }
             }
                 break;
 
@@ -65,23 +163,40 @@ uint32_t Account::GetCurrentRevision()
     return revision_;
 }
 
+uint32_t Account::GetProfileRevision() const
+{
+    return profile_revision_;
+}
+
 std::string Account::GetUserRevisionPatch(UserID user_id, uint32_t revision)
 {
-    auto user_revison = GetUserRevision(user_id);
+    boost::unique_lock<boost::recursive_mutex> lock(mutex_);
     std::string patch;
+    if (user_id >= records_.size()) {
+        return patch;
+    }
 
-    if (user_revison > revision) {
-        patch += network::Utils::Serialize(user_id, user_revison);
-
-        UserMap::iterator usermap_it;
-        if ((usermap_it = user_map_.find(user_id)) != user_map_.end()) {
+    const UserRecord& record = records_[user_id];
+    if (record.revision > revision) {
+        patch += network::Utils::Serialize(user_id, record.revision);
 
-            PropertyMap& property_map = usermap_it->second;
+        const std::string* strings = &strings_[user_id * STRING_FIELD_COUNT];
+        for (int field = 0; field < FIELD_COUNT; field++) {
+            if (record.field_revision[field] <= revision) {
+                continue;
+            }
 
-            BOOST_FOREACH (auto& property, property_map) {
-                if (property.second.revision > revision) {
-                    patch += network::Utils::Serialize((uint16_t)property.first) + property.second.value;
-                }
+            patch += network::Utils::Serialize((uint16_t)FIELD_PROPERTIES[field]);
+            switch (field) {
+                case FIELD_REVISION:   patch += network::Utils::Serialize(record.revision); break;
+                case FIELD_LOGIN:      patch += network::Utils::Serialize(record.login); break;
+                case FIELD_CHANNEL:    patch += network::Utils::Serialize(record.channel); break;
+                case FIELD_UDP_PORT:   patch += network::Utils::Serialize(record.udp_port); break;
+                case FIELD_PUBLIC_KEY: patch += network::Utils::Serialize(strings[STRING_PUBLIC_KEY]); break;
+                case FIELD_NAME:       patch += network::Utils::Serialize(strings[STRING_NAME]); break;
+                case FIELD_MODEL_NAME: patch += network::Utils::Serialize(strings[STRING_MODEL_NAME]); break;
+                case FIELD_TRIP:       patch += network::Utils::Serialize(strings[STRING_TRIP]); break;
+                case FIELD_IP_ADDRESS: patch += network::Utils::Serialize(strings[STRING_IP_ADDRESS]); break;
             }
         }
     }
@@ -91,18 +206,11 @@ std::string Account::GetUserRevisionPatch(UserID user_id, uint32_t revision)
 
 void Account::Remove(UserID user_id)
 {
-	// 30分後に削除
-	boost::thread t([this, user_id](){
-
-		boost::this_thread::sleep(boost::posix_time::minutes(30));
-
-		char login;
-		Get(user_id, LOGIN, &login);
-		if (!login) {
-			boost::unique_lock<boost::recursive_mutex> lock(mutex_);
-			user_map_.erase(user_id);
-		}
-	});
+	// 一覧から外す 公開鍵や名前は再ログインに備えて残す
+	boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+	if (user_id < records_.size() && !records_[user_id].login) {
+		records_[user_id].present &= ~(1 << FIELD_LOGIN);
+	}
 }
 
 /*
@@ -137,20 +245,18 @@ void Account::ApplyRevisionPatch(const std::string& patch)
 
 UserID Account::GetUserIdFromFingerPrint(const std::string& finger_print)
 {
-	return 0;
-    //FingerprintMap::iterator it;
-    //if ((it = fingerprint_map_.find(finger_print)) != fingerprint_map_.end()) {
-    //    return it->second;
-    //} else {
-    //    return 0;
-    //}
+    boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+    FingerprintMap::iterator it;
+    if ((it = fingerprint_map_.find(finger_print)) != fingerprint_map_.end()) {
+        return it->second;
+    } else {
+        return 0;
+    }
 }
 
 std::string Account::GetPublicKey(UserID user_id)
 {
-    std::string value;
-    Get(user_id, PUBLIC_KEY, &value);
-    return value;
+    return GetString(user_id, STRING_PUBLIC_KEY);
 }
 
 UserID Account::RegisterPublicKey(const std::string& public_key)
@@ -158,14 +264,16 @@ UserID Account::RegisterPublicKey(const std::string& public_key)
     UserID user_id = 0;
     std::string finger_print = network::Encrypter::GetHash(public_key);
 
-    if (GetUserIdFromFingerPrint(finger_print) == 0) {
+    boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+    user_id = GetUserIdFromFingerPrint(finger_print);
+    if (user_id == 0) {
         // ユーザーIDを発行
         user_id = ++max_user_id_;
         fingerprint_map_[finger_print] = user_id;
 
         SetUserName(user_id, "???");
-        Set(user_id, PUBLIC_KEY, public_key, false);
-        Set(user_id, REVISION, (uint32_t)1, false);
+        SetString(user_id, FIELD_PUBLIC_KEY, STRING_PUBLIC_KEY, public_key, false);
+        Set(user_id, FIELD_REVISION, &UserRecord::revision, (uint32_t)1, false);
     }
 
     return user_id;
@@ -173,12 +281,12 @@ UserID Account::RegisterPublicKey(const std::string& public_key)
 
 void Account::LogIn(UserID user_id)
 {
-    Set(user_id, LOGIN, (char)1);
+    Set(user_id, FIELD_LOGIN, &UserRecord::login, (char)1);
 }
 
 void Account::LogOut(UserID user_id)
 {
-    Set(user_id, LOGIN, (char)0);
+    Set(user_id, FIELD_LOGIN, &UserRecord::login, (char)0);
 }
 
 void Account::LogOutAll()
@@ -190,92 +298,79 @@ void Account::LogOutAll()
 
 std::string Account::GetUserName(UserID user_id) const
 {
-    std::string name;
-    Get(user_id, NAME, &name);
-    return name;
+    return GetString(user_id, STRING_NAME);
 }
 
 void Account::SetUserName(UserID user_id, const std::string& name)
 {
     if (name.size() > 0 && name.size() <= 32) {
-        Set(user_id, NAME, name);
+        SetString(user_id, FIELD_NAME, STRING_NAME, name);
     }
 }
 
 std::string Account::GetUserTrip(UserID user_id) const
 {
-    std::string trip;
-    Get(user_id, TRIP, &trip);
-    return trip;
+    return GetString(user_id, STRING_TRIP);
 }
 
 void Account::SetUserTrip(UserID user_id, const std::string& trip)
 {
     if (trip.size() > 0 && trip.size() <= 256) {
-        Set(user_id, TRIP, network::Encrypter::GetTrip(trip));
+        SetString(user_id, FIELD_TRIP, STRING_TRIP, network::Encrypter::GetTrip(trip));
     } else {
-		Set(user_id, TRIP, std::string());
+		SetString(user_id, FIELD_TRIP, STRING_TRIP, std::string());
 	}
 }
 
 std::string Account::GetUserModelName(UserID user_id) const
 {
-    std::string name;
-    Get(user_id, MODEL_NAME, &name);
-    return name;
+    return GetString(user_id, STRING_MODEL_NAME);
 }
 
 void Account::SetUserModelName(UserID user_id, const std::string& name)
 {
     if (name.size() > 0 && name.size() <= 64) {
-        Set(user_id, MODEL_NAME, name);
+        SetString(user_id, FIELD_MODEL_NAME, STRING_MODEL_NAME, name);
     }
 }
 
 std::string Account::GetUserIPAddress(UserID user_id) const
 {
-    std::string ip_address;
-    Get(user_id, IP_ADDRESS, &ip_address);
-    return ip_address;
+    return GetString(user_id, STRING_IP_ADDRESS);
 }
 void Account::SetUserIPAddress(UserID user_id, const std::string& ip_address)
 {
-    Set(user_id, IP_ADDRESS, ip_address);
+    SetString(user_id, FIELD_IP_ADDRESS, STRING_IP_ADDRESS, ip_address);
 }
 
 uint16_t Account::GetUserUDPPort(UserID user_id) const
 {
-    uint16_t udp_port = 0;
-    Get(user_id, UDP_PORT, &udp_port);
-    return udp_port;
+    return Get(user_id, &UserRecord::udp_port);
 }
 
 void Account::SetUserUDPPort(UserID user_id, uint16_t udp_port)
 {
-    Set(user_id, UDP_PORT, udp_port);
+    Set(user_id, FIELD_UDP_PORT, &UserRecord::udp_port, udp_port);
 }
 
 uint32_t Account::GetUserRevision(UserID user_id) const
 {
-    uint32_t revision = 0;
-    Get(user_id, REVISION, &revision);
-    return revision;
+    return Get(user_id, &UserRecord::revision);
 }
 
 void Account::SetUserChannel(UserID user_id, unsigned char channel)
 {
-    Set(user_id, CHANNEL, channel);
+    Set(user_id, FIELD_CHANNEL, &UserRecord::channel, channel);
 }
 
 unsigned char Account::GetUserChannel(UserID user_id) const
 {
-    unsigned char channel = 0;
-    Get(user_id, CHANNEL, &channel);
-    return channel;
+    return Get(user_id, &UserRecord::channel);
 }
 
 void Account::SetUserPosition(UserID user_id, const PlayerPosition& pos)
 {
+    boost::unique_lock<boost::recursive_mutex> lock(mutex_);
     auto it = position_map_.find(user_id);
     if (it == position_map_.end()) {
         position_map_[user_id] = PlayerPosition();
@@ -285,6 +380,7 @@ void Account::SetUserPosition(UserID user_id, const PlayerPosition& pos)
 
 PlayerPosition Account::GetUserPosition(UserID user_id) const
 {
+    boost::unique_lock<boost::recursive_mutex> lock(mutex_);
     auto it = position_map_.find(user_id);
     if (it == position_map_.end()) {
         return PlayerPosition();
@@ -294,11 +390,84 @@ PlayerPosition Account::GetUserPosition(UserID user_id) const
 
 std::vector<UserID> Account::GetIDList() const
 {
+    boost::unique_lock<boost::recursive_mutex> lock(mutex_);
     std::vector<UserID> list;
-    for (auto it = user_map_.begin(); it != user_map_.end(); ++it) {
-		if (it->first != 0) {
-			list.push_back(it->first);
+    for (UserID user_id = 1; user_id < records_.size(); user_id++) {
+		if (records_[user_id].present & (1 << FIELD_LOGIN)) {
+			list.push_back(user_id);
 		}
     }
     return list;
 }
+
+void Account::SetString(UserID user_id, Field field, StringField string_field,
+        const std::string& value, bool revision)
+{
+	if (user_id == 0) {
+		Logger::Error(_T("Invalid session id"));
+		return;
+	}
+
+    boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+    UserRecord* found = Reserve(user_id);
+    if (!found) {
+        return;
+    }
+    UserRecord& record = *found;
+    std::string& current = strings_[user_id * STRING_FIELD_COUNT + string_field];
+    if (!(record.present & (1 << field)) || current != value) {
+        current = value;
+        Update(user_id, record, field, revision);
+
+        if (field == FIELD_NAME || field == FIELD_MODEL_NAME) {
+            profile_revision_++;
+        }
+
+        // IPアドレスは接続ごとに変わるので記録しない
+        if (journal_ && field != FIELD_IP_ADDRESS) {
+            AccountJournal::Record journal_record;
+            journal_record.user_id = user_id;
+            journal_record.property = FIELD_PROPERTIES[field];
+            journal_record.value = value;
+            journal_->Append(journal_record);
+        }
+    }
+}
+
+std::string Account::GetString(UserID user_id, StringField string_field) const
+{
+    boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+    if (user_id < records_.size()) {
+        return strings_[user_id * STRING_FIELD_COUNT + string_field];
+    }
+    return std::string();
+}
+
+Account::UserRecord* Account::Reserve(UserID user_id)
+{
+    // IDはクライアントから届くこともあるので、発行済みの範囲を超えて広げない
+    if (user_id > max_user_id_) {
+        Logger::Error(_T("Unknown user id: %d"), user_id);
+        return nullptr;
+    }
+    if (user_id >= records_.size()) {
+        records_.resize(user_id + 1);
+        strings_.resize((user_id + 1) * STRING_FIELD_COUNT);
+    }
+    return &records_[user_id];
+}
+
+void Account::Update(UserID user_id, UserRecord& record, Field field, bool revision)
+{
+    record.present |= (1 << field);
+
+    if (revision) {
+        uint32_t new_revision = record.revision + 1;
+        Logger::Debug("Userdata Update %d %d Revision: %d",
+                  user_id, FIELD_PROPERTIES[field], new_revision);
+
+        record.field_revision[field] = new_revision;
+        record.revision = new_revision;
+        record.present |= (1 << FIELD_REVISION);
+    }
+}
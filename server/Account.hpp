@@ -7,11 +7,15 @@
 #include <string>
 #include <map>
 #include <list>
+#include <vector>
 #include <unordered_map>
+#include <memory>
+#include <atomic>
 #include <stdint.h>
 #include "../common/database/AccountProperty.hpp"
 #include "../common/network/Utils.hpp"
 #include "../common/Logger.hpp"
+#include "AccountJournal.hpp"
 #include <boost/thread.hpp>
 
 typedef uint32_t UserID;
@@ -22,9 +26,15 @@ class Account {
         Account();
         ~Account();
 
-        void LoadInitializeData(UserID user_id, std::string data);
+        // 記録から復元し、以降の変更を記録する
+        void OpenJournal(const std::string& path);
+
+        // トリップは計算が重いので設定せず trip に返す 呼び出し元で SetUserTrip すること
+        void LoadInitializeData(UserID user_id, std::string data, std::string* trip);
 
         uint32_t GetCurrentRevision();
+        // 名前かモデル名が変わるたびに増える
+        uint32_t GetProfileRevision() const;
         std::string GetUserRevisionPatch(UserID user_id, uint32_t revision);
 
         UserID GetUserIdFromFingerPrint(const std::string&);
@@ -59,58 +69,79 @@ class Account {
         std::vector<UserID> GetIDList() const;
 
     private:
+        // プロパティの並び 差分パッチはこの順に出力する
+        enum Field {
+            FIELD_REVISION,
+            FIELD_PUBLIC_KEY,
+            FIELD_LOGIN,
+            FIELD_CHANNEL,
+            FIELD_NAME,
+            FIELD_MODEL_NAME,
+            FIELD_TRIP,
+            FIELD_IP_ADDRESS,
+            FIELD_UDP_PORT,
+            FIELD_COUNT
+        };
+
+        // 文字列のプロパティ 別の配列にユーザーごとに並べて置く
+        enum StringField {
+            STRING_PUBLIC_KEY,
+            STRING_NAME,
+            STRING_MODEL_NAME,
+            STRING_TRIP,
+            STRING_IP_ADDRESS,
+            STRING_FIELD_COUNT
+        };
+
+        // ユーザーIDで直接引く固定長のレコード
+        struct UserRecord {
+            UserRecord();
+            uint32_t present;
+            uint32_t revision;
+            char login;
+            unsigned char channel;
+            uint16_t udp_port;
+            uint32_t field_revision[FIELD_COUNT];
+        };
+
         template <class T>
-        void Set(UserID user_id, AccountProperty property, T value, bool revision = true)
+        void Set(UserID user_id, Field field, T UserRecord::*member, T value, bool revision = true)
         {
 			if (user_id == 0) {
 				Logger::Error(_T("Invalid session id"));
 				return;
 			}
 
-            T old_value;
-            if (!Get(user_id, property, &old_value) || old_value != value) {
-				boost::unique_lock<boost::recursive_mutex> lock(mutex_);
-
-                if (user_map_.find(user_id) == user_map_.end()) {
-                    user_map_[user_id] = PropertyMap();
-                }
-
-                user_map_[user_id][property].value = network::Utils::Serialize(value);
-
-                if (revision) {
-                    uint32_t new_revision = GetUserRevision(user_id) + 1;
-                    Logger::Debug("Userdata Update %d %d Revision: %d",
-                              user_id, property, new_revision);
-
-                    user_map_[user_id][property].revision = new_revision;
-                    Set(user_id, REVISION, new_revision, false);
-                }
+            boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+            UserRecord* record = Reserve(user_id);
+            if (record && (!(record->present & (1 << field)) || record->*member != value)) {
+                record->*member = value;
+                Update(user_id, *record, field, revision);
             }
         }
 
         template <class T>
-        bool Get(UserID user_id, AccountProperty property, T* value) const
+        T Get(UserID user_id, T UserRecord::*member) const
         {
-            UserMap::const_iterator usermap_it;
-            if ((usermap_it = user_map_.find(user_id)) != user_map_.end()) {
-                PropertyMap::const_iterator property_it;
-                if ((property_it = usermap_it->second.find(property)) != usermap_it->second.end()) {
-                    network::Utils::Deserialize(property_it->second.value, value);
-                    return true;
-                }
+            boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+            if (user_id < records_.size()) {
+                return records_[user_id].*member;
             }
-            return false;
+            return T();
         }
 
-        struct PropertyValue {
-            PropertyValue() : revision(0) {}
-            uint32_t revision;
-            std::string value;
-        };
+        void SetString(UserID user_id, Field field, StringField string_field,
+                const std::string& value, bool revision = true);
+        std::string GetString(UserID user_id, StringField string_field) const;
+
+        // 発行済みのIDの分だけ表を広げる 未発行のIDはnullptr
+        UserRecord* Reserve(UserID user_id);
+        void Update(UserID user_id, UserRecord& record, Field field, bool revision);
+
+        std::vector<UserRecord> records_;
+        std::vector<std::string> strings_;
 
-        typedef std::map<AccountProperty, PropertyValue> PropertyMap;
-        typedef std::map<UserID, PropertyMap> UserMap;
-        UserMap user_map_;
+        std::unique_ptr<AccountJournal> journal_;
 
         typedef std::unordered_map<std::string, UserID> FingerprintMap;
         FingerprintMap fingerprint_map_;
@@ -119,7 +150,8 @@ class Account {
         PositionMap position_map_;
 
         uint32_t revision_;
+        std::atomic<uint32_t> profile_revision_;
         UserID max_user_id_;
 
-		boost::recursive_mutex mutex_;
+		mutable boost::recursive_mutex mutex_;
 };
@@ -0,0 +1,143 @@
+//
+// AccountJournal.cpp
+//
+
+#include "AccountJournal.hpp"
+#include "../common/network/Utils.hpp"
+#include "../common/Logger.hpp"
+#include <iterator>
+#include <boost/filesystem.hpp>
+
+static const std::string JOURNAL_MAGIC("MMOACCT1");
+
+AccountJournal::AccountJournal(const std::string& path) :
+path_(path)
+{
+}
+
+AccountJournal::~AccountJournal()
+{
+}
+
+size_t AccountJournal::Replay(const ReplayFunc& func)
+{
+    std::string data;
+    {
+        std::ifstream ifs(path_.c_str(), std::ios::in | std::ios::binary);
+        if (ifs) {
+            data.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+        }
+    }
+
+    if (data.empty()) {
+        Open();
+        return 0;
+    }
+
+    // 作成直後に落ちるとヘッダーが書きかけで残る 記録は無いので書き直す
+    if (data.size() < JOURNAL_MAGIC.size()) {
+        Logger::Error("Account journal header is truncated (%d bytes discarded)", data.size());
+        boost::filesystem::resize_file(path_, 0);
+        Open();
+        return 0;
+    }
+
+    if (data.compare(0, JOURNAL_MAGIC.size(), JOURNAL_MAGIC) != 0) {
+        throw std::runtime_error("Invalid account journal: " + path_);
+    }
+
+    // 長さ(4) チェックサム(4) 本体 の繰り返し
+    size_t count = 0;
+    size_t offset = JOURNAL_MAGIC.size();
+    while (offset + 8 <= data.size()) {
+        uint32_t length, checksum;
+        network::Utils::Deserialize(data.substr(offset, 8), &length, &checksum);
+        if (offset + 8 + length > data.size()) {
+            break;
+        }
+
+        std::string body = data.substr(offset + 8, length);
+        if (Checksum(body) != checksum) {
+            break;
+        }
+
+        Record record;
+        uint16_t property;
+        network::Utils::Deserialize(body, &record.user_id, &property, &record.value);
+        record.property = static_cast<AccountProperty>(property);
+        func(record);
+
+        offset += 8 + length;
+        count++;
+    }
+
+    if (offset < data.size()) {
+        Logger::Error("Account journal is truncated at %d bytes (%d bytes discarded)",
+            offset, data.size() - offset);
+        boost::filesystem::resize_file(path_, offset);
+    }
+
+    Open();
+    return count;
+}
+
+void AccountJournal::Append(const Record& record)
+{
+    if (!ofs_.is_open()) {
+        Open();
+    }
+    ofs_ << Encode(record);
+    ofs_.flush();
+}
+
+void AccountJournal::Rewrite(const std::vector<Record>& records)
+{
+    std::string temp_path = path_ + ".tmp";
+    {
+        std::ofstream ofs(temp_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        ofs << JOURNAL_MAGIC;
+        for (auto it = records.begin(); it != records.end(); ++it) {
+            ofs << Encode(*it);
+        }
+        if (!ofs) {
+            Logger::Error("Failed to write %s", temp_path);
+            return;
+        }
+    }
+
+    ofs_.close();
+    boost::filesystem::rename(temp_path, path_);
+    Open();
+}
+
+void AccountJournal::Open()
+{
+    bool exists = boost::filesystem::exists(path_) && boost::filesystem::file_size(path_) > 0;
+    ofs_.close();
+    ofs_.clear();
+    ofs_.open(path_.c_str(), std::ios::out | std::ios::binary | std::ios::app);
+    if (!ofs_) {
+        throw std::runtime_error("Failed to open account journal: " + path_);
+    }
+    if (!exists) {
+        ofs_ << JOURNAL_MAGIC;
+        ofs_.flush();
+    }
+}
+
+std::string AccountJournal::Encode(const Record& record)
+{
+    std::string body = network::Utils::Serialize(record.user_id,
+        static_cast<uint16_t>(record.property), record.value);
+    return network::Utils::Serialize(static_cast<uint32_t>(body.size()), Checksum(body)) + body;
+}
+
+uint32_t AccountJournal::Checksum(const std::string& data)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (auto it = data.begin(); it != data.end(); ++it) {
+        hash = (hash ^ static_cast<uint8_t>(*it)) * 16777619u;
+    }
+    return hash;
+}
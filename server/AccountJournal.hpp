@@ -0,0 +1,47 @@
+//
+// AccountJournal.hpp
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <functional>
+#include <stdint.h>
+#include "../common/database/AccountProperty.hpp"
+
+// アカウント情報の追記型の記録
+// 変更のたびに末尾に追記し、起動時に先頭から読み直して復元する
+class AccountJournal {
+    public:
+        struct Record {
+            uint32_t user_id;
+            AccountProperty property;
+            std::string value;
+        };
+
+        typedef std::function<void(const Record&)> ReplayFunc;
+
+    public:
+        AccountJournal(const std::string& path);
+        ~AccountJournal();
+
+        // 記録を先頭から順に渡す 末尾の書きかけの記録やヘッダーは捨てて切り詰める
+        // 戻り値は読み出した記録の数
+        size_t Replay(const ReplayFunc& func);
+
+        void Append(const Record& record);
+
+        // 現在の内容だけを書いたファイルに置き換える
+        void Rewrite(const std::vector<Record>& records);
+
+    private:
+        void Open();
+        static std::string Encode(const Record& record);
+        static uint32_t Checksum(const std::string& data);
+
+    private:
+        std::string path_;
+        std::ofstream ofs_;
+};
@@ -0,0 +1,179 @@
+//
+// AddressMatcher.cpp
+//
+
+#include "AddressMatcher.hpp"
+#include "../common/network/Utils.hpp"
+#include <boost/algorithm/string.hpp>
+
+AddressMatcher::AddressMatcher() :
+v4_(1),
+v6_(1),
+size_(0)
+{
+}
+
+void AddressMatcher::Add(const std::string& pattern)
+{
+    if (pattern.empty()) {
+        return;
+    }
+
+    if (!ParsePrefix(pattern)) {
+        wildcard_patterns_.push_back(pattern);
+    }
+    size_++;
+}
+
+bool AddressMatcher::Match(const boost::asio::ip::address& address) const
+{
+    boost::asio::ip::address normalized = address;
+    if (address.is_v6() && address.to_v6().is_v4_mapped()) {
+        normalized = address.to_v6().to_v4();
+    }
+
+    if (normalized.is_v4()) {
+        auto bytes = normalized.to_v4().to_bytes();
+        if (Find(v4_, bytes.data(), 32)) {
+            return true;
+        }
+    } else {
+        auto bytes = normalized.to_v6().to_bytes();
+        if (Find(v6_, bytes.data(), 128)) {
+            return true;
+        }
+    }
+
+    if (!wildcard_patterns_.empty()) {
+        auto text = normalized.to_string();
+        for (auto it = wildcard_patterns_.begin(); it != wildcard_patterns_.end(); ++it) {
+            if (network::Utils::MatchWithWildcard(*it, text)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+size_t AddressMatcher::size() const
+{
+    return size_;
+}
+
+bool AddressMatcher::ParsePrefix(const std::string& pattern)
+{
+    boost::system::error_code error;
+
+    if (pattern == "*") {
+        unsigned char zero[16] = {0};
+        Insert(&v4_, zero, 0);
+        Insert(&v6_, zero, 0);
+        return true;
+    }
+
+    // CIDR表記
+    auto slash = pattern.find('/');
+    if (slash != std::string::npos) {
+        auto address = boost::asio::ip::address::from_string(pattern.substr(0, slash), error);
+        auto length_text = pattern.substr(slash + 1);
+        if (error || length_text.empty() || length_text.size() > 3 ||
+                length_text.find_first_not_of("0123456789") != std::string::npos) {
+            return false;
+        }
+
+        int length = std::stoi(length_text);
+        if (address.is_v4() && length <= 32) {
+            Insert(&v4_, address.to_v4().to_bytes().data(), length);
+            return true;
+        } else if (address.is_v6() && length <= 128) {
+            Insert(&v6_, address.to_v6().to_bytes().data(), length);
+            return true;
+        }
+        return false;
+    }
+
+    // 単一のアドレス
+    if (pattern.find_first_of("*?") == std::string::npos) {
+        auto address = boost::asio::ip::address::from_string(pattern, error);
+        if (error) {
+            return false;
+        } else if (address.is_v4()) {
+            Insert(&v4_, address.to_v4().to_bytes().data(), 32);
+        } else {
+            Insert(&v6_, address.to_v6().to_bytes().data(), 128);
+        }
+        return true;
+    }
+
+    // "192.168.*" "10.*.*.*" のように末尾のオクテットだけが*のもの
+    std::vector<std::string> parts;
+    boost::algorithm::split(parts, pattern, boost::is_any_of("."));
+    if (parts.size() > 4) {
+        return false;
+    }
+
+    unsigned char bytes[4] = {0};
+    size_t octets = 0;
+    while (octets < parts.size() && parts[octets] != "*") {
+        const auto& part = parts[octets];
+        if (part.empty() || part.size() > 3 ||
+                part.find_first_not_of("0123456789") != std::string::npos ||
+                (part.size() > 1 && part[0] == '0')) {
+            return false;
+        }
+        int value = std::stoi(part);
+        if (value > 255) {
+            return false;
+        }
+        bytes[octets++] = static_cast<unsigned char>(value);
+    }
+
+    if (octets == parts.size()) {
+        return false;
+    }
+    for (size_t i = octets; i < parts.size(); i++) {
+        if (parts[i] != "*") {
+            return false;
+        }
+    }
+
+    Insert(&v4_, bytes, static_cast<int>(octets * 8));
+    return true;
+}
+
+void AddressMatcher::Insert(Trie* trie, const unsigned char* bytes, int prefix_length)
+{
+    uint32_t node = 0;
+    for (int i = 0; i < prefix_length; i++) {
+        // より短い接頭辞で既に一致する
+        if ((*trie)[node].terminal) {
+            return;
+        }
+
+        int bit = (bytes[i / 8] >> (7 - i % 8)) & 1;
+        if ((*trie)[node].child[bit] == 0) {
+            (*trie)[node].child[bit] = static_cast<uint32_t>(trie->size());
+            trie->push_back(Node());
+        }
+        node = (*trie)[node].child[bit];
+    }
+    (*trie)[node].terminal = true;
+}
+
+bool AddressMatcher::Find(const Trie& trie, const unsigned char* bytes, int length)
+{
+    uint32_t node = 0;
+    for (int i = 0; i < length; i++) {
+        if (trie[node].terminal) {
+            return true;
+        }
+
+        int bit = (bytes[i / 8] >> (7 - i % 8)) & 1;
+        node = trie[node].child[bit];
+        if (node == 0) {
+            return false;
+        }
+    }
+    return trie[node].terminal;
+}
@@ -0,0 +1,43 @@
+//
+// AddressMatcher.hpp
+//
+
+#pragma once
+
+#include <string>
+#include <list>
+#include <vector>
+#include <stdint.h>
+#include <boost/asio.hpp>
+
+// IPアドレスのパターンを二分木にまとめたもの
+// "192.168.0.0/16" "2001:db8::/32" のようなCIDR表記と、
+// "192.168.*" のようなオクテット単位のワイルドカードを木に入れ、
+// それ以外のワイルドカードは従来通り文字列で照合する
+class AddressMatcher {
+    public:
+        AddressMatcher();
+
+        void Add(const std::string& pattern);
+        bool Match(const boost::asio::ip::address& address) const;
+
+        size_t size() const;
+
+    private:
+        struct Node {
+            Node() : terminal(false) { child[0] = child[1] = 0; }
+            uint32_t child[2];
+            bool terminal;
+        };
+        typedef std::vector<Node> Trie;
+
+        bool ParsePrefix(const std::string& pattern);
+        static void Insert(Trie* trie, const unsigned char* bytes, int prefix_length);
+        static bool Find(const Trie& trie, const unsigned char* bytes, int length);
+
+    private:
+        Trie v4_;
+        Trie v6_;
+        std::list<std::string> wildcard_patterns_;
+        size_t size_;
+};
@@ -31,9 +31,23 @@ namespace {
 			}
 		}
 	}
+
+	Logger::Level ParseLogLevel(const std::string& name)
+	{
+		if (name == "info") {
+			return Logger::LEVEL_INFO;
+		} else if (name == "error") {
+			return Logger::LEVEL_ERROR;
+		} else if (name == "none") {
+			return Logger::LEVEL_NONE;
+		} else {
+			return Logger::LEVEL_DEBUG;
+		}
+	}
 };
 
-Config::Config()
+Config::Config() :
+loaded_(false)
 {
 	Load();
 }
@@ -45,6 +59,7 @@ void Config::Load()
 		std::ifstream ifs;
 		ifs.open(CONFIG_JSON);
 		read_json(ifs, pt_);
+		loaded_ = true;
 	} catch(std::exception& e) {
 		Logger::Error(unicode::ToTString(e.what()));
 	}
@@ -54,6 +69,17 @@ void Config::Load()
     server_note_ =		pt_.get<std::string>("server_note", "");
 	stage_ =			pt_.get<std::string>("stage", unicode::ToString(_T("stage:ケロリン町")));
     capacity_ =			pt_.get<int>("capacity", 20);
+	threads_ =			pt_.get<int>("threads", 1);
+	position_update_rate_ =	pt_.get<int>("position_update_rate", 10);
+	interest_radius_ =		pt_.get<int>("interest_radius", 0);
+	interest_far_radius_ =	pt_.get<int>("interest_far_radius", 0);
+	interest_far_interval_ = pt_.get<int>("interest_far_interval", 5);
+	key_pool_size_ =	pt_.get<int>("key_pool_size", 0);
+	crypto_threads_ =	pt_.get<int>("crypto_threads", 2);
+	crypto_queue_limit_ = pt_.get<int>("crypto_queue_limit", 64);
+	account_journal_ =	pt_.get<std::string>("account_journal", "accounts.dat");
+	log_level_ =		ParseLogLevel(pt_.get<std::string>("log_level", "debug"));
+	metrics_port_ =		pt_.get<uint16_t>("metrics_port", 0);
 
 	public_ =			pt_.get<bool>("public", false);
 
@@ -63,25 +89,18 @@ void Config::Load()
 	auto patterns =		pt_.get_child("blocking_address_patterns", ptree());
 	BOOST_FOREACH(const auto& item, patterns) {
 		blocking_address_patterns_.push_back(item.second.get_value<std::string>());
+		blocking_address_matcher_.Add(blocking_address_patterns_.back());
 	}
 
 	auto lobby_servers = pt_.get_child("lobby_servers", ptree());
 	BOOST_FOREACH(const auto& item, lobby_servers) {
 		lobby_servers_.push_back(item.second.get_value<std::string>());
 	}
-	
-	if (exists(CONFIG_JSON)) {
-		timestamp_ = last_write_time(CONFIG_JSON);
-	}
 }
 
-void Config::Reload()
+bool Config::loaded() const
 {
-	if (exists(CONFIG_JSON) &&
-		timestamp_ < last_write_time(CONFIG_JSON)) {
-		Config::Load();
-		Logger::Info(_T("Configuration reloaded."));
-	}
+	return loaded_;
 }
 
 //
@@ -118,6 +137,61 @@ int Config::capacity() const
 	return capacity_;
 }
 
+int Config::threads() const
+{
+	return threads_;
+}
+
+int Config::position_update_rate() const
+{
+	return position_update_rate_;
+}
+
+int Config::interest_radius() const
+{
+	return interest_radius_;
+}
+
+int Config::interest_far_radius() const
+{
+	return interest_far_radius_;
+}
+
+int Config::interest_far_interval() const
+{
+	return interest_far_interval_;
+}
+
+int Config::key_pool_size() const
+{
+	return key_pool_size_;
+}
+
+int Config::crypto_threads() const
+{
+	return crypto_threads_;
+}
+
+int Config::crypto_queue_limit() const
+{
+	return crypto_queue_limit_;
+}
+
+const std::string& Config::account_journal() const
+{
+	return account_journal_;
+}
+
+Logger::Level Config::log_level() const
+{
+	return log_level_;
+}
+
+uint16_t Config::metrics_port() const
+{
+	return metrics_port_;
+}
+
 int Config::receive_limit_1() const
 {
 	return receive_limit_1_;
@@ -132,6 +206,11 @@ const std::list<std::string>& Config::blocking_address_patterns() const
 {
 	return blocking_address_patterns_;
 }
+
+const AddressMatcher& Config::blocking_address_matcher() const
+{
+	return blocking_address_matcher_;
+}
 
 const std::list<std::string>& Config::lobby_servers() const
 {
@@ -9,12 +9,18 @@
 #include <istream>
 #include <string>
 #include <list>
+#include "AddressMatcher.hpp"
+#include "../common/Logger.hpp"
 
 class Config
 {
     public:
 		Config();
-		void Reload();
+
+		// 読み込みに成功したか
+		bool loaded() const;
+
+		static const char* CONFIG_JSON;
 
     private:
 		void Load();
@@ -24,6 +30,17 @@ class Config
         std::string server_note_;
         std::string stage_;
 		int capacity_;
+		int threads_;
+		int position_update_rate_;
+		int interest_radius_;
+		int interest_far_radius_;
+		int interest_far_interval_;
+		int key_pool_size_;
+		int crypto_threads_;
+		int crypto_queue_limit_;
+		std::string account_journal_;
+		Logger::Level log_level_;
+		uint16_t metrics_port_;
 
 		bool public_;
 
@@ -31,6 +48,7 @@ class Config
 		int receive_limit_2_;
 		
 		std::list<std::string> blocking_address_patterns_;
+		AddressMatcher blocking_address_matcher_;
 		std::list<std::string> lobby_servers_;
 
 		boost::property_tree::ptree pt_;
@@ -44,16 +62,27 @@ class Config
 
         const std::string& stage() const;
         int capacity() const;
+        int threads() const;
+        int position_update_rate() const;
+        int interest_radius() const;
+        int interest_far_radius() const;
+        int interest_far_interval() const;
+        int key_pool_size() const;
+        int crypto_threads() const;
+        int crypto_queue_limit() const;
+        const std::string& account_journal() const;
+        Logger::Level log_level() const;
+        uint16_t metrics_port() const;
 
 		int receive_limit_1() const;
 		int receive_limit_2() const;
 
 		const std::list<std::string>& blocking_address_patterns() const;
+		const AddressMatcher& blocking_address_matcher() const;
 		const std::list<std::string>& lobby_servers() const;
 
 		const boost::property_tree::ptree& pt() const;
 
 	private:
-		static const char* CONFIG_JSON;
-		time_t timestamp_;
+		bool loaded_;
 };
@@ -0,0 +1,129 @@
+//
+// ConfigWatcher.cpp
+//
+
+#include "ConfigWatcher.hpp"
+#include "../common/Logger.hpp"
+#include <boost/filesystem.hpp>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+ConfigWatcher::ConfigWatcher() :
+current_(std::make_shared<const Config>()),
+reload_count_(0),
+timestamp_(GetTimestamp()),
+inotify_fd_(-1),
+running_(true)
+{
+    Logger::set_level(current_->log_level());
+
+#ifdef __linux__
+    // 保存時に置き換えるエディタもあるので、ファイルではなくディレクトリを監視する
+    inotify_fd_ = inotify_init();
+    if (inotify_fd_ >= 0) {
+        auto dir = boost::filesystem::path(Config::CONFIG_JSON).parent_path().string();
+        if (inotify_add_watch(inotify_fd_, dir.empty() ? "." : dir.c_str(),
+                IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+            close(inotify_fd_);
+            inotify_fd_ = -1;
+        }
+    }
+#endif
+
+    if (inotify_fd_ < 0) {
+        Logger::Info("Config watcher: polling every %d ms", CONFIG_WATCH_POLL_MILLISECONDS);
+    }
+
+    thread_ = boost::thread([this](){ Run(); });
+}
+
+ConfigWatcher::~ConfigWatcher()
+{
+    running_ = false;
+    thread_.join();
+
+#ifdef __linux__
+    if (inotify_fd_ >= 0) {
+        close(inotify_fd_);
+    }
+#endif
+}
+
+std::shared_ptr<const Config> ConfigWatcher::current() const
+{
+    return std::atomic_load(&current_);
+}
+
+uint32_t ConfigWatcher::reload_count() const
+{
+    return reload_count_;
+}
+
+void ConfigWatcher::Run()
+{
+    while (running_) {
+        if (WaitForChange()) {
+            // 書き込みが続いている間は待つ
+            boost::this_thread::sleep(boost::posix_time::milliseconds(CONFIG_WATCH_SETTLE_MILLISECONDS));
+            Reload();
+        }
+    }
+}
+
+bool ConfigWatcher::WaitForChange()
+{
+#ifdef __linux__
+    if (inotify_fd_ >= 0) {
+        pollfd fd = {inotify_fd_, POLLIN, 0};
+        if (poll(&fd, 1, CONFIG_WATCH_POLL_MILLISECONDS) <= 0) {
+            return false;
+        }
+
+        char buffer[4096];
+        ssize_t length = read(inotify_fd_, buffer, sizeof(buffer));
+        auto filename = boost::filesystem::path(Config::CONFIG_JSON).filename().string();
+
+        bool changed = false;
+        for (ssize_t offset = 0; offset < length; ) {
+            auto event = reinterpret_cast<const inotify_event*>(buffer + offset);
+            if (event->len > 0 && filename == event->name) {
+                changed = true;
+            }
+            offset += sizeof(inotify_event) + event->len;
+        }
+        return changed;
+    }
+#endif
+
+    boost::this_thread::sleep(boost::posix_time::milliseconds(CONFIG_WATCH_POLL_MILLISECONDS));
+    return GetTimestamp() > timestamp_;
+}
+
+void ConfigWatcher::Reload()
+{
+    timestamp_ = GetTimestamp();
+
+    auto config = std::make_shared<const Config>();
+    if (!config->loaded()) {
+        // 書きかけや書き損じは無視して今の設定を使い続ける
+        Logger::Error(_T("Configuration reload failed."));
+        return;
+    }
+
+    // 古い設定は最後の参照が無くなった時点で解放される
+    std::atomic_store(&current_, config);
+    Logger::set_level(config->log_level());
+    reload_count_++;
+    Logger::Info(_T("Configuration reloaded."));
+}
+
+time_t ConfigWatcher::GetTimestamp() const
+{
+    boost::system::error_code error;
+    auto timestamp = boost::filesystem::last_write_time(Config::CONFIG_JSON, error);
+    return error ? 0 : timestamp;
+}
@@ -0,0 +1,42 @@
+//
+// ConfigWatcher.hpp
+//
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <boost/thread.hpp>
+#include "Config.hpp"
+
+#define CONFIG_WATCH_POLL_MILLISECONDS (1000)
+#define CONFIG_WATCH_SETTLE_MILLISECONDS (100)
+
+// 設定ファイルの変更を別スレッドで監視し、読み直したものに差し替える
+// 読み出し側はファイルアクセスせずに現在の設定を参照できる
+class ConfigWatcher {
+    public:
+        ConfigWatcher();
+        ~ConfigWatcher();
+
+        // 差し替えられた後も、受け取った側が持っている間は有効なまま残る
+        std::shared_ptr<const Config> current() const;
+
+        uint32_t reload_count() const;
+
+    private:
+        void Run();
+        bool WaitForChange();
+        void Reload();
+        time_t GetTimestamp() const;
+
+    private:
+        // std::atomic_load/atomic_store でのみ読み書きする
+        std::shared_ptr<const Config> current_;
+        std::atomic<uint32_t> reload_count_;
+
+        time_t timestamp_;
+        int inotify_fd_;
+        std::atomic<bool> running_;
+        boost::thread thread_;
+};
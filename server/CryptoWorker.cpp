@@ -0,0 +1,101 @@
+//
+// CryptoWorker.cpp
+//
+
+#include "CryptoWorker.hpp"
+#include "../common/Logger.hpp"
+
+namespace network {
+
+    using namespace boost::posix_time;
+
+    CryptoWorker::CryptoWorker(int thread_count, size_t queue_limit) :
+        work_(new boost::asio::io_service::work(io_service_)),
+        queue_limit_(queue_limit),
+        queue_depth_(0),
+        max_queue_depth_(0),
+        processed_(0),
+        overflowed_(0),
+        failed_(0),
+        total_wait_us_(0),
+        total_run_us_(0)
+    {
+        for (int i = 0; i < std::max(1, thread_count); i++) {
+            threads_.create_thread([this](){
+                try {
+                    io_service_.run();
+                } catch (std::exception& e) {
+                    Logger::Error("%s", e.what());
+                }
+            });
+        }
+    }
+
+    CryptoWorker::~CryptoWorker()
+    {
+        work_.reset();
+        io_service_.stop();
+        threads_.join_all();
+    }
+
+    bool CryptoWorker::Post(const SessionPtr& session, const Task& task, const Task& continuation)
+    {
+        auto queued_time = microsec_clock::universal_time();
+
+        size_t depth = ++queue_depth_;
+        if (depth > queue_limit_) {
+            --queue_depth_;
+            ++overflowed_;
+            return false;
+        }
+
+        size_t max_depth = max_queue_depth_;
+        while (depth > max_depth && !max_queue_depth_.compare_exchange_weak(max_depth, depth)) {}
+
+        io_service_.post([this, session, task, continuation, queued_time](){
+            --queue_depth_;
+            Run(session, task, continuation, queued_time);
+        });
+        return true;
+    }
+
+    void CryptoWorker::Run(const SessionPtr& session, const Task& task, const Task& continuation,
+        const ptime& queued_time)
+    {
+        auto start_time = microsec_clock::universal_time();
+        try {
+            task();
+        } catch (std::exception& e) {
+            // 続きを実行できないので、応答待ちのまま残さないよう切断する
+            Logger::Error("Crypto task failed: %s", e.what());
+            ++failed_;
+            session->Post([session](){
+                session->Close();
+            });
+            return;
+        }
+        auto end_time = microsec_clock::universal_time();
+
+        total_wait_us_ += (start_time - queued_time).total_microseconds();
+        total_run_us_ += (end_time - start_time).total_microseconds();
+        ++processed_;
+
+        session->Post(continuation);
+    }
+
+    CryptoWorker::Stats CryptoWorker::stats() const
+    {
+        Stats stats;
+        stats.queue_depth = queue_depth_;
+        stats.max_queue_depth = max_queue_depth_;
+        stats.processed = processed_;
+        stats.overflowed = overflowed_;
+        stats.failed = failed_;
+
+        uint64_t processed = std::max<uint64_t>(1, stats.processed);
+        stats.average_wait_ms = total_wait_us_ / 1000.0 / processed;
+        stats.average_run_ms = total_run_us_ / 1000.0 / processed;
+        return stats;
+    }
+
+}
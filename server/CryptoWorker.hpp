@@ -0,0 +1,62 @@
+//
+// CryptoWorker.hpp
+//
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include "../common/network/Session.hpp"
+
+namespace network {
+
+// 署名や公開鍵暗号などの重い処理をioスレッドから切り離すワーカー
+class CryptoWorker {
+    public:
+        typedef std::function<void()> Task;
+
+        struct Stats {
+            size_t queue_depth;
+            size_t max_queue_depth;
+            uint64_t processed;
+            uint64_t overflowed;
+            uint64_t failed;
+            double average_wait_ms;
+            double average_run_ms;
+        };
+
+    public:
+        CryptoWorker(int thread_count, size_t queue_limit);
+        ~CryptoWorker();
+
+        // taskをワーカーで実行し、終わったらcontinuationをセッションのstrandで実行する
+        // 待ちがqueue_limitに達している場合は何もせずにfalseを返す
+        // taskが例外を投げた場合はcontinuationを実行せずにセッションを切断する
+        // ioスレッドで重い処理をしないよう、呼び出し元で断ること
+        bool Post(const SessionPtr& session, const Task& task, const Task& continuation);
+
+        Stats stats() const;
+
+    private:
+        void Run(const SessionPtr& session, const Task& task, const Task& continuation,
+            const boost::posix_time::ptime& queued_time);
+
+    private:
+        boost::asio::io_service io_service_;
+        std::unique_ptr<boost::asio::io_service::work> work_;
+        boost::thread_group threads_;
+        size_t queue_limit_;
+
+        std::atomic<size_t> queue_depth_;
+        std::atomic<size_t> max_queue_depth_;
+        std::atomic<uint64_t> processed_;
+        std::atomic<uint64_t> overflowed_;
+        std::atomic<uint64_t> failed_;
+        std::atomic<uint64_t> total_wait_us_;
+        std::atomic<uint64_t> total_run_us_;
+};
+
+}
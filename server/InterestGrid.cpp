@@ -0,0 +1,71 @@
+//
+// InterestGrid.cpp
+//
+
+#include "InterestGrid.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <boost/foreach.hpp>
+
+namespace network {
+
+    InterestGrid::InterestGrid(int cell_size) :
+        cell_size_(std::max(1, cell_size))
+    {
+    }
+
+    void InterestGrid::Insert(UserID user_id, const PlayerPosition& pos)
+    {
+        cells_[GetCell(pos)].push_back(user_id);
+    }
+
+    void InterestGrid::Clear()
+    {
+        cells_.clear();
+    }
+
+    uint32_t InterestGrid::GetCell(const PlayerPosition& pos) const
+    {
+        // 負の座標も切り捨て方向が揃うようにずらしてから割る
+        uint32_t cell_x = (static_cast<int>(pos.x) + 32768) / cell_size_;
+        uint32_t cell_z = (static_cast<int>(pos.z) + 32768) / cell_size_;
+        return (cell_x << 16) | cell_z;
+    }
+
+    void InterestGrid::Query(uint32_t cell, int range, std::vector<UserID>* users) const
+    {
+        int cell_x = cell >> 16;
+        int cell_z = cell & 0xFFFF;
+
+        // セルの数が少なければ全セルを走査する方が速い
+        size_t area = (2 * range + 1) * (2 * range + 1);
+        if (area > cells_.size()) {
+            BOOST_FOREACH(const auto& pair, cells_) {
+                if (Distance(cell, pair.first) <= range) {
+                    users->insert(users->end(), pair.second.begin(), pair.second.end());
+                }
+            }
+            return;
+        }
+
+        for (int x = cell_x - range; x <= cell_x + range; x++) {
+            for (int z = cell_z - range; z <= cell_z + range; z++) {
+                if (x < 0 || z < 0 || x > 0xFFFF || z > 0xFFFF) {
+                    continue;
+                }
+                auto it = cells_.find((static_cast<uint32_t>(x) << 16) | z);
+                if (it != cells_.end()) {
+                    users->insert(users->end(), it->second.begin(), it->second.end());
+                }
+            }
+        }
+    }
+
+    int InterestGrid::Distance(uint32_t a, uint32_t b)
+    {
+        int dx = std::abs(static_cast<int>(a >> 16) - static_cast<int>(b >> 16));
+        int dz = std::abs(static_cast<int>(a & 0xFFFF) - static_cast<int>(b & 0xFFFF));
+        return std::max(dx, dz);
+    }
+
+}
@@ -0,0 +1,37 @@
+//
+// InterestGrid.hpp
+//
+
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+#include "../common/database/AccountProperty.hpp"
+#include "../common/network/Session.hpp"
+
+namespace network {
+
+// 水平面(x, z)を一様なセルに分割したプレイヤー位置の索引
+class InterestGrid {
+    public:
+        explicit InterestGrid(int cell_size);
+
+        void Insert(UserID user_id, const PlayerPosition& pos);
+        void Clear();
+
+        // セルの座標を1つの値にまとめたもの
+        uint32_t GetCell(const PlayerPosition& pos) const;
+
+        // 指定したセルからセル距離range以内にいるユーザーを列挙する
+        void Query(uint32_t cell, int range, std::vector<UserID>* users) const;
+
+        // 2つのセルのチェビシェフ距離
+        static int Distance(uint32_t a, uint32_t b);
+
+    private:
+        int cell_size_;
+        std::unordered_map<uint32_t, std::vector<UserID>> cells_;
+};
+
+}
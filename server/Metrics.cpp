@@ -0,0 +1,309 @@
+//
+// Metrics.cpp
+//
+
+#include "Metrics.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <boost/bind.hpp>
+
+namespace network {
+
+    using namespace boost::posix_time;
+
+    namespace {
+
+        const char* REFUSE_REASON_NAMES[] = {"blocked", "crowded", "version"};
+
+        const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+        void WriteHeader(std::ostream& out, const char* name, const char* type, const char* help)
+        {
+            out << "# HELP " << name << " " << help << "\n";
+            out << "# TYPE " << name << " " << type << "\n";
+        }
+
+        std::string CommandLabel(int header)
+        {
+            std::ostringstream label;
+            label << "0x" << std::hex << std::setw(2) << std::setfill('0') << header;
+            return label.str();
+        }
+
+        // マイクロ秒単位のヒストグラムを秒単位のsummaryとして書き出す
+        void WriteSummary(std::ostream& out, const char* name, const std::string& labels,
+                const Histogram& histogram, double scale)
+        {
+            auto separator = labels.empty() ? "" : ",";
+            for (size_t i = 0; i < sizeof(QUANTILES) / sizeof(QUANTILES[0]); i++) {
+                out << name << "{" << labels << separator << "quantile=\"" << QUANTILES[i] << "\"} "
+                    << histogram.Percentile(QUANTILES[i]) * scale << "\n";
+            }
+            auto braces = labels.empty() ? std::string() : "{" + labels + "}";
+            out << name << "_sum" << braces << " " << histogram.sum() * scale << "\n";
+            out << name << "_count" << braces << " " << histogram.count() << "\n";
+        }
+
+        void UpdateMax(std::atomic<uint64_t>* max, uint64_t value)
+        {
+            uint64_t current = max->load(std::memory_order_relaxed);
+            while (value > current &&
+                !max->compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+            }
+        }
+
+    }
+
+    Histogram::Histogram() :
+        count_(0),
+        sum_(0),
+        max_(0)
+    {
+        for (int i = 0; i < BUCKET_COUNT; i++) {
+            buckets_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void Histogram::Record(uint64_t value)
+    {
+        buckets_[GetIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        UpdateMax(&max_, value);
+    }
+
+    uint64_t Histogram::count() const
+    {
+        return count_;
+    }
+
+    uint64_t Histogram::sum() const
+    {
+        return sum_;
+    }
+
+    uint64_t Histogram::max() const
+    {
+        return max_;
+    }
+
+    uint64_t Histogram::Percentile(double ratio) const
+    {
+        uint64_t total = 0;
+        for (int i = 0; i < BUCKET_COUNT; i++) {
+            total += buckets_[i].load(std::memory_order_relaxed);
+        }
+        if (total == 0) {
+            return 0;
+        }
+
+        uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(ratio * total)));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKET_COUNT; i++) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                return std::min(GetUpperBound(i), max());
+            }
+        }
+        return max();
+    }
+
+    int Histogram::GetIndex(uint64_t value)
+    {
+        value = std::min<uint64_t>(value, (1ULL << HISTOGRAM_MAX_BITS) - 1);
+        if (value < SUB_BUCKETS) {
+            return static_cast<int>(value);
+        }
+
+        // 最上位ビットの下HISTOGRAM_SUB_BUCKET_BITSビットで範囲内の位置を決める
+        int shift = 0;
+        while ((value >> shift) >= 2 * SUB_BUCKETS) {
+            shift++;
+        }
+        return (shift + 1) * SUB_BUCKETS + static_cast<int>(value >> shift) - SUB_BUCKETS;
+    }
+
+    uint64_t Histogram::GetUpperBound(int index)
+    {
+        if (index < SUB_BUCKETS) {
+            return index;
+        }
+        int shift = index / SUB_BUCKETS - 1;
+        uint64_t sub = index % SUB_BUCKETS + SUB_BUCKETS;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    Metrics::Metrics(boost::asio::io_service& io_service) :
+        accepted_(0),
+        lag_timer_(io_service)
+    {
+        for (int i = 0; i < METRICS_COMMAND_COUNT; i++) {
+            auto& command = commands_[i];
+            command.received.store(0, std::memory_order_relaxed);
+            command.received_bytes.store(0, std::memory_order_relaxed);
+            command.sent.store(0, std::memory_order_relaxed);
+            command.sent_bytes.store(0, std::memory_order_relaxed);
+            command.sent_compressed_bytes.store(0, std::memory_order_relaxed);
+            command.latency.store(nullptr, std::memory_order_relaxed);
+        }
+        for (int i = 0; i < REFUSED_COUNT; i++) {
+            refused_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    Metrics::~Metrics()
+    {
+        for (int i = 0; i < METRICS_COMMAND_COUNT; i++) {
+            delete commands_[i].latency.load();
+        }
+    }
+
+    void Metrics::Start()
+    {
+        WaitLag();
+    }
+
+    void Metrics::RecordReceive(uint8_t header, size_t bytes, uint64_t latency_microseconds)
+    {
+        auto& command = commands_[header];
+        command.received.fetch_add(1, std::memory_order_relaxed);
+        command.received_bytes.fetch_add(bytes, std::memory_order_relaxed);
+
+        auto latency = command.latency.load(std::memory_order_acquire);
+        if (!latency) {
+            // 先に確保されていたらそちらを使う
+            auto created = new Histogram();
+            if (command.latency.compare_exchange_strong(latency, created, std::memory_order_acq_rel)) {
+                latency = created;
+            } else {
+                delete created;
+            }
+        }
+        latency->Record(latency_microseconds);
+    }
+
+    void Metrics::RecordSend(uint8_t header, size_t bytes, size_t compressed_bytes, size_t queue_depth)
+    {
+        auto& command = commands_[header];
+        command.sent.fetch_add(1, std::memory_order_relaxed);
+        command.sent_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        command.sent_compressed_bytes.fetch_add(compressed_bytes, std::memory_order_relaxed);
+        send_queue_depth_.Record(queue_depth);
+    }
+
+    void Metrics::RecordAccepted()
+    {
+        accepted_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Metrics::RecordRefused(RefuseReason reason)
+    {
+        refused_[reason].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Metrics::WritePrometheus(std::ostream& out) const
+    {
+        struct Counter {
+            const char* name;
+            const char* help;
+            std::atomic<uint64_t> CommandCounters::*member;
+        };
+        static const Counter counters[] = {
+            {"mmo_command_received_total", "Commands received.", &CommandCounters::received},
+            {"mmo_command_received_bytes_total", "Bytes of received command bodies.", &CommandCounters::received_bytes},
+            {"mmo_command_sent_total", "Commands sent.", &CommandCounters::sent},
+            {"mmo_command_sent_bytes_total", "Bytes of sent commands before compression.", &CommandCounters::sent_bytes},
+            {"mmo_command_sent_compressed_bytes_total", "Bytes of sent commands after compression.", &CommandCounters::sent_compressed_bytes},
+        };
+
+        for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+            WriteHeader(out, counters[c].name, "counter", counters[c].help);
+            for (int i = 0; i < METRICS_COMMAND_COUNT; i++) {
+                uint64_t value = commands_[i].*counters[c].member;
+                if (value > 0) {
+                    out << counters[c].name << "{command=\"" << CommandLabel(i) << "\"} " << value << "\n";
+                }
+            }
+        }
+
+        WriteHeader(out, "mmo_command_handler_seconds", "summary", "Time spent handling a received command.");
+        for (int i = 0; i < METRICS_COMMAND_COUNT; i++) {
+            if (auto latency = commands_[i].latency.load(std::memory_order_acquire)) {
+                WriteSummary(out, "mmo_command_handler_seconds",
+                    "command=\"" + CommandLabel(i) + "\"", *latency, 1e-6);
+            }
+        }
+
+        WriteHeader(out, "mmo_send_queue_depth", "summary", "Messages waiting in the session send queue when a command is queued.");
+        WriteSummary(out, "mmo_send_queue_depth", "", send_queue_depth_, 1);
+
+        WriteHeader(out, "mmo_sessions_accepted_total", "counter", "Accepted TCP sessions.");
+        out << "mmo_sessions_accepted_total " << accepted_.load() << "\n";
+
+        WriteHeader(out, "mmo_sessions_refused_total", "counter", "Refused TCP sessions.");
+        for (int i = 0; i < REFUSED_COUNT; i++) {
+            out << "mmo_sessions_refused_total{reason=\"" << REFUSE_REASON_NAMES[i] << "\"} " << refused_[i].load() << "\n";
+        }
+
+        WriteHeader(out, "mmo_io_loop_lag_seconds", "summary", "Delay of a periodic timer on the network io_service.");
+        WriteSummary(out, "mmo_io_loop_lag_seconds", "", lag_, 1e-6);
+        WriteHeader(out, "mmo_io_loop_lag_max_seconds", "gauge", "Largest io_service delay observed.");
+        out << "mmo_io_loop_lag_max_seconds " << lag_.max() * 1e-6 << "\n";
+    }
+
+    void Metrics::WriteJSON(std::ostream& out) const
+    {
+        out << "{\"accepted\":" << accepted_.load();
+        for (int i = 0; i < REFUSED_COUNT; i++) {
+            out << ",\"refused_" << REFUSE_REASON_NAMES[i] << "\":" << refused_[i].load();
+        }
+        out << ",\"lag_us\":{\"p50\":" << lag_.Percentile(0.5)
+            << ",\"p99\":" << lag_.Percentile(0.99) << ",\"max\":" << lag_.max() << "}";
+        out << ",\"queue\":{\"p99\":" << send_queue_depth_.Percentile(0.99)
+            << ",\"max\":" << send_queue_depth_.max() << "}";
+
+        out << ",\"commands\":{";
+        bool first = true;
+        for (int i = 0; i < METRICS_COMMAND_COUNT; i++) {
+            const auto& command = commands_[i];
+            if (command.received == 0 && command.sent == 0) {
+                continue;
+            }
+            out << (first ? "" : ",") << "\"" << CommandLabel(i) << "\":{"
+                << "\"recv\":" << command.received.load()
+                << ",\"recv_bytes\":" << command.received_bytes.load()
+                << ",\"sent\":" << command.sent.load()
+                << ",\"sent_bytes\":" << command.sent_bytes.load()
+                << ",\"sent_compressed\":" << command.sent_compressed_bytes.load();
+            if (auto latency = command.latency.load(std::memory_order_acquire)) {
+                out << ",\"p50_us\":" << latency->Percentile(0.5)
+                    << ",\"p99_us\":" << latency->Percentile(0.99);
+            }
+            out << "}";
+            first = false;
+        }
+        out << "}}";
+    }
+
+    void Metrics::WaitLag()
+    {
+        lag_expected_ = microsec_clock::universal_time() + milliseconds(METRICS_LAG_INTERVAL_MILLISECONDS);
+        lag_timer_.expires_at(lag_expected_);
+        lag_timer_.async_wait(boost::bind(&Metrics::CheckLag, this, boost::asio::placeholders::error));
+    }
+
+    void Metrics::CheckLag(const boost::system::error_code& error)
+    {
+        if (error) {
+            return;
+        }
+
+        // 予定の時刻からどれだけ遅れてハンドラが呼ばれたか
+        auto lag = microsec_clock::universal_time() - lag_expected_;
+        lag_.Record(std::max<int64_t>(0, lag.total_microseconds()));
+        WaitLag();
+    }
+
+}
@@ -0,0 +1,108 @@
+//
+// Metrics.hpp
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <ostream>
+#include <boost/asio.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#define HISTOGRAM_SUB_BUCKET_BITS (3)
+#define HISTOGRAM_MAX_BITS (32)
+#define METRICS_LAG_INTERVAL_MILLISECONDS (100)
+#define METRICS_COMMAND_COUNT (256)
+
+namespace network {
+
+// HdrHistogramと同じく、2の累乗ごとの範囲を等分したバケツで値の分布を数える
+// 相対誤差は 1 / 2^HISTOGRAM_SUB_BUCKET_BITS 以下に収まる
+class Histogram {
+    public:
+        enum {
+            SUB_BUCKETS = 1 << HISTOGRAM_SUB_BUCKET_BITS,
+            BUCKET_COUNT = SUB_BUCKETS * (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1)
+        };
+
+    public:
+        Histogram();
+
+        void Record(uint64_t value);
+
+        uint64_t count() const;
+        uint64_t sum() const;
+        uint64_t max() const;
+
+        // ratioの位置にある値が入っているバケツの上端
+        uint64_t Percentile(double ratio) const;
+
+    private:
+        static int GetIndex(uint64_t value);
+        static uint64_t GetUpperBound(int index);
+
+    private:
+        std::atomic<uint64_t> buckets_[BUCKET_COUNT];
+        std::atomic<uint64_t> count_;
+        std::atomic<uint64_t> sum_;
+        std::atomic<uint64_t> max_;
+};
+
+// サーバーの計測値 どのスレッドからもロックせずに記録できる
+class Metrics {
+    public:
+        enum RefuseReason {
+            REFUSED_BLOCKED,
+            REFUSED_CROWDED,
+            REFUSED_VERSION,
+            REFUSED_COUNT
+        };
+
+    public:
+        Metrics(boost::asio::io_service& io_service);
+        ~Metrics();
+
+        // io_serviceの遅延の計測を始める
+        void Start();
+
+        // 受信したコマンドと、その処理にかかった時間
+        void RecordReceive(uint8_t header, size_t bytes, uint64_t latency_microseconds);
+        // 送信したコマンドの圧縮前後の大きさと、積んだ時点の送信待ちの数
+        void RecordSend(uint8_t header, size_t bytes, size_t compressed_bytes, size_t queue_depth);
+
+        void RecordAccepted();
+        void RecordRefused(RefuseReason reason);
+
+        // Prometheusのテキスト形式
+        void WritePrometheus(std::ostream& out) const;
+        void WriteJSON(std::ostream& out) const;
+
+    private:
+        struct CommandCounters {
+            std::atomic<uint64_t> received;
+            std::atomic<uint64_t> received_bytes;
+            std::atomic<uint64_t> sent;
+            std::atomic<uint64_t> sent_bytes;
+            std::atomic<uint64_t> sent_compressed_bytes;
+
+            // 受信したことのあるコマンドだけ確保する
+            std::atomic<Histogram*> latency;
+        };
+
+        void WaitLag();
+        void CheckLag(const boost::system::error_code& error);
+
+    private:
+        CommandCounters commands_[METRICS_COMMAND_COUNT];
+        Histogram send_queue_depth_;
+
+        std::atomic<uint64_t> accepted_;
+        std::atomic<uint64_t> refused_[REFUSED_COUNT];
+
+        boost::asio::deadline_timer lag_timer_;
+        boost::posix_time::ptime lag_expected_;
+        Histogram lag_;
+};
+
+}
@@ -0,0 +1,78 @@
+//
+// MetricsEndpoint.cpp
+//
+
+#include "MetricsEndpoint.hpp"
+#include "../common/Logger.hpp"
+#include <boost/make_shared.hpp>
+
+namespace network {
+
+    using boost::asio::ip::tcp;
+
+    namespace {
+
+        struct Connection {
+            Connection(boost::asio::io_service& io_service) :
+                socket(io_service),
+                request(METRICS_REQUEST_MAX_BYTES) {}
+
+            tcp::socket socket;
+            boost::asio::streambuf request;
+            std::string response;
+        };
+
+    }
+
+    MetricsEndpoint::MetricsEndpoint(boost::asio::io_service& io_service, uint16_t port, const Handler& handler) :
+        io_service_(io_service),
+        acceptor_(io_service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), port)),
+        handler_(handler)
+    {
+    }
+
+    void MetricsEndpoint::Start()
+    {
+        Logger::Info("Metrics endpoint: http://%s/metrics", acceptor_.local_endpoint());
+        Accept();
+    }
+
+    void MetricsEndpoint::Accept()
+    {
+        auto connection = boost::make_shared<Connection>(io_service_);
+        acceptor_.async_accept(connection->socket,
+            [this, connection](const boost::system::error_code& error) {
+                if (error == boost::asio::error::operation_aborted) {
+                    return;
+                }
+                Accept();
+
+                if (error) {
+                    return;
+                }
+
+                // リクエストの中身は見ずに、ヘッダの終わりまで読んだら返す
+                boost::asio::async_read_until(connection->socket, connection->request, "\r\n\r\n",
+                    [this, connection](const boost::system::error_code& error, size_t) {
+                        if (error) {
+                            return;
+                        }
+
+                        auto body = handler_();
+                        connection->response =
+                            "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: " + std::to_string(static_cast<unsigned long long>(body.size())) + "\r\n"
+                            "Connection: close\r\n"
+                            "\r\n" + body;
+
+                        boost::asio::async_write(connection->socket, boost::asio::buffer(connection->response),
+                            [connection](const boost::system::error_code&, size_t) {
+                                boost::system::error_code ignored;
+                                connection->socket.shutdown(tcp::socket::shutdown_both, ignored);
+                            });
+                    });
+            });
+    }
+
+}
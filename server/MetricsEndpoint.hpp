@@ -0,0 +1,35 @@
+//
+// MetricsEndpoint.hpp
+//
+
+#pragma once
+
+#include <string>
+#include <functional>
+#include <boost/asio.hpp>
+
+#define METRICS_REQUEST_MAX_BYTES (4096)
+
+namespace network {
+
+// 計測値をPrometheusに渡すための最小限のHTTPサーバー
+// ループバックアドレスでのみ待ち受け、どのパスにも同じ内容を返す
+class MetricsEndpoint {
+    public:
+        typedef std::function<std::string()> Handler;
+
+    public:
+        MetricsEndpoint(boost::asio::io_service& io_service, uint16_t port, const Handler& handler);
+
+        void Start();
+
+    private:
+        void Accept();
+
+    private:
+        boost::asio::io_service& io_service_;
+        boost::asio::ip::tcp::acceptor acceptor_;
+        Handler handler_;
+};
+
+}
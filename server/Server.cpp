@@ -16,10 +16,16 @@
 namespace network {
 
     Server::Server() :
-            endpoint_(tcp::v4(), config_.port()),
+            crypto_worker_(config()->crypto_threads(), config()->crypto_queue_limit()),
+            endpoint_(tcp::v4(), config()->port()),
             acceptor_(io_service_, endpoint_),
-            socket_udp_(io_service_, udp::endpoint(udp::v4(), config_.port())),
+            accept_socket_(io_service_),
+            socket_udp_(io_service_, udp::endpoint(udp::v4(), config()->port())),
+            udp_strand_(io_service_),
+            metrics_(io_service_),
+            timer_wheel_(io_service_),
             udp_packet_count_(0),
+            position_tick_(0),
 			recent_chat_log_(10)
     {
     }
@@ -29,19 +35,24 @@ namespace network {
         callback_ = std::make_shared<CallbackFunc>(
                 [&](network::Command c){
 
+            auto start_time = boost::posix_time::microsec_clock::universal_time();
+
             // ログアウト
-            if (c.header() == network::header::FatalConnectionError || 
-				c.header() == network::header::UserFatalConnectionError) {
+            // 相手から届いたものは受信時に捨てているので、ここに来るのはセッションが作ったものだけ
+            if (network::header::IsConnectionError(c.header())) {
                 if (callback) {
 					(*callback)(c);
 				}
             } else if (auto session = c.session().lock()) {
 				auto read_average = session->GetReadByteAverage();
-				if (read_average > config_.receive_limit_2()) {
+				if (read_average > config()->receive_limit_2()) {
 					Logger::Info(_T("Banished a session: %d %dbyte/s"), session->id(), read_average);
 					session->Close();
-				} else if(read_average > config_.receive_limit_1()) {
+				} else if(read_average > config()->receive_limit_1()) {
 					Logger::Info(_T("Receive limit exceeded: %d: %d byte/s"), session->id(), read_average);
+				} else if (session->id() == 0 && !network::header::IsAnonymous(c.header())) {
+					// 鍵の持ち主と確かめるまでは、ハンドシェイク以外を受け付けない
+					Logger::Info(_T("Dropped a command before login: 0x%02X"), c.header());
 				} else {
 					if (callback) {
 						(*callback)(c);
@@ -49,30 +60,67 @@ namespace network {
                 }
             }
 
+            auto elapsed = boost::posix_time::microsec_clock::universal_time() - start_time;
+            metrics_.RecordReceive(static_cast<uint8_t>(c.header()), c.body().size(),
+                std::max<int64_t>(0, elapsed.total_microseconds()));
         });
 
-		BOOST_FOREACH(const auto& host, config().lobby_servers()) {
+		auto current_config = config();
+		BOOST_FOREACH(const auto& host, current_config->lobby_servers()) {
 			udp::resolver resolver(io_service_);
 			udp::resolver::query query(udp::v4(), host.c_str(), "39380");
 			lobby_hosts_.push_back(resolver.resolve(query));
 		}
 
-        {
-        auto new_session = boost::make_shared<ServerSession>(io_service_);
-        acceptor_.async_accept(new_session->tcp_socket(),
-                              boost::bind(&Server::ReceiveSession, this, new_session, boost::asio::placeholders::error));
-        }
+        StartAccept();
 
         {
             socket_udp_.async_receive_from(
                 boost::asio::buffer(receive_buf_udp_, UDP_MAX_RECEIVE_LENGTH), sender_endpoint_,
-                boost::bind(&Server::ReceiveUDP, this,
+                udp_strand_.wrap(boost::bind(&Server::ReceiveUDP, this,
                   boost::asio::placeholders::error,
-                  boost::asio::placeholders::bytes_transferred));
+                  boost::asio::placeholders::bytes_transferred)));
+        }
+
+        timer_wheel_.Start();
+        metrics_.Start();
+
+        if (config()->metrics_port() > 0) {
+            metrics_endpoint_.reset(new MetricsEndpoint(io_service_, config()->metrics_port(),
+                [this](){ return GetMetricsText(); }));
+            metrics_endpoint_->Start();
         }
 
         boost::asio::io_service::work work(io_service_);
-        io_service_.run();
+
+        // ワーカースレッドを起動
+        int thread_count = config()->threads();
+        if (thread_count <= 0) {
+            thread_count = std::max(1u, boost::thread::hardware_concurrency());
+        }
+        Logger::Info("Worker threads: %d", thread_count);
+
+        boost::thread_group threads;
+        for (int i = 1; i < thread_count; i++) {
+            threads.create_thread([this](){ RunIOService(); });
+        }
+
+        RunIOService();
+        threads.join_all();
+    }
+
+    void Server::RunIOService()
+    {
+        // ハンドラが例外を投げてもスレッドを減らさないよう、記録して再開する
+        // Stopされた場合は正常に戻る
+        while (true) {
+            try {
+                io_service_.run();
+                break;
+            } catch (std::exception& e) {
+                Logger::Error("%s", e.what());
+            }
+        }
     }
 
     void Server::Stop()
@@ -88,54 +136,68 @@ namespace network {
 
 	int Server::GetUserCount() const
 	{
-		auto count = std::count_if(sessions_.begin(), sessions_.end(),
-			[](const SessionWeakPtr& s) -> bool {
-				if (auto session = s.lock()) {
-					return !s.expired() && session->online() && session->id() > 0;
-				} else {
-					return false;
-				}
-			});
+		return registry_.GetUserCount();
+	}
 
-		return count;
+	Server::StatusVersion Server::GetStatusVersion() const
+	{
+		StatusVersion version;
+		version.valid = true;
+		version.users = registry_.GetVersion();
+		version.profiles = account_.GetProfileRevision();
+		version.config = config_watcher_.reload_count();
+		return version;
 	}
 
 	std::string Server::GetStatusJSON() const
 	{
-		auto msg = (
-					boost::format("{\"nam\":\"%s\",\"ver\":\"%d.%d.%d\",\"cnt\":%d,\"cap\":%d,\"stg\":\"%s\"}")
-						% config_.server_name()
-						% MMO_VERSION_MAJOR % MMO_VERSION_MINOR % MMO_VERSION_REVISION
-						% GetUserCount()
-						% config_.capacity()
-						% channel_.GetDefaultStage()
-					).str();
-
-		return msg;
+		// 人数と設定が変わった時だけ作り直す
+		auto version = GetStatusVersion();
+		version.profiles = 0;
+
+		boost::mutex::scoped_lock lock(status_mutex_);
+		if (!(status_json_version_ == version)) {
+			status_json_ = (
+						boost::format("{\"nam\":\"%s\",\"ver\":\"%d.%d.%d\",\"cnt\":%d,\"cap\":%d,\"stg\":\"%s\"}")
+							% config()->server_name()
+							% MMO_VERSION_MAJOR % MMO_VERSION_MINOR % MMO_VERSION_REVISION
+							% GetUserCount()
+							% config()->capacity()
+							% channel_.GetDefaultStage()
+						).str();
+			status_json_version_ = version;
+		}
+
+		return status_json_;
 	}
 
 	std::string Server::GetFullStatus() const
 	{
+		// ユーザーの顔ぶれ・名前・モデル・設定が変わった時だけ作り直す
+		auto version = GetStatusVersion();
+
+		boost::mutex::scoped_lock lock(status_mutex_);
+		if (full_status_version_ == version) {
+			return full_status_;
+		}
+
 		using namespace boost::property_tree;
 		ptree xml_ptree;
 
-		xml_ptree.put_child("config", config_.pt());
+		xml_ptree.put_child("config", config()->pt());
 		xml_ptree.put("version", (boost::format("%d.%d.%d") 
 			% MMO_VERSION_MAJOR % MMO_VERSION_MINOR % MMO_VERSION_REVISION).str());
 		xml_ptree.put("protocol_version", MMO_PROTOCOL_VERSION);
 
 		{
 			ptree player_array;
-			auto id_list = account_.GetIDList();
-			BOOST_FOREACH(const auto& s, sessions_) {
-				if (auto session = s.lock()) {
-					if (!s.expired() && session->online() && session->id() > 0) {
-						auto id = session->id();
-						ptree player;
-						player.put("name", account_.GetUserName(id));
-						player.put("model_name", account_.GetUserModelName(id));
-						player_array.push_back(std::make_pair("", player));
-					}
+			BOOST_FOREACH(const auto& session, registry_.GetLoggedIn()) {
+				if (session->online()) {
+					auto id = session->id();
+					ptree player;
+					player.put("name", account_.GetUserName(id));
+					player.put("model_name", account_.GetUserModelName(id));
+					player_array.push_back(std::make_pair("", player));
 				}
 			}
 			xml_ptree.put_child("players", player_array);
@@ -150,25 +212,138 @@ namespace network {
 		//}
 
 		xml_ptree.put_child("channels", channel_.pt());
+
 		std::stringstream stream;
 		boost::archive::text_oarchive oa(stream);
 		oa << xml_ptree;
 
+		full_status_ = stream.str();
+		full_status_version_ = version;
+		return full_status_;
+	}
+
+	std::string Server::GetExtendedStatusJSON() const
+	{
+		auto status = GetStatusJSON();
+		status.erase(status.size() - 1);
+
+		std::ostringstream stream;
+		stream << status << ",\"metrics\":";
+		metrics_.WriteJSON(stream);
+		stream << "}";
+		return stream.str();
+	}
+
+	std::string Server::GetMetricsText() const
+	{
+		std::ostringstream stream;
+		metrics_.WritePrometheus(stream);
+
+		size_t queue_sum = 0;
+		size_t queue_max = 0;
+		auto sessions = registry_.GetChannel(-1);
+		BOOST_FOREACH(const auto& session, sessions) {
+			auto depth = session->send_queue_depth();
+			queue_sum += depth;
+			queue_max = std::max(queue_max, depth);
+		}
+
+		auto crypto = crypto_worker_.stats();
+		auto timer = timer_wheel_.stats();
+
+		struct Gauge {
+			const char* name;
+			const char* type;
+			const char* help;
+			double value;
+		};
+		const Gauge gauges[] = {
+			{"mmo_users", "gauge", "Logged-in online users.", static_cast<double>(GetUserCount())},
+			{"mmo_sessions", "gauge", "Open TCP sessions.", static_cast<double>(registry_.GetSessionCount())},
+			{"mmo_send_queue_messages", "gauge", "Messages waiting to be written, summed over sessions.", static_cast<double>(queue_sum)},
+			{"mmo_send_queue_max_messages", "gauge", "Longest send queue of any session.", static_cast<double>(queue_max)},
+			{"mmo_crypto_queue_depth", "gauge", "Jobs waiting for the crypto workers.", static_cast<double>(crypto.queue_depth)},
+			{"mmo_crypto_processed_total", "counter", "Jobs run by the crypto workers.", static_cast<double>(crypto.processed)},
+			{"mmo_crypto_overflowed_total", "counter", "Jobs refused because the crypto queue was full.", static_cast<double>(crypto.overflowed)},
+			{"mmo_crypto_failed_total", "counter", "Jobs that threw and closed their session.", static_cast<double>(crypto.failed)},
+			{"mmo_timer_wheel_pending", "gauge", "Timers waiting on the timer wheel.", static_cast<double>(timer.pending)},
+			{"mmo_timer_wheel_fired_total", "counter", "Timers fired by the timer wheel.", static_cast<double>(timer.fired)},
+			{"mmo_log_dropped_total", "counter", "Log records dropped because the log buffer was full.", static_cast<double>(Logger::dropped())},
+			{"mmo_config_reloads_total", "counter", "Times config.json was reloaded.", static_cast<double>(config_watcher_.reload_count())},
+		};
+
+		BOOST_FOREACH(const auto& gauge, gauges) {
+			stream << "# HELP " << gauge.name << " " << gauge.help << "\n";
+			stream << "# TYPE " << gauge.name << " " << gauge.type << "\n";
+			stream << gauge.name << " " << gauge.value << "\n";
+		}
+
 		return stream.str();
 	}
 
-	const Config& Server::config() const
+	std::shared_ptr<const Config> Server::config() const
 	{
-		return config_;
+		return config_watcher_.current();
 	}
 
 	Account& Server::account()
 	{
 		return account_;
 	}
+
+	CryptoWorker& Server::crypto_worker()
+	{
+		return crypto_worker_;
+	}
+
+	TimerWheel& Server::timer_wheel()
+	{
+		return timer_wheel_;
+	}
+
+	Metrics& Server::metrics()
+	{
+		return metrics_;
+	}
+
+	void Server::ScheduleAccountRemoval(UserID user_id)
+	{
+		boost::mutex::scoped_lock lock(account_removal_mutex_);
+		auto it = account_removal_timers_.find(user_id);
+		if (it != account_removal_timers_.end()) {
+			timer_wheel_.Cancel(it->second);
+		}
+
+		// 発火したときに自分のものか確かめるため、IDは登録後に書き込む
+		auto timer_id = std::make_shared<TimerWheel::TimerID>(0);
+		*timer_id = timer_wheel_.Schedule(boost::posix_time::minutes(ACCOUNT_REMOVE_DELAY_MINUTES),
+			[this, user_id, timer_id](){
+				{
+					boost::mutex::scoped_lock lock(account_removal_mutex_);
+					auto it = account_removal_timers_.find(user_id);
+					if (it == account_removal_timers_.end() || it->second != *timer_id) {
+						return;
+					}
+					account_removal_timers_.erase(it);
+				}
+				account_.Remove(user_id);
+			});
+		account_removal_timers_[user_id] = *timer_id;
+	}
+
+	void Server::CancelAccountRemoval(UserID user_id)
+	{
+		boost::mutex::scoped_lock lock(account_removal_mutex_);
+		auto it = account_removal_timers_.find(user_id);
+		if (it != account_removal_timers_.end()) {
+			timer_wheel_.Cancel(it->second);
+			account_removal_timers_.erase(it);
+		}
+	}
 	
 	void Server::AddChatLog(const std::string& msg)
 	{
+		boost::mutex::scoped_lock lock(chat_log_mutex_);
 		recent_chat_log_.push_back(msg);
 	}
 
@@ -179,102 +354,347 @@ namespace network {
 
 	bool Server::IsBlockedAddress(const boost::asio::ip::address& address)
 	{
-		BOOST_FOREACH(const auto& pattern, config_.blocking_address_patterns()) {
-			if (network::Utils::MatchWithWildcard(pattern, address.to_string())) {
-				return true;
-			}
-		}
-		return false;
+		return config()->blocking_address_matcher().Match(address);
 	}
 
-    void Server::ReceiveSession(const SessionPtr& session, const boost::system::error_code& error)
+    void Server::StartAccept()
+    {
+        acceptor_.async_accept(accept_socket_,
+                boost::bind(&Server::ReceiveSession, this, boost::asio::placeholders::error));
+    }
+
+    void Server::ReceiveSession(const boost::system::error_code& error)
     {
-		config_.Reload();
+		if (error == boost::asio::error::operation_aborted) {
+			return;
+		}
 
-		if (!session) return;
+		boost::system::error_code endpoint_error;
+		const auto endpoint = accept_socket_.remote_endpoint(endpoint_error);
 
-		const auto address = session->tcp_socket().remote_endpoint().address();
+		if (error || endpoint_error) {
+			accept_socket_.close(endpoint_error);
 
-		// 拒否IPでないか判定
-		if(IsBlockedAddress(address)) {
-			Logger::Info("Blocked IP Address: %s", address);
-            session->Close();
+		// 拒否IPはセッションを作る前に切断する
+		} else if (IsBlockedAddress(endpoint.address())) {
+			Logger::Info("Blocked IP Address: %s", endpoint.address());
+			accept_socket_.close(endpoint_error);
+			metrics_.RecordRefused(Metrics::REFUSED_BLOCKED);
 
 		} else {
+            metrics_.RecordAccepted();
+            auto session = boost::make_shared<ServerSession>(io_service_, registry_, metrics_,
+                endpoint.address());
+            session->tcp_socket() = std::move(accept_socket_);
+            // ムーブ元のソケットはio_serviceを失っているので作り直す
+            accept_socket_ = tcp::socket(io_service_);
             session->set_on_receive(callback_);
             session->Start();
-            sessions_.push_back(SessionWeakPtr(session));
 
             // クライアント情報を要求
             session->Send(ClientRequestedClientInfo());
         }
 
-        auto new_session = boost::make_shared<ServerSession>(io_service_);
-        acceptor_.async_accept(new_session->tcp_socket(),
-                boost::bind(&Server::ReceiveSession, this, new_session, boost::asio::placeholders::error));
+        StartAccept();
 
 		RefreshSession();
     }
 
 	void Server::RefreshSession()
 	{
-		// 使用済のセッションのポインタを破棄
-        auto it = std::remove_if(sessions_.begin(), sessions_.end(),
-                [](const SessionWeakPtr& ptr){
-            return ptr.expired();
-        });
-        sessions_.erase(it, sessions_.end());
+		// 使用済のセッションはデストラクタで登録簿から外れる
 		Logger::Info("Active connection: %d", GetUserCount());
 	}
 
     void Server::SendAll(const Command& command, int channel, bool limited)
     {
-        BOOST_FOREACH(SessionWeakPtr& ptr, sessions_) {
-            if (auto session = ptr.lock()) {
-				if (channel < 0 || (channel >= 0 && session->channel() == channel)) {
-					if (!limited || session->write_average_limit() > session->GetWriteByteAverage()) {
-						if (session->id() > 0) {
-							session->Send(command);
-						}
+        // 圧縮は一度だけ行い、全セッションで共有する
+        SharedFramePtr frame;
+        BOOST_FOREACH(const SessionPtr& session, registry_.GetChannel(channel)) {
+			if (!limited || session->write_average_limit() > session->GetWriteByteAverage()) {
+				if (session->id() > 0) {
+					if (!frame) {
+						frame = boost::make_shared<const SharedFrame>(command);
 					}
+					session->Send(frame);
 				}
-            }
+			}
         }
     }
 
     void Server::SendOthers(const Command& command, uint32_t self_id, int channel, bool limited)
     {
-        BOOST_FOREACH(SessionWeakPtr& ptr, sessions_) {
-            if (auto session = ptr.lock()) {
-				if (channel < 0 || (channel >= 0 && session->channel() == channel)) {
-					if (!limited || session->write_average_limit() > session->GetWriteByteAverage()) {
-						if (session->id() > 0 && session->id() != self_id) {
-							session->Send(command);
-						}
+        // 圧縮は一度だけ行い、全セッションで共有する
+        SharedFramePtr frame;
+        BOOST_FOREACH(const SessionPtr& session, registry_.GetChannel(channel)) {
+			if (!limited || session->write_average_limit() > session->GetWriteByteAverage()) {
+				if (session->id() > 0 && session->id() != self_id) {
+					if (!frame) {
+						frame = boost::make_shared<const SharedFrame>(command);
 					}
+					session->Send(frame);
 				}
-            }
+			}
         }
     }
 	
     void Server::SendTo(const Command& command, uint32_t user_id)
 	{
-		auto it = std::find_if(sessions_.begin(), sessions_.end(),
-			[user_id](SessionWeakPtr& ptr) -> bool {
-				if (auto session = ptr.lock()) {
-					return session->id() == user_id;
-				} else {
-					return false;
-				}
-			});
-		
-		if (it != sessions_.end()) {
-			if (auto session = it->lock()) {
-				session->Send(command);
-			}
+		if (auto session = registry_.FindByID(user_id)) {
+			session->Send(command);
 		}
 	}
 
+    void Server::DetachUser(UserID user_id)
+    {
+        if (auto session = registry_.FindByID(user_id)) {
+            Logger::Info("Detach session: %d", user_id);
+            session->set_id(0);
+            session->Close();
+        }
+    }
+
+    void Server::LogInUser(const SessionPtr& session, UserID user_id)
+    {
+        boost::mutex::scoped_lock lock(login_mutex_);
+
+        // 同じ鍵で接続したままのセッションは切り離す
+        DetachUser(user_id);
+
+        session->set_id(user_id);
+        account_.LogIn(user_id);
+
+        account_.SetUserIPAddress(user_id, session->global_ip());
+        account_.SetUserUDPPort(user_id, session->udp_port());
+
+        CancelAccountRemoval(user_id);
+    }
+
+    bool Server::LogOutUser(const SessionPtr& session, UserID user_id)
+    {
+        boost::mutex::scoped_lock lock(login_mutex_);
+
+        // 古いセッションの切断が再ログインの後に届いた場合
+        auto current = registry_.FindByID(user_id);
+        if (current && current != session) {
+            return false;
+        }
+
+        account_.LogOut(user_id);
+        ScheduleAccountRemoval(user_id);
+        return true;
+    }
+
+    void Server::QueuePlayerPosition(UserID user_id, unsigned char channel, const PlayerPosition& pos)
+    {
+        // 次の配信までに届いた古い位置は上書きして捨てる
+        boost::mutex::scoped_lock lock(position_mutex_);
+        QueuedPosition& queued = queued_positions_[user_id];
+        queued.channel = channel;
+        queued.pos = pos;
+    }
+
+    void Server::FlushPlayerPositions()
+    {
+        std::map<UserID, QueuedPosition> positions;
+        {
+            boost::mutex::scoped_lock lock(position_mutex_);
+            positions.swap(queued_positions_);
+        }
+
+        const int radius = config()->interest_radius();
+        const int far_interval = std::max(1, config()->interest_far_interval());
+        const bool far_tick = (position_tick_++ % far_interval == 0);
+
+        // チャンネルごとに振り分け
+        std::map<unsigned char, std::vector<PositionEntry>> near_entries, far_entries;
+        BOOST_FOREACH(const auto& pair, positions) {
+            near_entries[pair.second.channel].push_back(std::make_pair(pair.first, pair.second.pos));
+        }
+
+        // 遠方のプレイヤーには前回からの最新の位置だけを間引いて送る
+        if (radius > 0) {
+            BOOST_FOREACH(const auto& pair, positions) {
+                far_positions_[pair.first] = pair.second;
+            }
+            if (far_tick) {
+                BOOST_FOREACH(const auto& pair, far_positions_) {
+                    far_entries[pair.second.channel].push_back(std::make_pair(pair.first, pair.second.pos));
+                    near_entries[pair.second.channel];
+                }
+                far_positions_.clear();
+            }
+        }
+
+        BOOST_FOREACH(const auto& channel, near_entries) {
+            auto sessions = registry_.GetChannel(channel.first);
+
+            if (radius <= 0) {
+                // チャンネル全員分をまとめて送る
+                // 自分自身の位置も含まれるのでクライアント側で無視する
+                BOOST_FOREACH(const SessionPtr& session, sessions) {
+                    if (session->id() > 0 &&
+                        session->write_average_limit() > session->GetWriteByteAverage()) {
+                        SendPlayerPositions(session, channel.second);
+                    }
+                }
+            } else {
+                SendPlayerPositionsInInterest(sessions, channel.second,
+                    far_entries[channel.first]);
+            }
+        }
+    }
+
+    void Server::SendPlayerPositionsInInterest(const std::vector<SessionPtr>& sessions,
+        const std::vector<PositionEntry>& near_entries,
+        const std::vector<PositionEntry>& far_entries)
+    {
+        const int radius = config()->interest_radius();
+        const int far_radius = std::max(radius, config()->interest_far_radius() > 0 ?
+            config()->interest_far_radius() : radius * 2);
+        const int near_range = 1;
+        const int far_range = (far_radius + radius - 1) / radius;
+
+        // チャンネル内の全員の現在位置
+        InterestGrid grid(radius);
+        std::unordered_map<UserID, PlayerPosition> current_positions;
+        BOOST_FOREACH(const SessionPtr& session, sessions) {
+            if (session->id() > 0) {
+                auto pos = account_.GetUserPosition(session->id());
+                current_positions[session->id()] = pos;
+                grid.Insert(session->id(), pos);
+            }
+        }
+
+        // 位置が更新されたプレイヤー
+        InterestGrid near_grid(radius), far_grid(radius);
+        std::unordered_map<UserID, PlayerPosition> near_positions, far_positions;
+        BOOST_FOREACH(const auto& entry, near_entries) {
+            near_grid.Insert(entry.first, entry.second);
+            near_positions[entry.first] = entry.second;
+        }
+        BOOST_FOREACH(const auto& entry, far_entries) {
+            far_grid.Insert(entry.first, entry.second);
+            far_positions[entry.first] = entry.second;
+        }
+
+        // 同じセルにいるセッションには同じ位置を送る
+        struct CellFrames {
+            std::vector<PositionEntry> entries;
+            std::unordered_set<UserID> users;
+        };
+        std::unordered_map<uint32_t, CellFrames> cells;
+
+        BOOST_FOREACH(const SessionPtr& session, sessions) {
+            auto user_id = session->id();
+            auto current = current_positions.find(user_id);
+            if (current == current_positions.end() ||
+                session->write_average_limit() <= session->GetWriteByteAverage()) {
+                continue;
+            }
+
+            auto cell = grid.GetCell(current->second);
+            auto cell_it = cells.find(cell);
+            if (cell_it == cells.end()) {
+                CellFrames& frames = cells[cell];
+                std::vector<UserID> users;
+                near_grid.Query(cell, near_range, &users);
+                BOOST_FOREACH(UserID id, users) {
+                    frames.entries.push_back(std::make_pair(id, near_positions[id]));
+                    frames.users.insert(id);
+                }
+
+                users.clear();
+                far_grid.Query(cell, far_range, &users);
+                BOOST_FOREACH(UserID id, users) {
+                    if (InterestGrid::Distance(cell, far_grid.GetCell(far_positions[id])) > near_range) {
+                        frames.entries.push_back(std::make_pair(id, far_positions[id]));
+                        frames.users.insert(id);
+                    }
+                }
+                cell_it = cells.find(cell);
+            }
+            SendPlayerPositions(session, cell_it->second.entries);
+
+            // 範囲に入ったプレイヤーと出たプレイヤーには現在位置を送る
+            const auto& sent_users = cell_it->second.users;
+            std::vector<UserID> users;
+            grid.Query(cell, far_range, &users);
+            std::unordered_set<UserID> visible_users(users.begin(), users.end());
+            visible_users.erase(user_id);
+
+            auto& known_users = boost::static_pointer_cast<ServerSession>(session)->visible_users();
+            std::vector<PositionEntry> events;
+            BOOST_FOREACH(UserID id, visible_users) {
+                if (known_users.find(id) == known_users.end() &&
+                    sent_users.find(id) == sent_users.end()) {
+                    events.push_back(std::make_pair(id, current_positions[id]));
+                }
+            }
+            BOOST_FOREACH(UserID id, known_users) {
+                if (visible_users.find(id) == visible_users.end()) {
+                    auto it = current_positions.find(id);
+                    if (it != current_positions.end()) {
+                        events.push_back(*it);
+                    }
+                }
+            }
+            known_users.swap(visible_users);
+
+            if (!events.empty()) {
+                // 取りこぼすと次に動くまで位置が古いままになるので確実に届ける
+                SendPlayerPositions(session, events, true);
+            }
+        }
+    }
+
+    void Server::SendPlayerPositions(const SessionPtr& session,
+        const std::vector<PositionEntry>& entries,
+        bool reliable)
+    {
+        if (entries.empty()) {
+            return;
+        }
+
+        auto server_session = boost::static_pointer_cast<ServerSession>(session);
+        if (!reliable && server_session->udp_position()) {
+            // 欠落しても次の更新で上書きされるので、差分ではなく絶対位置をUDPで送る
+            // 1パケットがMTUに収まるように分割する
+            std::string body;
+            int count = 0;
+            BOOST_FOREACH(const auto& entry, entries) {
+                if (entry.first == session->id()) {
+                    continue;
+                }
+                const auto& pos = entry.second;
+                body += ClientUpdatePlayerPosition(entry.first,
+                    pos.x, pos.y, pos.z, pos.theta, pos.vy).body();
+                if (++count >= UDP_POSITION_MAX_ENTRIES) {
+                    SendUDP(session->SerializeDatagram(ClientUpdatePlayerPositionBatch(body), DATAGRAM_SENDER_SERVER),
+                        server_session->udp_endpoint());
+                    body.clear();
+                    count = 0;
+                }
+            }
+            if (count > 0) {
+                SendUDP(session->SerializeDatagram(ClientUpdatePlayerPositionBatch(body), DATAGRAM_SENDER_SERVER),
+                    server_session->udp_endpoint());
+            }
+        } else {
+            // 受信側ごとの基準値からの差分で送る
+            std::vector<PositionDeltaEntry> delta_entries(entries.begin(), entries.end());
+            auto body = server_session->EncodePlayerPositions(delta_entries);
+            if (!body.empty()) {
+                session->Send(ClientUpdatePlayerPositionDelta(body));
+            }
+        }
+    }
+
+    void Server::RequestPositionKeyframe(const SessionPtr& session)
+    {
+        boost::static_pointer_cast<ServerSession>(session)->RequestPositionKeyframe();
+    }
+
     void Server::SendUDPTestPacket(const std::string& ip_address, uint16_t port)
     {
         using boost::asio::ip::udp;
@@ -286,10 +706,10 @@ namespace network {
         udp::resolver::query query(udp::v4(), ip_address.c_str(), port_str.str().c_str());
         udp::resolver::iterator iterator = resolver.resolve(query);
 
-        static char request[] = "MMO UDP Test Packet";
+        static char request[] = UDP_TEST_PACKET_MESSAGE;
         for (int i = 0; i < UDP_TEST_PACKET_TIME; i++) {
 
-            io_service_.post(boost::bind(&Server::DoWriteUDP, this, request, *iterator));
+            udp_strand_.post(boost::bind(&Server::DoWriteUDP, this, request, *iterator));
         }
     }
 
@@ -297,13 +717,13 @@ namespace network {
 	{
 		static char request[] = "P";
 		BOOST_FOREACH(const auto& iterator, lobby_hosts_) {
-			io_service_.post(boost::bind(&Server::DoWriteUDP, this, request, *iterator));
+			udp_strand_.post(boost::bind(&Server::DoWriteUDP, this, request, *iterator));
 		}
 	}
 
     void Server::SendUDP(const std::string& message, const boost::asio::ip::udp::endpoint endpoint)
     {
-		io_service_.post(boost::bind(&Server::DoWriteUDP, this, message, endpoint));
+		udp_strand_.post(boost::bind(&Server::DoWriteUDP, this, message, endpoint));
     }
 
     void Server::ReceiveUDP(const boost::system::error_code& error, size_t bytes_recvd)
@@ -315,9 +735,9 @@ namespace network {
         if (!error) {
           socket_udp_.async_receive_from(
               boost::asio::buffer(receive_buf_udp_, UDP_MAX_RECEIVE_LENGTH), sender_endpoint_,
-              boost::bind(&Server::ReceiveUDP, this,
+              udp_strand_.wrap(boost::bind(&Server::ReceiveUDP, this,
                 boost::asio::placeholders::error,
-                boost::asio::placeholders::bytes_transferred));
+                boost::asio::placeholders::bytes_transferred)));
         } else {
             Logger::Error("%s", error.message());
         }
@@ -330,8 +750,8 @@ namespace network {
 
         socket_udp_.async_send_to(
             boost::asio::buffer(s->data(), s->size()), endpoint,
-            boost::bind(&Server::WriteUDP, this,
-              boost::asio::placeholders::error, s));
+            udp_strand_.wrap(boost::bind(&Server::WriteUDP, this,
+              boost::asio::placeholders::error, s)));
     }
 
     void Server::WriteUDP(const boost::system::error_code& error, boost::shared_ptr<std::string> holder)
@@ -360,26 +780,9 @@ namespace network {
         SessionWeakPtr weak_session;
 
 		// IPアドレスとポートからセッションを特定
-		auto it = std::find_if(sessions_.begin(), sessions_.end(),
-			[&endpoint](const SessionWeakPtr& session) -> bool {
-				if (auto session_ptr = session.lock()) {
-
-					const auto session_endpoint = session_ptr->tcp_socket().remote_endpoint();
-					const auto session_port = session_ptr->udp_port();
-
-					return (session_endpoint.address() == endpoint.address() &&
-						session_port == endpoint.port());
-
-				} else {
-					return false;
-				}
-			});
-
-		if (it != sessions_.end()) {
-			weak_session = *it;
-			if (auto session = weak_session.lock()) {
-				Logger::Debug("Receive UDP Command: %d", session->id());
-			}
+		if (auto session = registry_.FindByUDPEndpoint(endpoint)) {
+			weak_session = session;
+			Logger::Debug("Receive UDP Command: %d", session->id());
 		} else {
 			Logger::Debug("Receive anonymous UDP Command");
 		}
@@ -388,44 +791,148 @@ namespace network {
 			body = buffer.substr(sizeof(header));
 		}
 
-        // 復号
-		if (auto session = weak_session.lock()) {
-			if (header == header::ENCRYPT_HEADER) {
-				body.erase(0, sizeof(header));
-				body = session->encrypter().Decrypt(body);
-				Utils::Deserialize(body, &header);
-				body = buffer.substr(sizeof(header));
+        // 連番付きの暗号化データグラム
+		if (header == header::DATAGRAM_HEADER) {
+			if (auto session = weak_session.lock()) {
+				FetchDatagram(buffer, session);
 			}
+			return;
 		}
 
+		// 暗号化されていないものは送信元を偽れるので、状態の問い合わせ以外は受け付けない
+		// セッションへのコマンドは連番付きのデータグラムでのみ受け取る
 		if (header == network::header::ServerRequstedStatus) {
-			SendUDP(GetStatusJSON(), endpoint);
-		} else {
-			if (callback_) {
-				(*callback_)(Command(static_cast<network::header::CommandHeader>(header), body, weak_session));
+			// 計測値は応答が大きくなるのでループバックからの要求にだけ返す
+			if (!body.empty() && endpoint.address().is_loopback()) {
+				SendUDP(GetExtendedStatusJSON(), endpoint);
+			} else {
+				SendUDP(GetStatusJSON(), endpoint);
 			}
+		} else if (buffer == UDP_TEST_PACKET_MESSAGE) {
+			Logger::Debug("Receive UDP test packet");
+		} else {
+			Logger::Debug("Dropped plain UDP command: 0x%02X", header);
 		}
 
     }
 
+    void Server::FetchDatagram(const std::string& buffer, const SessionPtr& session)
+    {
+        header::CommandHeader header;
+        std::string body;
+        if (session->id() == 0 ||
+            !session->DeserializeDatagram(buffer, DATAGRAM_SENDER_CLIENT, &header, &body)) {
+            return;
+        }
+
+        switch (header) {
+        // クライアントからのUDPが届いたので、以降の位置はUDPでやりとりする
+        case header::ServerStartUDPPosition:
+            if (boost::static_pointer_cast<ServerSession>(session)->EnableUDPPosition()) {
+                Logger::Info("Start UDP position: %d", session->id());
+                session->Send(ClientStartUDPPosition());
+            }
+            break;
+
+        case header::ServerUpdatePlayerPosition:
+            if (callback_) {
+                (*callback_)(Command(header, body, SessionWeakPtr(session)));
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
     void Server::ServerSession::Start()
     {
         online_ = true;
 
+        // 切断済みでも例外を投げないよう、エラーはここでは無視して読み込みの失敗で扱う
+        boost::system::error_code error;
+
         // Nagleアルゴリズムを無効化
-        socket_tcp_.set_option(boost::asio::ip::tcp::no_delay(true));
+        socket_tcp_.set_option(boost::asio::ip::tcp::no_delay(true), error);
 
 		// バッファサイズを変更 1MiB
 		boost::asio::socket_base::receive_buffer_size option(1048576);
-		socket_tcp_.set_option(option);
+		socket_tcp_.set_option(option, error);
 
-        // IPアドレスを取得
-        global_ip_ = socket_tcp_.remote_endpoint().address().to_string();
+        global_ip_ = remote_address_.to_string();
+
+        registry_.Add(shared_from_this(), &entry_);
 
         boost::asio::async_read_until(socket_tcp_,
             receive_buf_, NETWORK_UTILS_DELIMITOR,
-            boost::bind(
+            strand_.wrap(boost::bind(
               &ServerSession::ReceiveTCP, shared_from_this(),
-              boost::asio::placeholders::error));
+              boost::asio::placeholders::error)));
+    }
+
+    Server::ServerSession::~ServerSession()
+    {
+        registry_.Remove(&entry_);
+    }
+
+    void Server::ServerSession::OnOffline()
+    {
+        registry_.SetOffline(&entry_);
+    }
+
+    void Server::ServerSession::OnWrite(const SharedFrame& frame, size_t queue_depth)
+    {
+        metrics_.RecordSend(frame.header(), frame.original_size(), frame.payload().size(), queue_depth);
+    }
+
+    void Server::ServerSession::set_id(UserID id)
+    {
+        Session::set_id(id);
+        registry_.UpdateID(shared_from_this(), &entry_, id);
+    }
+
+    void Server::ServerSession::set_channel(unsigned char channel)
+    {
+        Session::set_channel(channel);
+        registry_.UpdateChannel(shared_from_this(), &entry_, channel);
+    }
+
+    void Server::ServerSession::set_udp_port(uint16_t udp_port)
+    {
+        Session::set_udp_port(udp_port);
+        registry_.UpdateUDPEndpoint(shared_from_this(), &entry_, udp::endpoint(remote_address_, udp_port));
+    }
+
+    std::unordered_set<UserID>& Server::ServerSession::visible_users()
+    {
+        return visible_users_;
+    }
+
+    std::string Server::ServerSession::EncodePlayerPositions(const std::vector<PositionDeltaEntry>& entries)
+    {
+        if (position_keyframe_requested_.exchange(false)) {
+            position_encoder_.RequestKeyframe();
+        }
+        return position_encoder_.Encode(entries, id());
+    }
+
+    void Server::ServerSession::RequestPositionKeyframe()
+    {
+        position_keyframe_requested_ = true;
+    }
+
+    bool Server::ServerSession::EnableUDPPosition()
+    {
+        return !udp_position_.exchange(true);
+    }
+
+    bool Server::ServerSession::udp_position() const
+    {
+        return udp_position_;
+    }
+
+    udp::endpoint Server::ServerSession::udp_endpoint() const
+    {
+        return udp::endpoint(remote_address_, udp_port());
     }
-}
+}
\ No newline at end of file
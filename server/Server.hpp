@@ -6,15 +6,29 @@
 
 #include <string>
 #include <list>
+#include <map>
+#include <unordered_set>
 #include <functional>
 #include <boost/circular_buffer.hpp>
 #include "../common/network/Session.hpp"
 #include "Config.hpp"
+#include "ConfigWatcher.hpp"
 #include "Account.hpp"
 #include "Channel.hpp"
+#include "SessionRegistry.hpp"
+#include "CryptoWorker.hpp"
+#include "TimerWheel.hpp"
+#include "Metrics.hpp"
+#include "MetricsEndpoint.hpp"
+#include "InterestGrid.hpp"
+#include "../common/network/PositionDelta.hpp"
 
 #define UDP_MAX_RECEIVE_LENGTH (2048)
 #define UDP_TEST_PACKET_TIME (5)
+#define POSITION_UPDATE_IDLE_MILLISECONDS (100)
+#define UDP_POSITION_MAX_ENTRIES (100)
+#define ACCOUNT_SNAPSHOT_MAX_BYTES (60000)
+#define ACCOUNT_REMOVE_DELAY_MINUTES (30)
 
 namespace network {
 
@@ -22,10 +36,42 @@ class Server {
     private:
         class ServerSession : public Session {
             public:
-                ServerSession(boost::asio::io_service& io_service) :
-                    Session(io_service) {};
+                // 接続直後に切られると remote_endpoint が失敗するので、受け付けた時点のアドレスを受け取る
+                ServerSession(boost::asio::io_service& io_service, SessionRegistry& registry, Metrics& metrics,
+                    const boost::asio::ip::address& remote_address) :
+                    Session(io_service), registry_(registry), metrics_(metrics), remote_address_(remote_address),
+                    position_keyframe_requested_(false), udp_position_(false) {};
+                ~ServerSession();
 
                 void Start();
+
+                void set_id(UserID id);
+                void set_channel(unsigned char channel);
+                void set_udp_port(uint16_t udp_port);
+
+                // 位置の配信範囲内にいるユーザー 配信スレッドからのみ触る
+                std::unordered_set<UserID>& visible_users();
+                std::string EncodePlayerPositions(const std::vector<PositionDeltaEntry>& entries);
+                void RequestPositionKeyframe();
+
+                // UDPでの位置の送受信 疎通を確認できたセッションのみ
+                bool EnableUDPPosition();
+                bool udp_position() const;
+                udp::endpoint udp_endpoint() const;
+
+            protected:
+                void OnOffline();
+                void OnWrite(const SharedFrame& frame, size_t queue_depth);
+
+            private:
+                SessionRegistry& registry_;
+                Metrics& metrics_;
+                SessionRegistry::Entry entry_;
+                boost::asio::ip::address remote_address_;
+                std::unordered_set<UserID> visible_users_;
+                PositionDeltaEncoder position_encoder_;
+                std::atomic<bool> position_keyframe_requested_;
+                std::atomic<bool> udp_position_;
         };
 
     public:
@@ -38,12 +84,35 @@ class Server {
         void SendOthers(const Command&, uint32_t self_id, int channel = -1, bool limited = false);
         void SendTo(const Command&, uint32_t);
 
+        // 位置は一定間隔でまとめて配信する
+        void QueuePlayerPosition(UserID user_id, unsigned char channel, const PlayerPosition& pos);
+        void FlushPlayerPositions();
+        void RequestPositionKeyframe(const SessionPtr& session);
+
+        // ログアウトしたユーザーの情報を一定時間後に削除する 再ログインしたら取り消す
+        void ScheduleAccountRemoval(UserID user_id);
+        void CancelAccountRemoval(UserID user_id);
+
+        // ユーザーIDを持つセッションからIDを外して切断する ログアウトは通知しない
+        void DetachUser(UserID user_id);
+
+        // 同じIDのセッションを切り離してからログインさせる
+        void LogInUser(const SessionPtr& session, UserID user_id);
+        // 切断したセッションのログアウト 既に別のセッションでログインし直していれば何もせずfalseを返す
+        bool LogOutUser(const SessionPtr& session, UserID user_id);
+
         bool Empty() const;
 		std::string GetStatusJSON() const;
 		std::string GetFullStatus() const;
+		// ループバックからの状態要求には計測値も付けて返す
+		std::string GetExtendedStatusJSON() const;
+		std::string GetMetricsText() const;
 
-		const Config& config() const;
+		std::shared_ptr<const Config> config() const;
 		Account& account();
+		CryptoWorker& crypto_worker();
+		TimerWheel& timer_wheel();
+		Metrics& metrics();
 
 		void AddChatLog(const std::string& msg);
 
@@ -58,34 +127,89 @@ class Server {
 		bool IsBlockedAddress(const boost::asio::ip::address& address);
 
     private:
-        void ReceiveSession(const SessionPtr&, const boost::system::error_code&);
+        void RunIOService();
+        void StartAccept();
+        void ReceiveSession(const boost::system::error_code&);
 
         void ReceiveUDP(const boost::system::error_code& error, size_t bytes_recvd);
         void DoWriteUDP(const std::string& msg, const udp::endpoint& endpoint);
         void WriteUDP(const boost::system::error_code& error, boost::shared_ptr<std::string> holder);
 
         void FetchUDP(const std::string& buffer, const boost::asio::ip::udp::endpoint endpoint);
+        void FetchDatagram(const std::string& buffer, const SessionPtr& session);
+
+        typedef std::pair<UserID, PlayerPosition> PositionEntry;
+
+        void SendPlayerPositionsInInterest(const std::vector<SessionPtr>& sessions,
+            const std::vector<PositionEntry>& near_entries,
+            const std::vector<PositionEntry>& far_entries);
+        void SendPlayerPositions(const SessionPtr& session,
+            const std::vector<PositionEntry>& entries,
+            bool reliable = false);
 
     private:
-	   Config config_;
+	   ConfigWatcher config_watcher_;
 	   Account account_;
+	   CryptoWorker crypto_worker_;
 	   Channel channel_;
 
        boost::asio::io_service io_service_;
        tcp::endpoint endpoint_;
        tcp::acceptor acceptor_;
+       tcp::socket accept_socket_;
 
        udp::socket socket_udp_;
        udp::endpoint sender_endpoint_;
+       boost::asio::io_service::strand udp_strand_;
+
+       Metrics metrics_;
+       std::unique_ptr<MetricsEndpoint> metrics_endpoint_;
+
+       TimerWheel timer_wheel_;
+       boost::mutex account_removal_mutex_;
+       // 再ログインと古いセッションのログアウトが入れ違わないようにする
+       boost::mutex login_mutex_;
+       std::unordered_map<UserID, TimerWheel::TimerID> account_removal_timers_;
 
        char receive_buf_udp_[2048];
        uint8_t udp_packet_count_;
 
        CallbackFuncPtr callback_;
 
-       boost::mutex mutex_;
-       std::list<SessionWeakPtr> sessions_;
-
+       SessionRegistry registry_;
+
+	   struct QueuedPosition {
+		   unsigned char channel;
+		   PlayerPosition pos;
+	   };
+	   boost::mutex position_mutex_;
+	   std::map<UserID, QueuedPosition> queued_positions_;
+
+	   // 配信スレッドからのみ触る
+	   std::map<UserID, QueuedPosition> far_positions_;
+	   unsigned int position_tick_;
+
+	   // サーバー情報は作り直しが必要になるまで直列化済みのものを返す
+	   struct StatusVersion {
+		   StatusVersion() : valid(false), users(0), profiles(0), config(0) {}
+		   bool operator==(const StatusVersion& other) const {
+			   return valid == other.valid && users == other.users &&
+				   profiles == other.profiles && config == other.config;
+		   }
+		   bool valid;
+		   uint32_t users;
+		   uint32_t profiles;
+		   uint32_t config;
+	   };
+	   StatusVersion GetStatusVersion() const;
+
+	   mutable boost::mutex status_mutex_;
+	   mutable StatusVersion full_status_version_;
+	   mutable std::string full_status_;
+	   mutable StatusVersion status_json_version_;
+	   mutable std::string status_json_;
+
+	   boost::mutex chat_log_mutex_;
 	   boost::circular_buffer<std::string> recent_chat_log_;
 	   std::list<udp::resolver::iterator> lobby_hosts_;
 
@@ -0,0 +1,243 @@
+//
+// SessionRegistry.cpp
+//
+
+#include "SessionRegistry.hpp"
+#include <boost/foreach.hpp>
+#include <boost/functional/hash.hpp>
+
+namespace network {
+
+    size_t UDPEndpointHash::operator()(const udp::endpoint& endpoint) const
+    {
+        size_t seed = 0;
+        const auto& address = endpoint.address();
+        if (address.is_v4()) {
+            boost::hash_combine(seed, address.to_v4().to_ulong());
+        } else {
+            const auto bytes = address.to_v6().to_bytes();
+            boost::hash_range(seed, bytes.begin(), bytes.end());
+        }
+        boost::hash_combine(seed, endpoint.port());
+        return seed;
+    }
+
+    //
+    // 注意: ロック中にweak_ptrから取り出したポインタを破棄すると、
+    // それが最後の参照だった場合にデストラクタからRemoveが呼ばれてデッドロックする。
+    // 取り出したポインタは必ず呼び出し元に返すこと。
+    //
+
+    SessionRegistry::SessionRegistry() :
+        user_count_(0),
+        version_(0)
+    {
+    }
+
+    void SessionRegistry::Add(const SessionPtr& session, Entry* entry)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (entry->registered_) {
+            return;
+        }
+
+        entry->session_ = session.get();
+        entry->registered_ = true;
+        entry->id_ = session->id();
+        entry->channel_ = session->channel();
+
+        entry->all_it_ = sessions_.insert(sessions_.end(), session);
+        auto& channel_list = channels_[entry->channel_];
+        entry->channel_it_ = channel_list.insert(channel_list.end(), session);
+
+        if (entry->id_ > 0) {
+            InsertID(session, entry);
+            UpdateCount(entry, session->online());
+        }
+    }
+
+    void SessionRegistry::Remove(Entry* entry)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (!entry->registered_) {
+            return;
+        }
+
+        sessions_.erase(entry->all_it_);
+        channels_[entry->channel_].erase(entry->channel_it_);
+        EraseID(entry);
+        EraseUDPEndpoint(entry);
+        UpdateCount(entry, false);
+        entry->registered_ = false;
+    }
+
+    void SessionRegistry::UpdateID(const SessionPtr& session, Entry* entry, UserID id)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (!entry->registered_) {
+            return;
+        }
+
+        bool changed = (entry->id_ != id);
+        EraseID(entry);
+        entry->id_ = id;
+        if (id > 0) {
+            InsertID(session, entry);
+        }
+
+        UpdateCount(entry, id > 0 && session->online());
+        if (changed) {
+            version_++;
+        }
+    }
+
+    void SessionRegistry::UpdateChannel(const SessionPtr& session, Entry* entry, unsigned char channel)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (!entry->registered_ || entry->channel_ == channel) {
+            return;
+        }
+
+        auto& old_list = channels_[entry->channel_];
+        auto& new_list = channels_[channel];
+        new_list.splice(new_list.end(), old_list, entry->channel_it_);
+        entry->channel_ = channel;
+    }
+
+    void SessionRegistry::UpdateUDPEndpoint(const SessionPtr& session, Entry* entry, const udp::endpoint& endpoint)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (!entry->registered_) {
+            return;
+        }
+
+        EraseUDPEndpoint(entry);
+        entry->udp_endpoint_ = endpoint;
+        Ref ref = {entry->session_, session, entry};
+        udp_endpoints_[endpoint] = ref;
+    }
+
+    SessionPtr SessionRegistry::FindByID(UserID id) const
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        auto it = ids_.find(id);
+        if (it != ids_.end()) {
+            return it->second.weak.lock();
+        } else {
+            return SessionPtr();
+        }
+    }
+
+    SessionPtr SessionRegistry::FindByUDPEndpoint(const udp::endpoint& endpoint) const
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        auto it = udp_endpoints_.find(endpoint);
+        if (it != udp_endpoints_.end()) {
+            return it->second.weak.lock();
+        } else {
+            return SessionPtr();
+        }
+    }
+
+    std::vector<SessionPtr> SessionRegistry::GetChannel(int channel) const
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        const SessionList* list = &sessions_;
+        if (channel >= 0) {
+            auto it = channels_.find(static_cast<unsigned char>(channel));
+            if (it == channels_.end()) {
+                return std::vector<SessionPtr>();
+            }
+            list = &it->second;
+        }
+
+        std::vector<SessionPtr> result;
+        result.reserve(list->size());
+        BOOST_FOREACH(const auto& weak, *list) {
+            result.push_back(weak.lock());
+            if (!result.back()) {
+                result.pop_back();
+            }
+        }
+        return result;
+    }
+
+    std::vector<SessionPtr> SessionRegistry::GetLoggedIn() const
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        std::vector<SessionPtr> result;
+        result.reserve(ids_.size());
+        BOOST_FOREACH(const auto& pair, ids_) {
+            result.push_back(pair.second.weak.lock());
+            if (!result.back()) {
+                result.pop_back();
+            }
+        }
+        return result;
+    }
+
+    void SessionRegistry::SetOffline(Entry* entry)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (entry->registered_) {
+            UpdateCount(entry, false);
+        }
+    }
+
+    int SessionRegistry::GetUserCount() const
+    {
+        return user_count_;
+    }
+
+    int SessionRegistry::GetSessionCount() const
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        return sessions_.size();
+    }
+
+    uint32_t SessionRegistry::GetVersion() const
+    {
+        return version_;
+    }
+
+    void SessionRegistry::UpdateCount(Entry* entry, bool counted)
+    {
+        if (entry->counted_ != counted) {
+            entry->counted_ = counted;
+            user_count_ += counted ? 1 : -1;
+            version_++;
+        }
+    }
+
+    void SessionRegistry::InsertID(const SessionPtr& session, Entry* entry)
+    {
+        // 同じIDで先に登録されていたセッションは数えない
+        // 数えるのはidsに載っているセッションだけにして、ids_.size()とずれないようにする
+        auto it = ids_.find(entry->id_);
+        if (it != ids_.end() && it->second.entry != entry) {
+            UpdateCount(it->second.entry, false);
+        }
+        Ref ref = {entry->session_, session, entry};
+        ids_[entry->id_] = ref;
+    }
+
+    void SessionRegistry::EraseID(Entry* entry)
+    {
+        // 同じIDで後から登録されたセッションは消さない
+        auto it = ids_.find(entry->id_);
+        if (it != ids_.end() && it->second.raw == entry->session_) {
+            ids_.erase(it);
+        }
+    }
+
+    void SessionRegistry::EraseUDPEndpoint(Entry* entry)
+    {
+        auto it = udp_endpoints_.find(entry->udp_endpoint_);
+        if (it != udp_endpoints_.end() && it->second.raw == entry->session_) {
+            udp_endpoints_.erase(it);
+        }
+    }
+
+}
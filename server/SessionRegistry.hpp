@@ -0,0 +1,94 @@
+//
+// SessionRegistry.hpp
+//
+
+#pragma once
+
+#include <list>
+#include <map>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <boost/thread.hpp>
+#include "../common/network/Session.hpp"
+
+namespace network {
+
+// UDPエンドポイントのハッシュ
+struct UDPEndpointHash {
+    size_t operator()(const udp::endpoint& endpoint) const;
+};
+
+// ユーザーID・チャンネル・UDPエンドポイントで索引したセッションの登録簿
+class SessionRegistry {
+    public:
+        typedef std::list<SessionWeakPtr> SessionList;
+
+        // 登録簿内での位置 セッション側で保持し、O(1)で付け替える
+        class Entry {
+            public:
+                Entry() : session_(nullptr), registered_(false), counted_(false), id_(0), channel_(0) {}
+
+            private:
+                friend class SessionRegistry;
+                Session* session_;
+                bool registered_;
+                bool counted_;
+                UserID id_;
+                unsigned char channel_;
+                udp::endpoint udp_endpoint_;
+                SessionList::iterator all_it_;
+                SessionList::iterator channel_it_;
+        };
+
+    public:
+        SessionRegistry();
+
+        void Add(const SessionPtr& session, Entry* entry);
+        void Remove(Entry* entry);
+
+        void UpdateID(const SessionPtr& session, Entry* entry, UserID id);
+        void UpdateChannel(const SessionPtr& session, Entry* entry, unsigned char channel);
+        void UpdateUDPEndpoint(const SessionPtr& session, Entry* entry, const udp::endpoint& endpoint);
+        void SetOffline(Entry* entry);
+
+        SessionPtr FindByID(UserID id) const;
+        SessionPtr FindByUDPEndpoint(const udp::endpoint& endpoint) const;
+
+        // channelが負の場合は全セッション
+        std::vector<SessionPtr> GetChannel(int channel) const;
+        std::vector<SessionPtr> GetLoggedIn() const;
+
+        // ログイン中でオンラインのセッション数 登録簿の変更時に数え直す
+        int GetUserCount() const;
+        int GetSessionCount() const;
+
+        // ログイン中のセッションの顔ぶれが変わるたびに増える
+        uint32_t GetVersion() const;
+
+    private:
+        void UpdateCount(Entry* entry, bool counted);
+        void InsertID(const SessionPtr& session, Entry* entry);
+        void EraseID(Entry* entry);
+        void EraseUDPEndpoint(Entry* entry);
+
+    private:
+        // 破棄中のセッションを識別するため生ポインタも保持する
+        struct Ref {
+            Session* raw;
+            SessionWeakPtr weak;
+            Entry* entry;
+        };
+
+        mutable boost::mutex mutex_;
+
+        SessionList sessions_;
+        std::map<unsigned char, SessionList> channels_;
+        std::unordered_map<UserID, Ref> ids_;
+        std::unordered_map<udp::endpoint, Ref, UDPEndpointHash> udp_endpoints_;
+
+        std::atomic<int> user_count_;
+        std::atomic<uint32_t> version_;
+};
+
+}
@@ -0,0 +1,211 @@
+//
+// TimerWheel.cpp
+//
+
+#include "TimerWheel.hpp"
+#include "../common/Logger.hpp"
+
+namespace network {
+
+    using namespace boost::posix_time;
+
+    static const uint64_t NEAR_SIZE = 1 << TIMER_WHEEL_NEAR_BITS;
+    static const uint64_t FAR_MASK = (1 << TIMER_WHEEL_FAR_BITS) - 1;
+
+    static int GetLevelShift(int level)
+    {
+        return TIMER_WHEEL_NEAR_BITS + (level - 1) * TIMER_WHEEL_FAR_BITS;
+    }
+
+    TimerWheel::TimerWheel(boost::asio::io_service& io_service) :
+        timer_(io_service),
+        running_(false),
+        current_tick_(0),
+        next_id_(1),
+        scheduled_(0),
+        fired_(0),
+        cancelled_(0)
+    {
+    }
+
+    void TimerWheel::Start()
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (running_) {
+            return;
+        }
+        running_ = true;
+
+        // 起動前に登録されたものも含めて、ここを0tick目とする
+        start_time_ = microsec_clock::universal_time() - milliseconds(current_tick_ * TIMER_WHEEL_TICK_MILLISECONDS);
+        Wait();
+    }
+
+    void TimerWheel::Stop()
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        running_ = false;
+        timer_.cancel();
+    }
+
+    TimerWheel::TimerID TimerWheel::Schedule(const time_duration& delay, const Handler& handler)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        uint64_t ticks = (std::max<int64_t>(0, delay.total_milliseconds())
+            + TIMER_WHEEL_TICK_MILLISECONDS - 1) / TIMER_WHEEL_TICK_MILLISECONDS;
+
+        Entry entry;
+        entry.id = next_id_++;
+        entry.expires = current_tick_ + ticks;
+        entry.level = 0;
+        entry.slot = 0;
+        entry.handler = handler;
+
+        Slot temp;
+        temp.push_back(entry);
+        auto it = temp.begin();
+        Insert(temp, it);
+
+        timers_[entry.id] = it;
+        scheduled_++;
+        return entry.id;
+    }
+
+    bool TimerWheel::Cancel(TimerID id)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        auto it = timers_.find(id);
+        if (it == timers_.end()) {
+            return false;
+        }
+
+        GetSlot(it->second->level, it->second->slot).erase(it->second);
+        timers_.erase(it);
+        cancelled_++;
+        return true;
+    }
+
+    TimerWheel::Stats TimerWheel::stats() const
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        Stats stats;
+        stats.pending = timers_.size();
+        stats.scheduled = scheduled_;
+        stats.fired = fired_;
+        stats.cancelled = cancelled_;
+        return stats;
+    }
+
+    void TimerWheel::Wait()
+    {
+        // 開始時刻からの経過で次の時刻を決めるので、処理が遅れても誤差が積み重ならない
+        timer_.expires_at(start_time_ + milliseconds(current_tick_ * TIMER_WHEEL_TICK_MILLISECONDS));
+        timer_.async_wait(boost::bind(&TimerWheel::OnTick, this, boost::asio::placeholders::error));
+    }
+
+    void TimerWheel::OnTick(const boost::system::error_code& error)
+    {
+        if (error) {
+            return;
+        }
+
+        std::vector<Handler> expired;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            if (!running_) {
+                return;
+            }
+
+            auto elapsed = (microsec_clock::universal_time() - start_time_).total_milliseconds();
+            uint64_t target_tick = std::max<int64_t>(0, elapsed) / TIMER_WHEEL_TICK_MILLISECONDS;
+            while (current_tick_ <= target_tick) {
+                Step(&expired);
+            }
+            Wait();
+        }
+
+        // ハンドラからScheduleやCancelを呼べるようにロックの外で実行する
+        for (auto it = expired.begin(); it != expired.end(); ++it) {
+            try {
+                (*it)();
+            } catch (std::exception& e) {
+                Logger::Error("%s", e.what());
+            }
+        }
+    }
+
+    void TimerWheel::Insert(Slot& from, Slot::iterator it)
+    {
+        Entry& entry = *it;
+        if (entry.expires < current_tick_) {
+            entry.expires = current_tick_;
+        }
+        uint64_t delta = entry.expires - current_tick_;
+
+        if (delta < NEAR_SIZE) {
+            entry.level = 0;
+            entry.slot = static_cast<int>(entry.expires & (NEAR_SIZE - 1));
+        } else {
+            for (int level = 1; level <= TIMER_WHEEL_FAR_LEVELS; level++) {
+                uint64_t range = 1ull << (GetLevelShift(level) + TIMER_WHEEL_FAR_BITS);
+                if (delta < range || level == TIMER_WHEEL_FAR_LEVELS) {
+                    // 最上位の段に収まらないものは上限に丸める
+                    if (delta >= range) {
+                        entry.expires = current_tick_ + range - 1;
+                    }
+                    entry.level = level;
+                    entry.slot = static_cast<int>((entry.expires >> GetLevelShift(level)) & FAR_MASK);
+                    break;
+                }
+            }
+        }
+
+        Slot& to = GetSlot(entry.level, entry.slot);
+        to.splice(to.end(), from, it);
+    }
+
+    int TimerWheel::Cascade(int level)
+    {
+        // 上の段の1スロット分を下の段に振り分け直す
+        int index = static_cast<int>((current_tick_ >> GetLevelShift(level)) & FAR_MASK);
+
+        Slot temp;
+        temp.splice(temp.end(), GetSlot(level, index));
+        while (!temp.empty()) {
+            Insert(temp, temp.begin());
+        }
+        return index;
+    }
+
+    void TimerWheel::Step(std::vector<Handler>* expired)
+    {
+        int index = static_cast<int>(current_tick_ & (NEAR_SIZE - 1));
+        if (index == 0) {
+            for (int level = 1; level <= TIMER_WHEEL_FAR_LEVELS; level++) {
+                if (Cascade(level) != 0) {
+                    break;
+                }
+            }
+        }
+        current_tick_++;
+
+        Slot& slot = near_[index];
+        for (auto it = slot.begin(); it != slot.end(); ++it) {
+            expired->push_back(it->handler);
+            timers_.erase(it->id);
+            fired_++;
+        }
+        slot.clear();
+    }
+
+    TimerWheel::Slot& TimerWheel::GetSlot(int level, int slot)
+    {
+        if (level == 0) {
+            return near_[slot];
+        } else {
+            return far_[level - 1][slot];
+        }
+    }
+
+}
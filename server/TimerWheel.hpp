@@ -0,0 +1,89 @@
+//
+// TimerWheel.hpp
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#define TIMER_WHEEL_TICK_MILLISECONDS (100)
+#define TIMER_WHEEL_NEAR_BITS (8)
+#define TIMER_WHEEL_FAR_BITS (6)
+#define TIMER_WHEEL_FAR_LEVELS (3)
+
+namespace network {
+
+// 階層型タイマーホイール
+// 多数の長いタイムアウトを1つのdeadline_timerでまとめて扱う
+class TimerWheel {
+    public:
+        typedef uint64_t TimerID;
+        typedef std::function<void()> Handler;
+
+        struct Stats {
+            size_t pending;
+            uint64_t scheduled;
+            uint64_t fired;
+            uint64_t cancelled;
+        };
+
+    public:
+        TimerWheel(boost::asio::io_service& io_service);
+
+        void Start();
+        void Stop();
+
+        // delay後にio_serviceのスレッドでhandlerを呼ぶ
+        TimerID Schedule(const boost::posix_time::time_duration& delay, const Handler& handler);
+        // 既に呼ばれたものや存在しないものはfalse
+        bool Cancel(TimerID id);
+
+        Stats stats() const;
+
+    private:
+        struct Entry {
+            TimerID id;
+            uint64_t expires;
+            int level;
+            int slot;
+            Handler handler;
+        };
+        typedef std::list<Entry> Slot;
+
+        void Wait();
+        void OnTick(const boost::system::error_code& error);
+
+        void Insert(Slot& from, Slot::iterator it);
+        int Cascade(int level);
+        void Step(std::vector<Handler>* expired);
+        Slot& GetSlot(int level, int slot);
+
+    private:
+        boost::asio::deadline_timer timer_;
+        boost::posix_time::ptime start_time_;
+        bool running_;
+
+        // 次に処理するtick
+        uint64_t current_tick_;
+
+        Slot near_[1 << TIMER_WHEEL_NEAR_BITS];
+        Slot far_[TIMER_WHEEL_FAR_LEVELS][1 << TIMER_WHEEL_FAR_BITS];
+
+        std::unordered_map<TimerID, Slot::iterator> timers_;
+        TimerID next_id_;
+
+        uint64_t scheduled_;
+        uint64_t fired_;
+        uint64_t cancelled_;
+
+        mutable boost::mutex mutex_;
+};
+
+}
@@ -0,0 +1,293 @@
+//
+// UtilsBench.cpp
+//
+// network::Utils のマイクロベンチマーク
+// make bench で実行する
+//
+
+#include "../../common/network/Utils.hpp"
+#include "../../common/database/AccountProperty.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+#include <boost/random.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace network;
+using namespace boost::posix_time;
+
+// 1回分の確保量を数えるため、このプログラム内の new/delete を置き換える
+// lz4 内部の malloc は数えない
+namespace {
+    std::atomic<uint64_t> allocated_bytes(0);
+    std::atomic<uint64_t> allocated_count(0);
+}
+
+void* operator new(size_t size)
+{
+    allocated_bytes += size;
+    allocated_count++;
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) throw()
+{
+    std::free(p);
+}
+
+void operator delete[](void* p) throw()
+{
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) throw()
+{
+    std::free(p);
+}
+
+void operator delete[](void* p, size_t) throw()
+{
+    std::free(p);
+}
+
+namespace {
+
+    // 1回の計測で最低限回す時間と、計測の繰り返し数
+    // 結果は繰り返しの中央値
+    int min_time_ms = 50;
+    const int REPEAT_COUNT = 5;
+
+    const size_t PAYLOAD_SIZES[] = {8, 64, 512, 4096, 65536};
+
+    // 最適化で処理が消えないように結果を流し込む
+    volatile size_t sink;
+
+    // 位置: ClientUpdatePlayerPositionBatch と同じ並び
+    std::string MakePosition(size_t size, boost::mt19937& random)
+    {
+        std::string out;
+        while (out.size() < size) {
+            out += Utils::Serialize((uint32_t)(random() % 1000),
+                    (int16_t)(random() % 2000 - 1000), (int16_t)(random() % 200),
+                    (int16_t)(random() % 2000 - 1000), (uint8_t)random(), (uint8_t)(random() % 16));
+        }
+        out.resize(size);
+        return out;
+    }
+
+    // チャット: ClientReceiveJSON で流れる本文
+    std::string MakeChat(size_t size, boost::mt19937& random)
+    {
+        const char* bodies[] = {"こんにちは", "hello", "ミクさん！", "おつかれさまです", "w"};
+        std::string out;
+        while (out.size() < size) {
+            out += (boost::format("{\"id\":%d,\"name\":\"user%d\",\"trip\":\"\",\"body\":\"%s #%d\"}")
+                    % (random() % 1000) % (random() % 1000) % bodies[random() % 5] % random()).str();
+        }
+        out.resize(size);
+        return out;
+    }
+
+    // リビジョンパッチ: Account::GetUserRevisionPatch と同じ並び
+    std::string MakeRevisionPatch(size_t size, boost::mt19937& random)
+    {
+        std::string out;
+        while (out.size() < size) {
+            std::string public_key(140, 0);
+            std::generate(public_key.begin(), public_key.end(), [&random](){ return (char)random(); });
+
+            out += Utils::Serialize((uint32_t)(random() % 1000), (uint32_t)(random() % 100));
+            out += Utils::Serialize((uint16_t)NAME, std::string("ミク"));
+            out += Utils::Serialize((uint16_t)MODEL_NAME, std::string("初音ミク.pmd"));
+            out += Utils::Serialize((uint16_t)PUBLIC_KEY, public_key);
+            out += Utils::Serialize((uint16_t)LOGIN, (uint8_t)1);
+        }
+        out.resize(size);
+        return out;
+    }
+
+    std::string MakeRandom(size_t size, boost::mt19937& random)
+    {
+        std::string out(size, 0);
+        std::generate(out.begin(), out.end(), [&random](){ return (char)random(); });
+        return out;
+    }
+
+    struct Content {
+        const char* name;
+        std::function<std::string(size_t, boost::mt19937&)> make;
+    };
+
+    struct Operation {
+        const char* name;
+        // 入力を前処理したものを返す 計測対象の処理には含めない
+        std::function<std::string(const std::string&)> prepare;
+        std::function<size_t(const std::string&, const std::string&)> run;
+    };
+
+    struct Result {
+        uint64_t iterations;
+        double ns_per_op;
+        double spread;
+        double bytes_per_op;
+        double allocs_per_op;
+    };
+
+    Result Measure(const Operation& operation, const std::string& payload)
+    {
+        const std::string input = operation.prepare(payload);
+
+        // 1回の計測が min_time_ms を超える回数を見積もる
+        uint64_t iterations = 1;
+        while (true) {
+            auto start = microsec_clock::universal_time();
+            for (uint64_t i = 0; i < iterations; i++) {
+                sink = operation.run(input, payload);
+            }
+            auto elapsed = (microsec_clock::universal_time() - start).total_microseconds();
+            if (elapsed >= min_time_ms * 1000 || iterations >= (1ULL << 40)) {
+                break;
+            }
+            iterations *= elapsed > 0 ? std::min<uint64_t>(10, std::max<uint64_t>(2, min_time_ms * 2000 / elapsed)) : 10;
+        }
+
+        std::vector<double> samples;
+        uint64_t bytes = 0, count = 0;
+        for (int r = 0; r < REPEAT_COUNT; r++) {
+            uint64_t bytes_before = allocated_bytes, count_before = allocated_count;
+            auto start = microsec_clock::universal_time();
+            for (uint64_t i = 0; i < iterations; i++) {
+                sink = operation.run(input, payload);
+            }
+            auto elapsed = (microsec_clock::universal_time() - start).total_microseconds();
+            samples.push_back(elapsed * 1000.0 / iterations);
+            bytes += allocated_bytes - bytes_before;
+            count += allocated_count - count_before;
+        }
+
+        std::sort(samples.begin(), samples.end());
+        Result result;
+        result.iterations = iterations;
+        result.ns_per_op = samples[REPEAT_COUNT / 2];
+        result.spread = result.ns_per_op > 0 ? (samples.back() - samples.front()) / result.ns_per_op : 0;
+        result.bytes_per_op = (double)bytes / (iterations * REPEAT_COUNT);
+        result.allocs_per_op = (double)count / (iterations * REPEAT_COUNT);
+        return result;
+    }
+
+    std::string Identity(const std::string& in)
+    {
+        return in;
+    }
+
+    void usage()
+    {
+        std::fprintf(stderr,
+            "Usage: utils_bench [options]\n"
+            "  --filter TEXT   run only the benchmarks whose name contains TEXT\n"
+            "  --time MS       minimum time of one measurement (50)\n");
+    }
+
+}
+
+int main(int argc, char* argv[])
+{
+    std::string filter;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (std::strcmp(argv[i], "--time") == 0 && i + 1 < argc) {
+            min_time_ms = std::max(1, std::atoi(argv[++i]));
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    Content contents[] = {
+        {"position", MakePosition},
+        {"chat", MakeChat},
+        {"patch", MakeRevisionPatch},
+        {"random", MakeRandom},
+    };
+
+    Operation operations[] = {
+        // Commandの組み立てと同じく、ヘッダーとユーザーIDに本文を続ける
+        {"Serialize", Identity,
+            [](const std::string&, const std::string& payload) {
+                return Utils::Serialize((uint16_t)0x07, (uint32_t)1, payload).size();
+            }},
+        {"Deserialize",
+            [](const std::string& payload) { return Utils::Serialize((uint16_t)0x07, (uint32_t)1, payload); },
+            [](const std::string& input, const std::string&) {
+                uint16_t header;
+                uint32_t user_id;
+                std::string body;
+                Utils::Deserialize(input, &header, &user_id, &body);
+                return body.size();
+            }},
+        {"ByteStuffingEncode", Identity,
+            [](const std::string& input, const std::string&) { return Utils::ByteStuffingEncode(input).size(); }},
+        {"ByteStuffingDecode", Utils::ByteStuffingEncode,
+            [](const std::string& input, const std::string&) { return Utils::ByteStuffingDecode(input).size(); }},
+        {"LZ4Compress", Identity,
+            [](const std::string& input, const std::string&) { return Utils::LZ4Compress(input).size(); }},
+        {"LZ4Uncompress", Utils::LZ4Compress,
+            [](const std::string& input, const std::string& payload) {
+                return Utils::LZ4Uncompress(input, payload.size()).size();
+            }},
+        {"Base64Encode", Identity,
+            [](const std::string& input, const std::string&) { return Utils::Base64Encode(input).size(); }},
+        {"Base64Decode", Utils::Base64Encode,
+            [](const std::string& input, const std::string&) { return Utils::Base64Decode(input).size(); }},
+        {"ConvertEndian", Identity,
+            [](const std::string& input, const std::string&) { return Utils::ConvertEndian(input).size(); }},
+        // 一致しないことが多いパターンで最後まで走査させる
+        // c_strで比較するので、NULを含む入力はその手前までになる
+        {"MatchWithWildcard", Identity,
+            [](const std::string& input, const std::string&) {
+                return (size_t)Utils::MatchWithWildcard("*\"body\":*#*9", input);
+            }},
+    };
+
+    std::printf("%-48s %12s %12s %10s %10s %10s %8s\n",
+            "benchmark", "iterations", "ns/op", "MB/s", "B/op", "allocs/op", "spread");
+
+    for (auto operation = std::begin(operations); operation != std::end(operations); ++operation) {
+        for (auto content = std::begin(contents); content != std::end(contents); ++content) {
+            for (auto size = std::begin(PAYLOAD_SIZES); size != std::end(PAYLOAD_SIZES); ++size) {
+                auto name = (boost::format("%s/%s/%d") % operation->name % content->name % *size).str();
+                if (!filter.empty() && name.find(filter) == std::string::npos) {
+                    continue;
+                }
+
+                // 毎回同じ入力になるように種を固定する
+                boost::mt19937 random(*size);
+                auto payload = content->make(*size, random);
+                auto result = Measure(*operation, payload);
+
+                std::printf("%-48s %12llu %12.1f %10.1f %10.1f %10.2f %7.1f%%\n",
+                        name.c_str(), (unsigned long long)result.iterations, result.ns_per_op,
+                        result.ns_per_op > 0 ? *size * 1000.0 / result.ns_per_op : 0.0,
+                        result.bytes_per_op, result.allocs_per_op, result.spread * 100);
+                std::fflush(stdout);
+            }
+        }
+    }
+
+    return 0;
+}
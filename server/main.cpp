@@ -7,12 +7,13 @@
 #include <ctime>
 #include <boost/format.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
-#include <boost/property_tree/json_parser.hpp>
+#include <boost/thread/tss.hpp>
 #include <boost/foreach.hpp>
 #include "version.hpp"
 #include "Server.hpp"
 #include "../common/network/Encrypter.hpp"
 #include "../common/network/Signature.hpp"
+#include "../common/network/JsonScanner.hpp"
 #include "../common/database/AccountProperty.hpp"
 #include "../common/Logger.hpp"
 #include "Config.hpp"
@@ -32,6 +33,12 @@ using namespace boost::posix_time;
 
 void client_sync(network::Server& server);
 void public_ping(network::Server& server);
+void position_update(network::Server& server);
+void send_common_key(network::Server& server, network::Signature& sign,
+    const network::SessionPtr& session, uint32_t user_id);
+void refuse_crowded(network::Server& server, const network::SessionPtr& session);
+void send_account_snapshot(network::Server& server, const network::SessionPtr& session);
+std::string chat_info_json(uint32_t user_id);
 void server();
 
 int main(int argc, char* argv[])
@@ -57,12 +64,22 @@ int main(int argc, char* argv[])
 
 void server()
 {
+    auto start_time = microsec_clock::universal_time();
 
     // 署名
     network::Signature sign("server_key");
 
     // アカウント
     network::Server server;
+    if (!server.config()->account_journal().empty()) {
+        server.account().OpenJournal(server.config()->account_journal());
+    }
+
+    // RSA鍵ペアの在庫
+    if (server.config()->key_pool_size() > 0) {
+        network::Encrypter::set_key_pool(
+            std::make_shared<network::KeyPool>(server.config()->key_pool_size()));
+    }
 
     auto callback = std::make_shared<std::function<void(network::Command)>>(
             [&server, &sign](network::Command c){
@@ -113,29 +130,34 @@ void server()
 					break;
 				}
 				
-				std::stringstream message_json(network::Utils::Deserialize<std::string>(c.body()));
+				auto message_json = network::Utils::Deserialize<std::string>(c.body());
 
-				using namespace boost::property_tree;
-				ptree message_tree;
-				json_parser::read_json(message_json, message_tree);
-
-				// プライベートメッセージの処理
+				// 転送先と本文だけを取り出す
 				std::list<uint32_t> destination_list;
-				auto private_list_tree =  message_tree.get_child("private", ptree());
-				BOOST_FOREACH(const auto& user_id, private_list_tree) {
-					destination_list.push_back(user_id.second.get_value<uint32_t>());
+				network::JsonScanner::Value body;
+				network::JsonScanner scanner(message_json);
+				network::JsonScanner::Value key, value;
+				while (scanner.NextMember(&key, &value)) {
+					if (key.Equals("private") && value.type == network::JsonScanner::TYPE_ARRAY) {
+						network::JsonScanner private_list(value);
+						network::JsonScanner::Value user_id_value;
+						while (private_list.NextElement(&user_id_value)) {
+							uint32_t user_id;
+							if (user_id_value.ToUInt32(&user_id)) {
+								destination_list.push_back(user_id);
+							}
+						}
+					} else if (key.Equals("body")) {
+						body = value;
+					}
 				}
 
-                ptime now = second_clock::universal_time();
-                auto time_string = to_iso_extended_string(now);
-
-                std::string info_json;
-                info_json += "{";
-                info_json += (boost::format("\"id\":\"%d\",") % id).str();
-                info_json += (boost::format("\"time\":\"%s\"") % time_string).str();
-                info_json += "}";
+				if (scanner.error()) {
+					Logger::Error(_T("Invalid JSON message"));
+					break;
+				}
 
-				auto send_command = network::ClientReceiveJSON(info_json, message_json.str());
+				auto send_command = network::ClientReceiveJSON(chat_info_json(id), message_json);
 
 				if (destination_list.size() > 0) {
 					BOOST_FOREACH(uint32_t user_id, destination_list) {
@@ -143,13 +165,14 @@ void server()
 					}
 				} else {
 					auto name = server.account().GetUserName(id);
-					auto body = message_tree.get<std::string>("body", std::string());
-					server.AddChatLog((boost::format("[%s] %s") % name % body).str());
+					std::string body_text;
+					body.ToString(&body_text);
+					server.AddChatLog("[" + name + "] " + body_text);
 
 					server.SendAll(send_command, session->channel());
 				}
 
-				Logger::Info("Receive JSON: %s", message_json.str());
+				Logger::Info("Receive JSON: %s", message_json);
             }
         }
             break;
@@ -162,8 +185,21 @@ void server()
                 PlayerPosition pos;
                 network::Utils::Deserialize(c.body(), &pos.x, &pos.y, &pos.z, &pos.theta, &pos.vy);
                 server.account().SetUserPosition(session->id(), pos);
-                server.SendOthers(network::ClientUpdatePlayerPosition(session->id(),
-					pos.x,pos.y,pos.z,pos.theta, pos.vy), session->id(), session->channel(), true);
+                if (server.config()->position_update_rate() > 0) {
+                    server.QueuePlayerPosition(session->id(), session->channel(), pos);
+                } else {
+                    server.SendOthers(network::ClientUpdatePlayerPosition(session->id(),
+                        pos.x,pos.y,pos.z,pos.theta, pos.vy), session->id(), session->channel(), true);
+                }
+            }
+        }
+            break;
+
+        // 位置の差分の基準値をリセット
+        case network::header::ServerRequestedPositionKeyframe:
+        {
+            if (auto session = c.session().lock()) {
+                server.RequestPositionKeyframe(session);
             }
         }
             break;
@@ -174,11 +210,9 @@ void server()
             if (auto session = c.session().lock()) {
 
 				// 最大接続数を超えていないか判定
-				if (server.GetUserCount() >= server.config().capacity()) {
-					Logger::Info("Refused Session");
-					session->SyncSend(network::ClientReceiveServerCrowdedError());
-					session->Close();
-
+				if (server.GetUserCount() >= server.config()->capacity()) {
+					refuse_crowded(server, session);
+					return;
 				}
 
 				session->ResetReadByteAverage();
@@ -190,11 +224,18 @@ void server()
                 network::Utils::Deserialize(c.body(), &finger_print, &version, &udp_port);
 
                 // クライアントのプロトコルバージョンをチェック
-                if (version != MMO_PROTOCOL_VERSION) {
+                if (version < MMO_PROTOCOL_VERSION_MIN || version > MMO_PROTOCOL_VERSION) {
                     Logger::Info("Unsupported Client Version : v%d", version);
+                    server.metrics().RecordRefused(network::Metrics::REFUSED_VERSION);
                     session->Send(network::ClientReceiveUnsupportVersionError(1));
                     return;
                 }
+                session->set_protocol_version(version);
+
+                // 長さ付きフレームに切り替え
+                // クライアントはClientInfoの直後から長さ付きフレームで送ってくる
+                session->EnableReceiveLengthFraming();
+                session->SendAndEnableLengthFraming(network::ClientStartLengthFraming());
 
                 // UDPパケットの宛先を設定
                 session->set_udp_port(udp_port);
@@ -210,17 +251,15 @@ void server()
                     session->Send(network::ClientRequestedPublicKey());
                 } else {
                     uint32_t user_id = static_cast<uint32_t>(id);
-                    // ログイン
-                    session->set_id(user_id);
-                    server.account().LogIn(user_id);
-                    session->encrypter().SetPublicKey(server.account().GetPublicKey(user_id));
 
-                    server.account().SetUserIPAddress(session->id(), session->global_ip());
-                    server.account().SetUserUDPPort(session->id(), session->udp_port());
+                    // フィンガープリントは誰でも知りうるので、まだログインさせない
+                    // 共通鍵を復号できたことを確かめてからログインする
+                    auto public_key = server.account().GetPublicKey(user_id);
+                    session->set_pending_public_key(public_key);
+                    session->encrypter().SetPublicKey(public_key);
 
                     // 共通鍵を送り返す
-                    auto key = session->encrypter().GetCryptedCommonKey();
-                    session->Send(network::ClientReceiveCommonKey(key, sign.Sign(key), user_id));
+                    send_common_key(server, sign, session, user_id);
 
                 }
                 Logger::Info(msg);
@@ -233,23 +272,27 @@ void server()
         {
             if (auto session = c.session().lock()) {
 				auto public_key = network::Utils::Deserialize<std::string>(c.body());
-                uint32_t user_id = server.account().RegisterPublicKey(public_key);
-
-				assert(user_id > 0);
 
 				session->ResetReadByteAverage();
 
-                // ログイン
-                session->set_id(user_id);
-                server.account().LogIn(user_id);
-                session->encrypter().SetPublicKey(server.account().GetPublicKey(user_id));
-
-                server.account().SetUserIPAddress(session->id(), session->global_ip());
-                server.account().SetUserUDPPort(session->id(), session->udp_port());
-
-                // 共通鍵を送り返す
-                auto key = session->encrypter().GetCryptedCommonKey();
-                session->Send(network::ClientReceiveCommonKey(key, sign.Sign(key), user_id));
+                // フィンガープリントの計算と鍵の読み込みはワーカーで行う
+                // 登録は共通鍵を復号できたことを確かめてから行うので、ここでは引くだけ
+                auto user_id = std::make_shared<uint32_t>(0);
+                bool posted = server.crypto_worker().Post(session,
+                    [&server, session, public_key, user_id](){
+                        session->encrypter().SetPublicKey(public_key);
+                        *user_id = server.account().GetUserIdFromFingerPrint(
+                            network::Encrypter::GetHash(public_key));
+                    },
+                    [&server, &sign, session, public_key, user_id](){
+                        session->set_pending_public_key(public_key);
+
+                        // 共通鍵を送り返す 未登録ならIDは0
+                        send_common_key(server, sign, session, *user_id);
+                    });
+                if (!posted) {
+                    refuse_crowded(server, session);
+                }
 
             }
             Logger::Info(msg);
@@ -260,11 +303,39 @@ void server()
         case network::header::ServerStartEncryptedSession:
         {
             if (auto session = c.session().lock()) {
-				
-				session->Send(network::ClientReceiveServerInfo(server.config().stage()));
-
-                session->Send(network::ClientStartEncryptedSession());
-                session->EnableEncryption();
+                // 共通鍵は公開鍵で暗号化して送ったので、復号できたなら秘密鍵の持ち主
+                auto public_key = session->pending_public_key();
+                std::string proof;
+                if (!c.body().empty()) {
+                    proof = network::Utils::Deserialize<std::string>(c.body());
+                }
+                if (public_key.empty() || proof != session->encrypter().GetCommonKeyProof()) {
+                    Logger::Info("Invalid common key proof");
+                    session->Close();
+                    break;
+                }
+                session->set_pending_public_key(std::string());
+
+                // 未登録の鍵ならここで初めてIDを発行する
+                auto user_id = std::make_shared<uint32_t>(0);
+                bool posted = server.crypto_worker().Post(session,
+                    [&server, public_key, user_id](){
+                        *user_id = server.account().RegisterPublicKey(public_key);
+                    },
+                    [&server, session, user_id](){
+                        assert(*user_id > 0);
+
+                        // ログイン
+                        server.LogInUser(session, *user_id);
+
+                        session->Send(network::ClientReceiveServerInfo(server.config()->stage()));
+
+                        session->Send(network::ClientStartEncryptedSession(*user_id));
+                        session->EnableEncryption();
+                    });
+                if (!posted) {
+                    refuse_crowded(server, session);
+                }
 
                 Logger::Info(msg);
             }
@@ -276,18 +347,28 @@ void server()
         {
             if (auto session = c.session().lock()) {
 				auto data = network::Utils::Deserialize<std::string>(c.body());
-                server.account().LoadInitializeData(session->id(), data);
+                std::string trip;
+                server.account().LoadInitializeData(session->id(), data, &trip);
 
-                const auto& list = server.account().GetIDList();
-                BOOST_FOREACH(UserID user_id, list) {
-                    session->Send(network::ClientReceiveAccountRevisionUpdateNotify(user_id,
-                            server.account().GetUserRevision(user_id)));
+                if (trip.empty()) {
+                    send_account_snapshot(server, session);
+                } else {
+                    // トリップの計算は重いのでワーカーで行い、アカウント情報はその後に送る
+                    auto user_id = session->id();
+                    bool posted = server.crypto_worker().Post(session,
+                        [&server, user_id, trip](){
+                            server.account().SetUserTrip(user_id, trip);
+                        },
+                        [&server, session](){
+                            send_account_snapshot(server, session);
+                        });
+                    if (!posted) {
+                        // ログイン済みなので切断はせず、トリップの設定だけを見送る
+                        Logger::Error("Crypto queue is full, trip is not changed: %d", user_id);
+                        send_account_snapshot(server, session);
+                    }
                 }
 
-                server.SendOthers(
-                        network::ClientReceiveAccountRevisionUpdateNotify(session->id(),
-                                server.account().GetUserRevision(session->id())), session->id());
-
                 Logger::Info(msg);
             }
         }
@@ -318,6 +399,7 @@ void server()
                 network::Utils::Deserialize(c.body(), &property);
 
                 auto old_revision = server.account().GetUserRevision(session->id());
+                bool notify = true;
 
                 switch (property) {
 
@@ -332,7 +414,26 @@ void server()
                     {
 						std::string value;
 						network::Utils::Deserialize(buffer, &value);
-                        server.account().SetUserTrip(session->id(), value);
+
+                        // トリップの計算は重いのでワーカーで行い、通知もその後に送る
+                        auto user_id = session->id();
+                        bool posted = server.crypto_worker().Post(session,
+                            [&server, user_id, value](){
+                                server.account().SetUserTrip(user_id, value);
+                            },
+                            [&server, user_id, old_revision](){
+                                auto new_revison = server.account().GetUserRevision(user_id);
+                                if (new_revison > old_revision) {
+                                    server.SendAll(
+                                            network::ClientReceiveAccountRevisionUpdateNotify(
+                                            user_id, new_revison));
+                                }
+                            });
+                        if (!posted) {
+                            // ログイン済みなので切断はせず、トリップの変更だけを見送る
+                            Logger::Error("Crypto queue is full, trip is not changed: %d", user_id);
+                        }
+                        notify = false;
                     }
                     break;
                 case MODEL_NAME:
@@ -356,7 +457,7 @@ void server()
                 }
 
                 auto new_revison = server.account().GetUserRevision(session->id());
-                if (new_revison > old_revision) {
+                if (notify && new_revison > old_revision) {
                     server.SendAll(
                             network::ClientReceiveAccountRevisionUpdateNotify(
                             session->id(),new_revison));
@@ -372,14 +473,15 @@ void server()
         {
             if (c.body().size() > 0) {
                 uint32_t user_id = network::Utils::Deserialize<uint32_t>(c.body());
-                server.account().LogOut(user_id);
-
-                server.SendAll(
-                        network::ClientReceiveAccountRevisionUpdateNotify(user_id,
-                                server.account().GetUserRevision(user_id)));
+                if (server.LogOutUser(c.session().lock(), user_id)) {
+                    server.SendAll(
+                            network::ClientReceiveAccountRevisionUpdateNotify(user_id,
+                                    server.account().GetUserRevision(user_id)));
 
-                Logger::Info("Logout User: %d", user_id);
-				server.account().Remove(user_id);
+                    Logger::Info("Logout User: %d", user_id);
+                } else {
+                    Logger::Info("Logout skipped, logged in again: %d", user_id);
+                }
             }
         }
         Logger::Info(msg);
@@ -393,13 +495,110 @@ void server()
 
 	client_sync(server);
 
-	if (server.config().is_public()) {
+	if (server.config()->is_public()) {
 		public_ping(server);
 	}
 
+	position_update(server);
+
+    Logger::Info("Startup time: %d ms", (microsec_clock::universal_time() - start_time).total_milliseconds());
     server.Start(callback);
 }
 
+void send_common_key(network::Server& server, network::Signature& sign,
+    const network::SessionPtr& session, uint32_t user_id)
+{
+    // RSAでの暗号化と署名は重いのでワーカーで行う
+    auto key = std::make_shared<std::string>();
+    auto signature = std::make_shared<std::string>();
+    bool posted = server.crypto_worker().Post(session,
+        [&sign, session, key, signature](){
+            *key = session->encrypter().GetCryptedCommonKey();
+            *signature = sign.Sign(*key);
+        },
+        [session, key, signature, user_id](){
+            session->Send(network::ClientReceiveCommonKey(*key, *signature, user_id));
+        });
+    if (!posted) {
+        refuse_crowded(server, session);
+    }
+}
+
+void refuse_crowded(network::Server& server, const network::SessionPtr& session)
+{
+    Logger::Info("Refused Session");
+    server.metrics().RecordRefused(network::Metrics::REFUSED_CROWDED);
+    session->SyncSend(network::ClientReceiveServerCrowdedError());
+    session->Close();
+}
+
+void send_account_snapshot(network::Server& server, const network::SessionPtr& session)
+{
+    // 全ユーザーの情報をまとめて送る 圧縮前の長さに上限があるので大きければ分割する
+    const auto& list = server.account().GetIDList();
+    std::string snapshot;
+    BOOST_FOREACH(UserID user_id, list) {
+        auto patch = server.account().GetUserRevisionPatch(user_id, 0);
+        if (patch.empty()) {
+            continue;
+        }
+        patch = network::Utils::Serialize(patch);
+        if (!snapshot.empty() && snapshot.size() + patch.size() > ACCOUNT_SNAPSHOT_MAX_BYTES) {
+            session->Send(network::ClientReceiveAccountSnapshot(snapshot));
+            snapshot.clear();
+        }
+        snapshot += patch;
+    }
+    if (!snapshot.empty()) {
+        session->Send(network::ClientReceiveAccountSnapshot(snapshot));
+    }
+
+    server.SendOthers(
+            network::ClientReceiveAccountRevisionUpdateNotify(session->id(),
+                    server.account().GetUserRevision(session->id())), session->id());
+}
+
+std::string chat_info_json(uint32_t user_id)
+{
+    // 送信時刻は秒単位なので、同じ秒の間はスレッドごとに文字列を使い回す
+    struct TimeCache {
+        TimeCache() : time(0) {}
+        std::time_t time;
+        std::string text;
+    };
+    static boost::thread_specific_ptr<TimeCache> cache;
+    if (!cache.get()) {
+        cache.reset(new TimeCache());
+    }
+
+    std::time_t now = std::time(nullptr);
+    if (now != cache->time) {
+        cache->time = now;
+        cache->text = to_iso_extended_string(from_time_t(now));
+    }
+
+    char id_text[10];
+    char* id_begin = id_text + sizeof(id_text);
+    do {
+        *--id_begin = '0' + user_id % 10;
+        user_id /= 10;
+    } while (user_id > 0);
+
+    // {"id":"%d","time":"%s"}
+    static const char prefix[] = "{\"id\":\"";
+    static const char middle[] = "\",\"time\":\"";
+    static const char suffix[] = "\"}";
+
+    std::string info_json;
+    info_json.reserve(sizeof(prefix) + sizeof(id_text) + sizeof(middle) + cache->text.size() + sizeof(suffix));
+    info_json.append(prefix, sizeof(prefix) - 1);
+    info_json.append(id_begin, id_text + sizeof(id_text));
+    info_json.append(middle, sizeof(middle) - 1);
+    info_json.append(cache->text);
+    info_json.append(suffix, sizeof(suffix) - 1);
+    return info_json;
+}
+
 void public_ping(network::Server& server)
 {
     boost::thread([&server](){
@@ -410,6 +609,20 @@ void public_ping(network::Server& server)
     });
 }
 
+void position_update(network::Server& server)
+{
+    // position_update_rateは設定の再読み込みで変わるので、毎回読み直す
+    // 0の間も、切り替わる前に溜まった位置を流すために動かし続ける
+    boost::thread([&server](){
+        while (1) {
+            int rate = server.config()->position_update_rate();
+            boost::this_thread::sleep(boost::posix_time::milliseconds(
+                rate > 0 ? std::max(1, 1000 / rate) : POSITION_UPDATE_IDLE_MILLISECONDS));
+            server.FlushPlayerPositions();
+        }
+    });
+}
+
 void client_sync(network::Server& server)
 {
     bool execute_with_client;
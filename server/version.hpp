@@ -11,7 +11,13 @@
 #define MMO_VERSION_MINOR 3
 #define MMO_VERSION_REVISION 0
 
-#define MMO_PROTOCOL_VERSION 3
+#define MMO_PROTOCOL_VERSION 8
+
+// 接続を受け付ける最も古いプロトコルバージョン
+// 8より前のクライアントは共通鍵を受け取れたことを証明せず、
+// 他人のフィンガープリントでログインできてしまうので受け付けない
+// そのため長さ付きフレーム、位置の差分符号化、アカウント情報の一括送信は常に使う
+#define MMO_PROTOCOL_VERSION_MIN 8
 
 #ifdef MMO_VERSION_BUILD
 #define MMO_VERSION_BUILD_TEXT " Build " MMO_VERSION_TOSTRING(MMO_VERSION_BUILD)